@@ -49,10 +49,43 @@ class Mmap
       #
       #  length:: maps <em>length</em> bytes from the file
       #
-      #  offset:: the mapping begin at <em>offset</em>
+      #  offset:: the mapping begin at <em>offset</em>, which doesn't need
+      #  to be aligned on a page
       #
       #  advice:: the type of the access (see #madvise)
       #
+      #  increment:: the minimum number of bytes added when the map grows
+      #
+      #  growth:: the map grows by <em>size * (growth - 1)</em> bytes
+      #  (default 2.0, i.e. the size is doubled). With 1.0 only
+      #  <em>increment</em> is used
+      #
+      #  max_increment:: upper limit for a geometric growth step
+      #  (default 64 Mb, 0 means no limit)
+      #
+      #  readahead:: size of the window prefetched in background ahead of
+      #  the current position of #each_line, #each_byte and #scan
+      #  (<em>true</em> means 8 Mb)
+      #
+      #  populate:: fault in all the pages before returning : with
+      #  MAP_POPULATE for a small map, or with MADV_POPULATE_READ or
+      #  MADV_POPULATE_WRITE split across several threads (see
+      #  #populate). <em>:read</em> or <em>:write</em> select the
+      #  access, <em>true</em> is :write for an anonymous map and :read
+      #  otherwise
+      #
+      #  memfd:: an anonymous map is backed by a file created with
+      #  memfd_create(2) (<em>memfd</em> can be its name), which accept
+      #  the seals (see #seal) and can be given to other processes with
+      #  #to_io
+      #
+      #  hugepages:: <em>true</em> map an anonymous map with huge pages
+      #  (MAP_HUGETLB), or with transparent huge pages when none is
+      #  reserved; <em>:transparent</em> only advise MADV_HUGEPAGE; a
+      #  size (2 Mb, 1 Gb) select the huge pages of this size. The
+      #  length is rounded to a multiple of the huge pages. A file in
+      #  hugetlbfs is always mapped with its huge pages
+      #
       #
       def  new(file, mode = "r", protection = Mmap::MAP_SHARED, options = {})
       end
@@ -61,6 +94,13 @@ class Mmap
       #
       def  unlockall
       end
+
+      #map the file descriptor <em>fd</em> (an Integer or an IO), for
+      #example a "memfd" map received with UNIXSocket#recv_io.
+      #<em>fd</em> is not closed
+      #
+      def  from_fd(fd, mode = "r", options = {})
+      end
    end
    
    #add <em>count</em> bytes to the file (i.e. pre-extend the file) 
@@ -71,8 +111,16 @@ class Mmap
    #<em>advice</em> can have the value <em>Mmap::MADV_NORMAL</em>,
    #<em>Mmap::MADV_RANDOM</em>, <em>Mmap::MADV_SEQUENTIAL</em>,
    #<em>Mmap::MADV_WILLNEED</em>, <em>Mmap::MADV_DONTNEED</em>
+   #and, when the system define them, <em>Mmap::MADV_HUGEPAGE</em>,
+   #<em>Mmap::MADV_NOHUGEPAGE</em>, <em>Mmap::MADV_FREE</em>,
+   #<em>Mmap::MADV_COLD</em>, <em>Mmap::MADV_PAGEOUT</em>,
+   #<em>Mmap::MADV_POPULATE_READ</em>, <em>Mmap::MADV_POPULATE_WRITE</em>,
+   #<em>Mmap::MADV_DONTFORK</em>, <em>Mmap::MADV_DOFORK</em>
+   #
+   #With <em>offset</em> and <em>length</em> the advice is only given
+   #for the pages which contain this range
    #
-   def  madvise(advice)
+   def  madvise(advice, offset = nil, length = nil)
    end
    
    #change the mode, value must be "r", "w" or "rw"
@@ -85,12 +133,275 @@ class Mmap
    def  mlock
    end
    
-   #flush the file
+   #flush the file. With <em>offset</em> and <em>length</em> only
+   #the pages which contain this range are written, otherwise only
+   #the pages modified by this object (see #dirty_ranges), or all the
+   #map for an IPC map and a map used by #log_init, #log_append or the
+   #atomic methods, which the other processes write too. The pages that
+   #another process has modified with []= are written by its own
+   #msync, or with an explicit range
    #
-   def  msync
+   #  msync(flag = Mmap::MS_SYNC)
+   #  msync(offset, length, flag = Mmap::MS_SYNC)
+   #
+   def  msync(*args)
    end
    #same than <em> msync</em>
-   def  flush
+   def  flush(*args)
+   end
+
+   #start to write back the pages which contain the range and return
+   #immediately a <em>Mmap::Flush</em> object. Without argument the range
+   #covers all the modified pages (all the map in the cases given
+   #for #msync), when no page was modified the Flush is already
+   #done. If the write back fail, the pages are marked again as
+   #modified
+   #
+   def  flush_async(offset = nil, length = nil)
+   end
+
+   #read in background the pages which contain this range
+   #(all the map by default) and return immediately
+   #
+   #  prefetch(offset = nil, length = nil)
+   #  prefetch(range)
+   #
+   def  prefetch(*args)
+   end
+
+   #return a new IO on the file of the map, for example to give a
+   #"memfd" map to another process with UNIXSocket#send_io
+   #
+   def  to_io
+   end
+
+   #add the seals to a "memfd" map : :seal, :shrink, :grow, :write,
+   #:future_write or the values <em>Mmap::F_SEAL_*</em>. With :write the
+   #map is first remapped read-only, and frozen. The other writable maps
+   #of the file must be unmapped before
+   #
+   def  seal(*seals)
+   end
+
+   #return the seals of the file (the values <em>Mmap::F_SEAL_*</em>)
+   #
+   def  seals
+   end
+
+   #fault in the pages which contain this range (all the map by
+   #default), and return when they are all mapped
+   #
+   #  populate(offset = nil, length = nil, options = {})
+   #  populate(range, options = {})
+   #
+   #The options are
+   #
+   #threads:: the number of threads (by default one for each 64 Mb, at
+   #most one for each processor)
+   #
+   #write:: populate the pages for writing (MADV_POPULATE_WRITE), raise
+   #ArgumentError for a read-only map
+   #
+   def  populate(*args)
+   end
+
+   #return the number of <em>byte</em> (an Integer or a String of
+   #one character) in the range
+   #
+   #  count_byte(byte, offset = nil, length = nil)
+   #  count_byte(byte, range)
+   #
+   def  count_byte(byte, *args)
+   end
+
+   #return the number of lines, i.e. the number of "\n" plus one if
+   #the file don't end with "\n"
+   #
+   def  line_count
+   end
+
+   #build an index of the start of each line ("\n"), in parallel for
+   #a large file, and return the number of lines. The index is
+   #extended when the file grows, and truncated when the file is
+   #modified with a method of Mmap
+   #
+   #With <em>path</em> the index is stored (and mapped) in this file,
+   #and reused by the next call if the file was only extended. The
+   #device, the inode and a hash of the start and the end of the
+   #indexed bytes are recorded, and the stored offsets are checked
+   #against all the indexed bytes (a scan for "\n", much faster than
+   #a build) : an index of another file, or of a file rewritten
+   #since, is rebuilt
+   def  build_line_index(path = nil)
+   end
+
+   #return the line <em>n</em> (with its "\n"), or nil. The index is
+   #built by the first call if <em>build_line_index</em> was not called
+   def  line(n)
+   end
+
+   #return an Array with the lines in the range, or nil
+   #
+   #  lines(range)
+   #  lines(start, length)
+   def  lines(range)
+   end
+
+   #yield a Mmap::Batch which queue the edits, and apply them in one
+   #pass when the block returns : the file is resized at most once and
+   #each byte is moved at most once. Nothing is modified if the block
+   #raise an exception
+   def  batch
+      yield batch
+   end
+
+   #take the lock of a map created with <em>"ipc"</em>, yield and
+   #release it. The lock is exclusive : it wait until the readers
+   #(see #read_lock) have released their lock. If <em>wait</em> is
+   #false, or if the lock is not obtained after <em>"timeout"</em> =>
+   #seconds, raise Errno::EAGAIN. The other threads run while the
+   #process wait
+   #
+   #The lock belongs to the thread : it is recursive for this thread,
+   #and the other threads wait like the other processes. A thread
+   #which ask for it inside its own #read_lock get a ThreadError
+   def  semlock(wait = true, options = {})
+      yield
+   end
+   #same than <em> semlock</em>
+   def  write_lock(wait = true, options = {})
+      yield
+   end
+
+   #take a shared lock : several processes can hold it at the same
+   #time, but not with #semlock. While a writer wait, the new readers
+   #wait too, so that they can't starve it. The methods which don't
+   #modify the map take it. The arguments are the same than
+   #for #semlock
+   def  read_lock(wait = true, options = {})
+      yield
+   end
+
+   #lock the bytes <em>[offset, offset + length)</em> of the file (to
+   #the end of the file if <em>length</em> is 0), yield and release the
+   #lock. The processes which lock disjoint ranges don't wait for each
+   #other. Return the value of the block
+   #
+   #* <em>"shared"</em> => true
+   #  take a read lock, several processes can hold it
+   #
+   #* <em>"wait"</em> => false
+   #  raise Errno::EAGAIN instead of waiting
+   #
+   #The lock is an open file description lock (F_OFD_SETLKW), so the
+   #threads of a process exclude each other, and closing another
+   #descriptor of the file don't release it. Without them raise
+   #NotImplementedError. The other threads run while the process wait
+   def  lock_range(offset, length, options = {})
+      yield
+   end
+
+   #return the number at <em>offset</em>, read directly in the map.
+   #<em>order</em> is :native, :little, :big or :network
+   #
+   #The same methods exist for the types u8, i8, u16, i16, u32, i32,
+   #u64, i64, f32 and f64
+   def  get_u32(offset, order = :native)
+   end
+
+   #write <em>value</em> at <em>offset</em> directly in the map. Raise
+   #RangeError if <em>value</em> don't fit in the integer type
+   #
+   #The same methods exist for the types u8, i8, u16, i16, u32, i32,
+   #u64, i64, f32 and f64
+   def  put_u32(offset, value, order = :native)
+   end
+
+   #return a <em>Mmap::ArrayView</em> over <em>count</em> numbers (all
+   #the numbers up to the end of the map by default) at
+   #<em>offset</em>, which must be aligned in memory on the size of the
+   #type (for a map with an unaligned <em>"offset"</em>, the address of
+   #the map plus <em>offset</em>). <em>type</em> is :int8, :uint8, :int16, :uint16, :int32, :uint32,
+   #:int64, :uint64, :float32 or :float64 (native byte order)
+   #
+   def  array_view(type, offset = 0, count = nil)
+   end
+
+   #return the <em>Mmap::Records</em> with <em>layout</em> at
+   #<em>offset</em> : <em>count</em> records, or all the complete
+   #records up to the end of the map
+   #
+   def  records(layout, offset = 0, count = nil)
+   end
+
+   #format the map as an append log, which use the current size of
+   #the map (see #extend). Nothing is done if the map is already a log,
+   #unless <em>reset</em> is true. It must be called before the
+   #producers start. The map must start at an address aligned on 8
+   #bytes
+   def  log_init(reset = false)
+   end
+
+   #append a record to the log and return its offset. Several
+   #processes can append at the same time without lock : the space is
+   #reserved with an atomic add on the tail stored in the header of the
+   #log, then the record is published with a commit marker.
+   #Raise IndexError if the log is full
+   def  log_append(str)
+   end
+
+   #yield the records of the log from <em>offset</em> (the first record
+   #by default) with the offset of the next record. Stop at the first
+   #record which is not yet committed, and return its offset
+   def  log_each(offset = nil)
+      yield record, next_offset
+   end
+
+   #read atomically the integer (signed, native byte order) of
+   #<em>width</em> bytes (4 or 8) at <em>offset</em>, which must be
+   #aligned in memory on <em>width</em>. The methods which write raise
+   #RangeError for a value which doesn't fit in <em>width</em> bytes
+   def  atomic_load(offset, width = 8)
+   end
+
+   #write atomically <em>value</em> at <em>offset</em>
+   def  atomic_store(offset, value, width = 8)
+   end
+
+   #add atomically <em>value</em> to the integer at <em>offset</em>,
+   #and return the new value
+   def  atomic_add(offset, value, width = 8)
+   end
+
+   #write atomically <em>value</em> at <em>offset</em> if the integer
+   #is <em>expected</em>, and return <em>true</em> if it was written
+   def  compare_and_swap(offset, expected, value, width = 8)
+   end
+
+   #return the fraction (between 0.0 and 1.0) of the pages of the range
+   #which are in memory
+   #
+   def  residency(offset = nil, length = nil)
+   end
+
+   #return the list of the ranges <em>[offset, length]</em> which are in
+   #memory. The offsets are relative to the start of the map, like
+   #<em>offset</em>, and the ranges cover whole pages clipped to the map
+   #
+   def  resident_ranges(offset = nil, length = nil)
+   end
+
+   #return a String with one bit for each page of the range (the bit
+   #<em>n % 8</em> of the byte <em>n / 8</em> for the page <em>n</em>),
+   #set when the page is in memory
+   #
+   def  residency_bitmap(offset = nil, length = nil)
+   end
+
+   #return the list of the ranges <em>[offset, length]</em> (page aligned)
+   #modified since the last #msync
+   #
+   def  dirty_ranges
    end
    
    #reenable paging
@@ -236,13 +547,27 @@ class Mmap
       yield char
    end
    
-   #iterate on each line
+   #iterate on each line. The map is scanned in place, without
+   #creating a String for the whole file
+   #
+   #<em>options</em> is a Hash
+   #
+   #* <em>"chomp"</em> => true
+   #  remove the separator from each line
    #
-   def  each(rs = $/)  
+   #* <em>"offsets"</em> => true
+   #  yield <em>offset, length</em> instead of a String
+   #
+   #* <em>"shared"</em> => true
+   #  yield a frozen String which point directly in the map (it
+   #  must not be used after the map is unmapped or remapped)
+   #
+   #return an Enumerator when called without a block
+   def  each(rs = $/, options = {})  
       yield line
    end
    #same than <em> each</em>
-   def  each_line(rs = $/)  
+   def  each_line(rs = $/, options = {})  
       yield line
    end
    
@@ -393,4 +718,230 @@ class Mmap
    end
 
 
+   #Object returned by Mmap#flush_async
+   class Flush
+
+      #return <em>true</em> if the write back is finished
+      #
+      def  done?
+      end
+
+      #wait until the write back is finished
+      #
+      def  wait
+      end
+   end
+
+   #Object given by Mmap#batch. The offsets refer to the content
+   #before the batch, and the edits must not overlap. The insertions at
+   #the same offset are applied in the order of the calls, before a
+   #replacement or a deletion at this offset
+   class Batch
+
+      #replace <em>length</em> bytes at <em>offset</em> with <em>str</em>
+      #
+      def  replace(offset, length, str)
+      end
+
+      #insert <em>str</em> at <em>offset</em>
+      #
+      def  insert(offset, str)
+      end
+
+      #remove <em>length</em> bytes at <em>offset</em>
+      #
+      def  delete(offset, length)
+      end
+
+      #return the number of queued edits
+      #
+      def  size
+      end
+   end
+
+   #Object given by <em>Mmap#array_view</em>. The reductions are
+   #computed natively (with SSE2 or AVX2 for the types float64,
+   #float32 and int32), by several threads for the large views
+   class ArrayView
+      include Enumerable
+
+      #return the number at <em>index</em>, or nil
+      #
+      def  [](index)
+      end
+
+      #write <em>value</em> at <em>index</em>
+      #
+      def  []=(index, value)
+      end
+
+      #return the number of elements
+      #
+      def  size
+      end
+
+      #iterate on the numbers
+      #
+      def  each
+         yield x
+      end
+
+      #return the sum of the numbers (modulo 2**64 for the integer types)
+      #
+      def  sum
+      end
+
+      #return the mean of the numbers, or nil if the view is empty
+      #
+      def  mean
+      end
+
+      #return the smallest number, or nil if the view is empty
+      #
+      def  min
+      end
+
+      #return the largest number, or nil if the view is empty
+      #
+      def  max
+      end
+
+      #return the number of elements <em>x</em> for which <em>x op
+      #value</em> is true, <em>op</em> is one of :<, :<=, :>, :>=, :==
+      #or :!=. Without argument return the size. The comparison is
+      #exact : for the integer types it is done in the type of the view,
+      #not in Float
+      #
+      def  count(op = nil, value = nil)
+      end
+
+      #return an Array with the number of elements in each of the
+      #<em>bins</em> intervals of the same width between <em>min</em>
+      #and <em>max</em>
+      #
+      def  histogram(bins, min = self.min, max = self.max)
+      end
+   end
+
+   #Description of a fixed-size record, compiled in a table of offsets
+   class Layout
+
+      #<em>fields</em> is a Hash (an Array of pairs with ruby 1.8, where
+      #the Hash are not ordered) which give for each name the type of
+      #the field : :u8, :i8, :u16, :i16, :u32, :i32, :u64, :i64, :f32,
+      #:f64 or [:bytes, length]. The fields are packed without padding
+      #
+      #  Mmap::Layout.define(id: :u64, ts: :i64, score: :f32, name: [:bytes, 16])
+      def  self.define(fields, order = :native)
+      end
+
+      #return the size of a record
+      #
+      def  size
+      end
+
+      #return the names of the fields
+      #
+      def  fields
+      end
+
+      #return the offset of <em>field</em> in a record
+      #
+      def  offset(field)
+      end
+   end
+
+   #Object given by <em>Mmap#records</em>. The fields are read and
+   #written directly in the map
+   class Records
+
+      #return the value of <em>field</em> in the record <em>index</em>,
+      #or a Hash with all the fields without <em>field</em>
+      #
+      def  [](index, field = nil)
+      end
+
+      #write <em>value</em> in <em>field</em> of the record
+      #<em>index</em>. A String shorter than a bytes field is padded
+      #with "\0"
+      #
+      def  []=(index, field, value)
+      end
+
+      #return a String with the values of <em>field</em> in all the
+      #records, packed one after the other (in the native byte order
+      #for the numbers)
+      #
+      def  column(field)
+      end
+
+      #return the number of records
+      #
+      def  size
+      end
+
+      #return the <em>Mmap::Layout</em> of the records
+      #
+      def  layout
+      end
+   end
+
+   #Sequential access to a file of any size through a window which
+   #follow the cursor : the window is remapped when the cursor leaves
+   #it, and the pages behind the cursor are released (MADV_DONTNEED)
+   class Window
+
+      #open <em>file</em> (a path or an IO) for reading through a
+      #window of <em>size</em> bytes
+      #
+      def  self.new(file, size = 64 * 1024 * 1024)
+      end
+
+      #read at most <em>length</em> bytes (up to the end of the file by
+      #default) from the cursor, return nil at the end of the file
+      #
+      def  read(length = nil)
+      end
+
+      #read the next line, return nil at the end of the file
+      #
+      def  gets(rs = $/)
+      end
+
+      #iterate on the lines from the cursor
+      #
+      def  each_line(rs = $/)
+         yield line
+      end
+
+      #return the position of the cursor
+      #
+      def  pos
+      end
+
+      #move the cursor to <em>offset</em>
+      #
+      def  pos=(offset)
+      end
+
+      #return the size of the file
+      #
+      def  size
+      end
+
+      #return true when the cursor is at the end of the file
+      #
+      def  eof?
+      end
+
+      #return the offset and the length of the mapped part of the file
+      #
+      def  window
+      end
+
+      #unmap the window and close the file
+      #
+      def  close
+      end
+   end
 end
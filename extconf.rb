@@ -19,8 +19,19 @@ if enable_config("ipc")
    unless have_func("semctl") && have_func("shmctl")
       $stderr.puts "\tIPC will not be available"
    end
+   have_func("semtimedop")
 end
 
+have_func("mremap")
+have_func("rb_thread_call_without_gvl2", "ruby/thread.h")
+if have_header("pthread.h")
+   have_library("pthread", "pthread_create")
+end
+have_func("sync_file_range")
+have_func("mincore")
+have_header("sys/vfs.h")
+have_func("memfd_create", "sys/mman.h")
+
 $CFLAGS += " -DRUBYLIBDIR='\"#{CONFIG['rubylibdir']}\"'"
 
 create_makefile "mmap"
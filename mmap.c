@@ -4,8 +4,14 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <math.h>
 #include <sys/mman.h>
 
+#if HAVE_SYS_VFS_H
+#include <sys/vfs.h>
+#endif
+
 #if HAVE_SEMCTL && HAVE_SHMCTL
 #include <sys/shm.h>
 #include <sys/ipc.h>
@@ -16,6 +22,22 @@
 #include <intern.h>
 #include <re.h>
 
+#if HAVE_RB_THREAD_CALL_WITHOUT_GVL2
+#include <ruby/thread.h>
+#endif
+
+#if HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#if defined(__GNUC__) && __GNUC__ >= 5 && defined(__x86_64__)
+#include <immintrin.h>
+#define MM_AVX2 1
+#endif
+#endif
+
 #ifndef MADV_NORMAL
 #ifdef POSIX_MADV_NORMAL
 #define MADV_NORMAL     POSIX_MADV_NORMAL 
@@ -55,26 +77,79 @@
 #endif
 #endif
 
-static VALUE mm_cMap;
+#if defined(MAP_HUGETLB) && !defined(MAP_HUGE_SHIFT)
+#define MAP_HUGE_SHIFT 26
+#endif
+
+#ifndef HUGETLBFS_MAGIC
+#define HUGETLBFS_MAGIC 0x958458f6
+#endif
+
+static VALUE mm_cMap, mm_cFlush, mm_cBatch, mm_cArrayView;
+static VALUE mm_cLayout, mm_cRecords, mm_cWindow;
+static size_t mm_pagesize;
+static int mm_madv_populate;
 
 #define EXP_INCR_SIZE 4096
+#define EXP_GROWTH 2.0
+#define EXP_MAX_INCR_SIZE (64 * 1024 * 1024)
+#define EXP_READAHEAD_SIZE (8 * 1024 * 1024)
+
+#define MM_HUGE_ROUND(len, huge) (((len) + (huge) - 1) & ~((size_t)(huge) - 1))
+
+#define MM_POPULATE_CHUNK (64 * 1024 * 1024)
+#define MM_POPULATE_THREADS 16
 
 typedef struct {
     MMAP_RETTYPE addr;
     int smode, pmode, vscope;
-    int advice, flag;
+    int advice, flag, fd;
     VALUE key;
     int semid, shmid;
-    size_t len, real, incr;
+    size_t len, real, incr, max_incr, hugepage, delta;
+    double growth;
     off_t offset;
     char *path, *template;
 } mm_mmap;
 
+/*
+ * with an offset which is not aligned on a page, addr is delta bytes
+ * after the start of the mapping
+ */
+#define MM_BASE(t) ((char *)(t)->addr - (t)->delta)
+#define MM_MAPLEN(t) ((t)->len + (t)->delta)
+
+#define MM_DIRTY_MAX 32
+
+typedef struct {
+    size_t beg, end;
+} mm_range;
+
+struct mm_prefetch;
+struct mm_lindex;
+
 typedef struct {
-    int count;
+    int count, rcount, busy;
+    int locking, wwait;
+    VALUE wowner, readers, waiters;
+    int ndirty;
+    mm_range dirty[MM_DIRTY_MAX + 2];
+    size_t readahead, ranext;
+    struct mm_prefetch *prefetch;
+    struct mm_lindex *lindex;
     mm_mmap *t;
 } mm_ipc;
 
+typedef struct {
+    mm_ipc *i_mm;
+    MMAP_RETTYPE addr;
+    size_t len;
+    int flag, error, err, done;
+    size_t count;
+    void *data;
+    double deadline;
+} mm_st;
+
 typedef struct {
     VALUE obj, *argv;
     int flag, id, argc;
@@ -91,6 +166,9 @@ typedef struct {
 #define MM_LOCK   (1<<3)
 #define MM_IPC    (1<<4)
 #define MM_TMP    (1<<5)
+#define MM_HUGETLB (1<<6)
+#define MM_THP    (1<<7)
+#define MM_SHARED (1<<8)
 
 #if HAVE_SEMCTL && HAVE_SHMCTL
 static char template[1024];
@@ -104,9 +182,25 @@ union semun
 };
 #endif
 
+static void mm_prefetch_stop __((mm_ipc *));
+static void mm_lindex_free __((mm_ipc *));
+static void mm_lindex_cut __((struct mm_lindex *, size_t));
+static VALUE mm_substr __((VALUE, mm_ipc *, size_t, size_t, int));
+static void mm_populate_range __((mm_ipc *, size_t, size_t, int, int));
+
+static void
+mm_mark(mm_ipc *i_mm)
+{
+    rb_gc_mark(i_mm->wowner);
+    rb_gc_mark(i_mm->readers);
+    rb_gc_mark(i_mm->waiters);
+}
+
 static void
 mm_free(mm_ipc *i_mm)
 {
+    mm_prefetch_stop(i_mm);
+    mm_lindex_free(i_mm);
 #if HAVE_SEMCTL && HAVE_SHMCTL
     if (i_mm->t->flag & MM_IPC) {
 	struct shmid_ds buf;
@@ -127,7 +221,10 @@ mm_free(mm_ipc *i_mm)
     }
 #endif
     if (i_mm->t->path) {
-	munmap(i_mm->t->addr, i_mm->t->len);
+	munmap(MM_BASE(i_mm->t), MM_MAPLEN(i_mm->t));
+	if (i_mm->t->fd >= 0) {
+	    close(i_mm->t->fd);
+	}
 	if (i_mm->t->path != (char *)-1) {
 	    if (i_mm->t->real < i_mm->t->len && i_mm->t->vscope != MAP_PRIVATE &&
 		truncate(i_mm->t->path, i_mm->t->real) == -1) {
@@ -141,627 +238,2347 @@ mm_free(mm_ipc *i_mm)
     free(i_mm);
 }
 
-static void
-mm_lock(mm_ipc *i_mm, int wait_lock)
+/*
+ * value of the option name (a String or a Symbol) in the Hash options
+ */
+static VALUE
+mm_i_optval(VALUE options, const char *name)
+{
+    VALUE val;
+
+    if (NIL_P(options)) return Qnil;
+    val = rb_hash_aref(options, rb_str_new2(name));
+    if (NIL_P(val)) {
+	val = rb_hash_aref(options, ID2SYM(rb_intern(name)));
+    }
+    return val;
+}
+
+static int
+mm_i_option(VALUE options, const char *name)
 {
+    return RTEST(mm_i_optval(options, name));
+}
+
+static void mm_nogvl __((mm_st *, void *(*)(void *), int));
+
 #if HAVE_SEMCTL && HAVE_SHMCTL
-    struct sembuf sem_op;
+static double
+mm_time(void)
+{
+    struct timeval tv;
 
-    if (i_mm->t->flag & MM_IPC) {
-	i_mm->count++;
-	if (i_mm->count == 1) {
-	retry:
-	    sem_op.sem_num = 0;
-	    sem_op.sem_op = -1;
-	    sem_op.sem_flg = IPC_NOWAIT;
-	    if (semop(i_mm->t->semid, &sem_op, 1) == -1) {
-		if (errno == EAGAIN) {
-		    if (!wait_lock) {
-			rb_raise(rb_const_get(rb_mErrno, rb_intern("EAGAIN")), "EAGAIN");
-		    }
-		    rb_thread_sleep(1);
-		    goto retry;
-		}
-		rb_sys_fail("semop()");
-	    }
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+#if HAVE_SEMTIMEDOP && HAVE_RB_THREAD_CALL_WITHOUT_GVL2
+/*
+ * wait in semtimedop() without the GVL. On EINTR done is not set, the
+ * interrupts are checked by mm_nogvl which call it again
+ */
+static void *
+mm_i_semop(void *ptr)
+{
+    mm_st *st_mm = (mm_st *)ptr;
+    struct timespec ts, *tsp = 0;
+    double rem;
+
+    if (st_mm->deadline >= 0) {
+	rem = st_mm->deadline - mm_time();
+	if (rem <= 0) {
+	    st_mm->error = EAGAIN;
+	    st_mm->done = 1;
+	    return 0;
 	}
-   }
-#endif
+	ts.tv_sec = (time_t)rem;
+	ts.tv_nsec = (long)((rem - ts.tv_sec) * 1e9);
+	tsp = &ts;
+    }
+    if (semtimedop(st_mm->i_mm->t->semid, (struct sembuf *)st_mm->data,
+		   st_mm->flag, tsp) == 0) {
+	st_mm->error = 0;
+    }
+    else if (errno == EINTR) {
+	return 0;
+    }
+    else {
+	st_mm->error = errno;
+    }
+    st_mm->done = 1;
+    return 0;
 }
+#endif
 
-static void
-mm_unlock(mm_ipc *i_mm)
+/*
+ * apply the operations on the semaphores, waiting at most timeout
+ * seconds (forever if timeout < 0). Return 0 or an errno, EAGAIN
+ * when the time is out
+ */
+static int
+mm_semop(mm_ipc *i_mm, struct sembuf *ops, int nops, double timeout)
 {
-#if HAVE_SEMCTL && HAVE_SHMCTL
-    struct sembuf sem_op;
+    double deadline;
+    int i;
 
-    if (i_mm->t->flag & MM_IPC) {
-	i_mm->count--;
-	if (!i_mm->count) {
-	retry:
-	    sem_op.sem_num = 0;
-	    sem_op.sem_op = 1;
-	    sem_op.sem_flg = IPC_NOWAIT;
-	    if (semop(i_mm->t->semid, &sem_op, 1) == -1) {
-		if (errno == EAGAIN) {
-		    rb_thread_sleep(1);
-		    goto retry;
-		}
-		rb_sys_fail("semop()");
-	    }
+    for (i = 0; i < nops; i++) {
+	ops[i].sem_flg = IPC_NOWAIT;
+    }
+    if (semop(i_mm->t->semid, ops, nops) == 0) {
+	return 0;
+    }
+    if (errno != EAGAIN) {
+	return errno;
+    }
+    if (timeout == 0) {
+	return EAGAIN;
+    }
+    deadline = (timeout < 0) ? -1.0 : mm_time() + timeout;
+#if HAVE_SEMTIMEDOP && HAVE_RB_THREAD_CALL_WITHOUT_GVL2
+    {
+	mm_st st_mm;
+
+	for (i = 0; i < nops; i++) {
+	    ops[i].sem_flg = 0;
+	}
+	st_mm.i_mm = i_mm;
+	st_mm.data = ops;
+	st_mm.flag = nops;
+	st_mm.deadline = deadline;
+	st_mm.error = 0;
+	mm_nogvl(&st_mm, mm_i_semop, 0);
+	return st_mm.error;
+    }
+#else
+    for (;;) {
+	struct timeval tv;
+
+	tv.tv_sec = 0;
+	tv.tv_usec = 1000;
+	rb_thread_wait_for(tv);
+	if (semop(i_mm->t->semid, ops, nops) == 0) {
+	    return 0;
+	}
+	if (errno != EAGAIN) {
+	    return errno;
+	}
+	if (deadline >= 0 && mm_time() >= deadline) {
+	    return EAGAIN;
 	}
     }
 #endif
 }
+#endif
 
-#define GetMmap(obj, i_mm, t_modify)					\
-    Data_Get_Struct(obj, mm_ipc, i_mm);					\
-    if (!i_mm->t->path) {						\
-	rb_raise(rb_eIOError, "unmapped file");				\
-    }									\
-    if ((t_modify & MM_MODIFY) && (i_mm->t->flag & MM_FROZEN)) {	\
-	rb_error_frozen("mmap");					\
+#if HAVE_SEMCTL && HAVE_SHMCTL
+static void
+mm_semfail(int err)
+{
+    if (err == EAGAIN) {
+	rb_raise(rb_const_get(rb_mErrno, rb_intern("EAGAIN")), "EAGAIN");
     }
+    errno = err;
+    rb_sys_fail("semop()");
+}
+
+typedef struct {
+    mm_ipc *i_mm;
+    double deadline;
+    int err;
+} mm_semwait;
+
+/*
+ * seconds left before deadline (forever if deadline < 0)
+ */
+static double
+mm_remain(double deadline)
+{
+    double rem;
+
+    if (deadline < 0) return -1.0;
+    rem = deadline - mm_time();
+    return (rem < 0) ? 0.0 : rem;
+}
 
 static VALUE
-mm_vunlock(VALUE obj)
+mm_i_lock_sleep(VALUE arg)
 {
-    mm_ipc *i_mm;
+    double rem = *(double *)arg;
+    struct timeval tv;
 
-    GetMmap(obj, i_mm, 0);
-    mm_unlock(i_mm);
+    tv.tv_sec = (time_t)rem;
+    tv.tv_usec = (long)((rem - tv.tv_sec) * 1e6);
+    rb_thread_wait_for(tv);
     return Qnil;
 }
 
-/*
- * call-seq: semlock
- *
- * Create a lock
- */
 static VALUE
-mm_semlock(int argc, VALUE *argv, VALUE obj)
+mm_i_lock_unwait(VALUE arg)
 {
-    mm_ipc *i_mm;
-
-    GetMmap(obj, i_mm, 0);
-    if (!(i_mm->t->flag & MM_IPC)) {
-	rb_warning("useless use of #semlock");
-	rb_yield(obj);
-    }
-    else {
-#if HAVE_SEMCTL && HAVE_SHMCTL
-	VALUE a;
-	int wait_lock = Qtrue;
+    mm_ipc *i_mm = (mm_ipc *)arg;
 
-	if (rb_scan_args(argc, argv, "01", &a)) {
-	    wait_lock = RTEST(a);
-	}
-	mm_lock(i_mm, wait_lock);
-	rb_ensure(rb_yield, obj, mm_vunlock, obj);
-#endif
-    }
+    rb_ary_delete(i_mm->waiters, rb_thread_current());
     return Qnil;
 }
 
 /*
- * call-seq: ipc_key
- *
- * Get the ipc key
+ * sleep until another thread of this process change the state of the
+ * lock (see mm_lock_wake), return EAGAIN when the deadline is passed.
+ * Without deadline the sleep is still limited to 1s
  */
-static VALUE
-mm_ipc_key(VALUE obj)
+static int
+mm_lock_sleep(mm_ipc *i_mm, double deadline)
 {
-    mm_ipc *i_mm;
+    double rem = 1.0;
 
-    GetMmap(obj, i_mm, 0);
-    if (i_mm->t->flag & MM_IPC) {
-	return INT2NUM(i_mm->t->key);
+    if (deadline >= 0) {
+	if ((rem = deadline - mm_time()) <= 0) {
+	    return EAGAIN;
+	}
+	if (rem > 1.0) rem = 1.0;
     }
-    return INT2NUM(-1);
+    if (NIL_P(i_mm->waiters)) {
+	i_mm->waiters = rb_ary_new();
+    }
+    rb_ary_push(i_mm->waiters, rb_thread_current());
+    rb_ensure(mm_i_lock_sleep, (VALUE)&rem, mm_i_lock_unwait, (VALUE)i_mm);
+    return 0;
 }
 
 /*
- * Document-method: munmap
- * Document-method: unmap
- *
- * call-seq: munmap
- *
- * terminate the association
+ * wake up the threads sleeping in mm_lock_sleep, which check again
+ * the state of the lock
  */
-static VALUE
-mm_unmap(VALUE obj)
+static void
+mm_lock_wake(mm_ipc *i_mm)
 {
-    mm_ipc *i_mm;
+    long i;
 
-    GetMmap(obj, i_mm, 0);
-    if (i_mm->t->path) {
-	mm_lock(i_mm, Qtrue);
-	munmap(i_mm->t->addr, i_mm->t->len);
-	if (i_mm->t->path != (char *)-1) {
-	    if (i_mm->t->real < i_mm->t->len && i_mm->t->vscope != MAP_PRIVATE &&
-		truncate(i_mm->t->path, i_mm->t->real) == -1) {
-		rb_raise(rb_eTypeError, "truncate");
-	    }
-	    free(i_mm->t->path);
-	}
-	i_mm->t->path = '\0';
-	mm_unlock(i_mm);
+    if (NIL_P(i_mm->waiters)) return;
+    for (i = 0; i < RARRAY(i_mm->waiters)->len; i++) {
+	rb_thread_wakeup(RARRAY(i_mm->waiters)->ptr[i]);
     }
-    return Qnil;
 }
 
 /*
- * call-seq: freeze
- *
- * freeze the current file 
+ * number of read locks held by the current thread
  */
-static VALUE
-mm_freeze(VALUE obj)
+static long
+mm_rheld(mm_ipc *i_mm)
 {
-    mm_ipc *i_mm;
-    rb_obj_freeze(obj);
-    GetMmap(obj, i_mm, 0);
-    i_mm->t->flag |= MM_FROZEN;
-    return obj;
+    VALUE n;
+
+    if (NIL_P(i_mm->readers)) return 0;
+    n = rb_hash_aref(i_mm->readers, rb_thread_current());
+    return NIL_P(n) ? 0 : FIX2LONG(n);
 }
 
-static VALUE
-mm_str(VALUE obj, int modify)
+static void
+mm_rheld_add(mm_ipc *i_mm, long d)
 {
-    mm_ipc *i_mm;
-    VALUE ret = Qnil;
+    VALUE th = rb_thread_current();
+    long n = mm_rheld(i_mm) + d;
 
-    GetMmap(obj, i_mm, modify & ~MM_ORIGIN);
-    if (modify & MM_MODIFY) {
-	if (i_mm->t->flag & MM_FROZEN) rb_error_frozen("mmap");
-	if (!OBJ_TAINTED(ret) && rb_safe_level() >= 4)
-	    rb_raise(rb_eSecurityError, "Insecure: can't modify mmap");
+    if (NIL_P(i_mm->readers)) {
+	i_mm->readers = rb_hash_new();
     }
-    ret = rb_obj_alloc(rb_cString);
-    if (rb_obj_tainted(obj)) {
-	OBJ_TAINT(ret);
+    if (n) {
+	rb_hash_aset(i_mm->readers, th, LONG2FIX(n));
     }
-    RSTRING(ret)->ptr = i_mm->t->addr;
-    RSTRING(ret)->len = i_mm->t->real;
-    if (modify & MM_ORIGIN) {
-	RSTRING(ret)->aux.shared = ret;
-	FL_SET(ret, ELTS_SHARED);
+    else {
+	rb_hash_delete(i_mm->readers, th);
     }
-    if (i_mm->t->flag & MM_FROZEN) {
-	ret = rb_obj_freeze(ret);
+}
+
+static VALUE
+mm_i_wait_readers(VALUE arg)
+{
+    mm_semwait *sw = (mm_semwait *)arg;
+    struct sembuf sem_op;
+
+    sem_op.sem_num = 1;
+    sem_op.sem_op = 0;
+    sw->err = mm_semop(sw->i_mm, &sem_op, 1, mm_remain(sw->deadline));
+    return Qnil;
+}
+
+/*
+ * take the semaphore 0, which stop the new readers, then wait until
+ * the semaphore 1 (the number of readers) is 0
+ */
+static VALUE
+mm_i_wlock(VALUE arg)
+{
+    mm_semwait *sw = (mm_semwait *)arg;
+    struct sembuf sem_op;
+    int state = 0;
+
+    sem_op.sem_num = 0;
+    sem_op.sem_op = -1;
+    if ((sw->err = mm_semop(sw->i_mm, &sem_op, 1, mm_remain(sw->deadline))) != 0) {
+	return Qnil;
     }
-    return ret;
+    rb_protect(mm_i_wait_readers, arg, &state);
+    if (state || sw->err) {
+	sem_op.sem_num = 0;
+	sem_op.sem_op = 1;
+	mm_semop(sw->i_mm, &sem_op, 1, -1);
+	if (state) rb_jump_tag(state);
+    }
+    return Qnil;
 }
 
 /*
- * call-seq: to_str
- *
- * Convert object to a string
+ * in one operation wait for the semaphore 0, increment the number of
+ * readers and release the semaphore 0
  */
 static VALUE
-mm_to_str(VALUE obj)
+mm_i_rlock(VALUE arg)
 {
-    return mm_str(obj, MM_ORIGIN);
+    mm_semwait *sw = (mm_semwait *)arg;
+    struct sembuf sem_op[3];
+
+    sem_op[0].sem_num = 0;
+    sem_op[0].sem_op = -1;
+    sem_op[1].sem_num = 1;
+    sem_op[1].sem_op = 1;
+    sem_op[2].sem_num = 0;
+    sem_op[2].sem_op = 1;
+    sw->err = mm_semop(sw->i_mm, sem_op, 3, mm_remain(sw->deadline));
+    return Qnil;
 }
- 
-extern char *ruby_strdup();
 
-typedef struct {
-    mm_ipc *i_mm;
-    size_t len;
-} mm_st;
+/*
+ * call func, which take the semaphores, with i_mm->locking set : the
+ * other threads of the process wait until it is done
+ */
+static void
+mm_semtake(mm_ipc *i_mm, VALUE (*func)(VALUE), double deadline)
+{
+    mm_semwait sw;
+    int state = 0;
+
+    sw.i_mm = i_mm;
+    sw.deadline = deadline;
+    sw.err = 0;
+    i_mm->locking = 1;
+    rb_protect(func, (VALUE)&sw, &state);
+    i_mm->locking = 0;
+    mm_lock_wake(i_mm);
+    if (state) rb_jump_tag(state);
+    if (sw.err) mm_semfail(sw.err);
+}
+#endif
 
+#if HAVE_SEMCTL && HAVE_SHMCTL
 static VALUE
-mm_i_expand(mm_st *st_mm)
+mm_i_wlock_wait(VALUE arg)
 {
-    int fd;
-    mm_ipc *i_mm = st_mm->i_mm;
-    size_t len = st_mm->len;
+    mm_semwait *sw = (mm_semwait *)arg;
+    mm_ipc *i_mm = sw->i_mm;
 
-    if (munmap(i_mm->t->addr, i_mm->t->len)) {
-	rb_raise(rb_eArgError, "munmap failed");
-    }
-    if ((fd = open(i_mm->t->path, i_mm->t->smode)) == -1) {
-	rb_raise(rb_eArgError, "Can't open %s", i_mm->t->path);
+    while (i_mm->count || i_mm->rcount || i_mm->locking) {
+	if ((sw->err = mm_lock_sleep(i_mm, sw->deadline)) != 0) {
+	    return Qnil;
+	}
     }
-    if (len > i_mm->t->len) {
-	if (lseek(fd, len - i_mm->t->len - 1, SEEK_END) == -1) {
-	    rb_raise(rb_eIOError, "Can't lseek %d", len - i_mm->t->len - 1);
+    mm_semtake(i_mm, mm_i_wlock, sw->deadline);
+    return Qnil;
+}
+#endif
+
+/*
+ * take the (exclusive) lock of an IPC map, waiting at most timeout
+ * seconds (forever if timeout < 0). The lock is recursive for the
+ * thread which hold it, the other threads of the process wait like
+ * the other processes. While a thread wait for it, i_mm->wwait stop
+ * the new readers of the process. Taking it inside a read lock of
+ * the same thread would never end, and raise ThreadError
+ */
+static void
+mm_lock_timeout(mm_ipc *i_mm, double timeout)
+{
+#if HAVE_SEMCTL && HAVE_SHMCTL
+    mm_semwait sw;
+    VALUE th;
+    int state = 0;
+
+    if (i_mm->t->flag & MM_IPC) {
+	th = rb_thread_current();
+	if (i_mm->count && i_mm->wowner == th) {
+	    i_mm->count++;
+	    return;
 	}
-	if (write(fd, "\000", 1) != 1) {
-	    rb_raise(rb_eIOError, "Can't extend %s", i_mm->t->path);
+	if (mm_rheld(i_mm)) {
+	    rb_raise(rb_eThreadError, "can't take the write lock inside a read lock");
 	}
-    }
-    else if (len < i_mm->t->len && truncate(i_mm->t->path, len) == -1) {
-	rb_raise(rb_eIOError, "Can't truncate %s", i_mm->t->path);
-    }
-    i_mm->t->addr = mmap(0, len, i_mm->t->pmode, i_mm->t->vscope, fd, i_mm->t->offset);
-    close(fd);
-    if (i_mm->t->addr == MAP_FAILED) {
-	rb_raise(rb_eArgError, "mmap failed");
-    }
-#ifdef MADV_NORMAL
-    if (i_mm->t->advice && madvise(i_mm->t->addr, len, i_mm->t->advice) == -1) {
-	rb_raise(rb_eArgError, "madvise(%d)", errno);
+	sw.i_mm = i_mm;
+	sw.deadline = (timeout < 0) ? -1.0 : mm_time() + timeout;
+	sw.err = 0;
+	i_mm->wwait++;
+	rb_protect(mm_i_wlock_wait, (VALUE)&sw, &state);
+	i_mm->wwait--;
+	if (state || sw.err) {
+	    mm_lock_wake(i_mm);
+	    if (state) rb_jump_tag(state);
+	    mm_semfail(sw.err);
+	}
+	i_mm->count = 1;
+	i_mm->wowner = th;
     }
 #endif
-    if ((i_mm->t->flag & MM_LOCK) && mlock(i_mm->t->addr, len) == -1) {
-	rb_raise(rb_eArgError, "mlock(%d)", errno);
-    }
-    i_mm->t->len  = len;
-    return Qnil;
 }
 
 static void
-mm_expandf(mm_ipc *i_mm, size_t len)
+mm_lock(mm_ipc *i_mm, int wait_lock)
 {
-    int status;
-    mm_st st_mm;
+    mm_lock_timeout(i_mm, wait_lock ? -1.0 : 0.0);
+}
+
+/*
+ * take a shared lock of an IPC map. The threads of the process share
+ * the reader counted in the semaphore 1, and wait while another thread
+ * hold the exclusive lock, or wait for it unless they already hold a
+ * read lock. Inside its own exclusive lock, a thread only increment
+ * the count
+ */
+static void
+mm_rlock_timeout(mm_ipc *i_mm, double timeout)
+{
+#if HAVE_SEMCTL && HAVE_SHMCTL
+    double deadline;
+    int err;
 
-    if (i_mm->t->vscope == MAP_PRIVATE) {
-	rb_raise(rb_eTypeError, "expand for a private map");
-    }
-    if (i_mm->t->flag & MM_FIXED) {
-	rb_raise(rb_eTypeError, "expand for a fixed map");
-    }
-    if (!i_mm->t->path || i_mm->t->path == (char *)-1) {
-	rb_raise(rb_eTypeError, "expand for an anonymous map");
-    }
-    st_mm.i_mm = i_mm;
-    st_mm.len = len;
     if (i_mm->t->flag & MM_IPC) {
-	mm_lock(i_mm, Qtrue);
-	rb_protect((VALUE (*)(VALUE))mm_i_expand, (VALUE)&st_mm, &status);
-	mm_unlock(i_mm);
-	if (status) {
-	    rb_jump_tag(status);
+	if (!i_mm->count || i_mm->wowner != rb_thread_current()) {
+	    deadline = (timeout < 0) ? -1.0 : mm_time() + timeout;
+	    while (i_mm->count || i_mm->locking ||
+		   (i_mm->wwait && !mm_rheld(i_mm))) {
+		if ((err = mm_lock_sleep(i_mm, deadline)) != 0) {
+		    mm_semfail(err);
+		}
+	    }
+	    if (!i_mm->rcount) {
+		mm_semtake(i_mm, mm_i_rlock, deadline);
+	    }
 	}
+	i_mm->rcount++;
+	mm_rheld_add(i_mm, 1);
     }
-    else {
-	mm_i_expand(&st_mm);
+#endif
+}
+
+static void
+mm_rlock(mm_ipc *i_mm)
+{
+    mm_rlock_timeout(i_mm, -1.0);
+}
+
+static void
+mm_runlock(mm_ipc *i_mm)
+{
+#if HAVE_SEMCTL && HAVE_SHMCTL
+    struct sembuf sem_op;
+    int err;
+
+    if (i_mm->t->flag & MM_IPC) {
+	i_mm->rcount--;
+	mm_rheld_add(i_mm, -1);
+	if (!i_mm->rcount && !i_mm->count) {
+	    sem_op.sem_num = 1;
+	    sem_op.sem_op = -1;
+	    if ((err = mm_semop(i_mm, &sem_op, 1, -1)) != 0) {
+		errno = err;
+		rb_sys_fail("semop()");
+	    }
+	    mm_lock_wake(i_mm);
+	}
     }
+#endif
 }
 
 static void
-mm_realloc(mm_ipc *i_mm, size_t len)
+mm_unlock(mm_ipc *i_mm)
 {
-    if (i_mm->t->flag & MM_FROZEN) rb_error_frozen("mmap");
-    if (len > i_mm->t->len) {
-	if ((len - i_mm->t->len) < i_mm->t->incr) {
-	    len = i_mm->t->len + i_mm->t->incr;
+#if HAVE_SEMCTL && HAVE_SHMCTL
+    struct sembuf sem_op;
+
+    if (i_mm->t->flag & MM_IPC) {
+	i_mm->count--;
+	if (!i_mm->count) {
+	    i_mm->wowner = Qnil;
+	    mm_lock_wake(i_mm);
+	retry:
+	    sem_op.sem_num = 0;
+	    sem_op.sem_op = 1;
+	    sem_op.sem_flg = IPC_NOWAIT;
+	    if (semop(i_mm->t->semid, &sem_op, 1) == -1) {
+		if (errno == EAGAIN) {
+		    rb_thread_sleep(1);
+		    goto retry;
+		}
+		rb_sys_fail("semop()");
+	    }
 	}
-	mm_expandf(i_mm, len);
     }
+#endif
 }
 
 /*
- * call-seq:
- *   extend(count)
- *
- * add <em>count</em> bytes to the file (i.e. pre-extend the file) 
+ * wait until another thread has finished to remap (or unmap) the file
  */
-static VALUE
-mm_extend(VALUE obj, VALUE a)
+static void
+mm_wait_busy(mm_ipc *i_mm)
 {
-    mm_ipc *i_mm;
-    long len;
+    struct timeval tv;
 
-    GetMmap(obj, i_mm, MM_MODIFY);
-    len = NUM2LONG(a);
-    if (len > 0) {
-	mm_expandf(i_mm, i_mm->t->len + len);
+    while (i_mm->busy) {
+	tv.tv_sec = 0;
+	tv.tv_usec = 1000;
+	rb_thread_wait_for(tv);
     }
-    return UINT2NUM(i_mm->t->len);
 }
 
-static VALUE
-mm_i_options(VALUE arg, VALUE obj)
+/*
+ * call func(st_mm) without the GVL. This needs
+ * rb_thread_call_without_gvl2() (ruby >= 2.0) which this extension,
+ * written for the 1.8 API, can't be built with : func is then called
+ * with the interpreter stopped. func must not call ruby and must set
+ * st_mm->done. Pending interrupts are checked before func is called, never
+ * after, so that the result of the syscall is always recorded. With
+ * <em>busy</em> the other threads using this map wait until func returns
+ */
+static void
+mm_nogvl(mm_st *st_mm, void *(*func)(void *), int busy)
 {
-    mm_ipc *i_mm;
-    char *options;
-    VALUE key, value;
+#if HAVE_RB_THREAD_CALL_WITHOUT_GVL2
+    mm_ipc *i_mm = st_mm->i_mm;
+#endif
 
-    Data_Get_Struct(obj, mm_ipc, i_mm);
-    key = rb_ary_entry(arg, 0);
-    value = rb_ary_entry(arg, 1);
-    key = rb_obj_as_string(key);
-    options = StringValuePtr(key);
-    if (strcmp(options, "length") == 0) {
-	i_mm->t->len = NUM2UINT(value);
-	if (i_mm->t->len <= 0) {
-	    rb_raise(rb_eArgError, "Invalid value for length %d", i_mm->t->len);
-	}
-	i_mm->t->flag |= MM_FIXED;
+    st_mm->done = 0;
+#if HAVE_RB_THREAD_CALL_WITHOUT_GVL2
+    for (;;) {
+	if (busy) i_mm->busy++;
+	rb_thread_call_without_gvl2(func, st_mm, RUBY_UBF_IO, 0);
+	if (busy) i_mm->busy--;
+	if (st_mm->done) break;
+	rb_thread_check_ints();
     }
-    else if (strcmp(options, "offset") == 0) {
-	i_mm->t->offset = NUM2INT(value);
-	if (i_mm->t->offset < 0) {
-	    rb_raise(rb_eArgError, "Invalid value for offset %d", i_mm->t->offset);
+#else
+    (*func)(st_mm);
+#endif
+}
+
+#define GetMmap(obj, i_mm, t_modify)					\
+    Data_Get_Struct(obj, mm_ipc, i_mm);					\
+    if (i_mm->busy) mm_wait_busy(i_mm);					\
+    if (!i_mm->t->path) {						\
+	rb_raise(rb_eIOError, "unmapped file");				\
+    }									\
+    if ((t_modify & MM_MODIFY) && (i_mm->t->flag & MM_FROZEN)) {	\
+	rb_error_frozen("mmap");					\
+    }
+
+/*
+ * merge the two closest dirty ranges until there are at most
+ * MM_DIRTY_MAX ranges
+ */
+static void
+mm_dirty_compact(mm_ipc *i_mm)
+{
+    int i, k;
+    size_t gap;
+
+    while (i_mm->ndirty > MM_DIRTY_MAX) {
+	k = 0;
+	gap = i_mm->dirty[1].beg - i_mm->dirty[0].end;
+	for (i = 1; i < i_mm->ndirty - 1; i++) {
+	    if (i_mm->dirty[i + 1].beg - i_mm->dirty[i].end < gap) {
+		gap = i_mm->dirty[i + 1].beg - i_mm->dirty[i].end;
+		k = i;
+	    }
 	}
-	i_mm->t->flag |= MM_FIXED;
+	i_mm->dirty[k].end = i_mm->dirty[k + 1].end;
+	MEMMOVE(i_mm->dirty + k + 1, i_mm->dirty + k + 2, mm_range,
+		i_mm->ndirty - k - 2);
+	i_mm->ndirty--;
     }
-    else if (strcmp(options, "advice") == 0) {
-	i_mm->t->advice = NUM2INT(value);
+}
+
+/*
+ * record that the bytes [beg, beg + len) were modified. The ranges
+ * are page aligned, sorted and merged
+ */
+static void
+mm_dirty(mm_ipc *i_mm, size_t beg, size_t len)
+{
+    size_t end;
+    int i, j;
+
+    if (!len) return;
+    if (i_mm->lindex) {
+	mm_lindex_cut(i_mm->lindex, beg);
     }
-    else if (strcmp(options, "increment") == 0) {
-	int incr =  NUM2INT(value);
-	if (incr < 0) {
-	    rb_raise(rb_eArgError, "Invalid value for increment %d", incr);
-	}
-	i_mm->t->incr = incr;
+    end = (beg + len + mm_pagesize - 1) & ~(mm_pagesize - 1);
+    beg &= ~(mm_pagesize - 1);
+    for (i = 0; i < i_mm->ndirty && i_mm->dirty[i].end < beg; i++);
+    for (j = i; j < i_mm->ndirty && i_mm->dirty[j].beg <= end; j++) {
+	if (i_mm->dirty[j].beg < beg) beg = i_mm->dirty[j].beg;
+	if (i_mm->dirty[j].end > end) end = i_mm->dirty[j].end;
     }
-    else if (strcmp(options, "initialize") == 0) {
+    if (j == i) {
+	MEMMOVE(i_mm->dirty + i + 1, i_mm->dirty + i, mm_range, i_mm->ndirty - i);
+	i_mm->ndirty++;
     }
-#if HAVE_SEMCTL && HAVE_SHMCTL
-    else if (strcmp(options, "ipc") == 0) {
-	if (value != Qtrue && TYPE(value) != T_HASH) {
-	    rb_raise(rb_eArgError, "Expected an Hash for :ipc");
-	}
-	i_mm->t->shmid = value;
-	i_mm->t->flag |= (MM_IPC | MM_TMP);
+    else if (j > i + 1) {
+	MEMMOVE(i_mm->dirty + i + 1, i_mm->dirty + j, mm_range, i_mm->ndirty - j);
+	i_mm->ndirty -= j - i - 1;
     }
-#endif
-    else {
-	rb_warning("Unknown option `%s'", options);
+    i_mm->dirty[i].beg = beg;
+    i_mm->dirty[i].end = end;
+    mm_dirty_compact(i_mm);
+}
+
+/*
+ * forget the dirty pages in [beg, end)
+ */
+static void
+mm_dirty_clear(mm_ipc *i_mm, size_t beg, size_t end)
+{
+    mm_range tmp[MM_DIRTY_MAX + 2];
+    int i, n;
+
+    for (i = n = 0; i < i_mm->ndirty; i++) {
+	mm_range r = i_mm->dirty[i];
+
+	if (r.end <= beg || end <= r.beg) {
+	    tmp[n++] = r;
+	    continue;
+	}
+	if (r.beg < beg) {
+	    tmp[n].beg = r.beg;
+	    tmp[n++].end = beg;
+	}
+	if (end < r.end) {
+	    tmp[n].beg = end;
+	    tmp[n++].end = r.end;
+	}
     }
-    return Qnil;
+    MEMCPY(i_mm->dirty, tmp, mm_range, n);
+    i_mm->ndirty = n;
+    mm_dirty_compact(i_mm);
 }
 
-#if HAVE_SEMCTL && HAVE_SHMCTL
+static VALUE
+mm_vunlock(VALUE obj)
+{
+    mm_ipc *i_mm;
+
+    GetMmap(obj, i_mm, 0);
+    mm_unlock(i_mm);
+    return Qnil;
+}
 
 static VALUE
-mm_i_ipc(VALUE arg, VALUE obj)
+mm_vrunlock(VALUE obj)
 {
     mm_ipc *i_mm;
-    char *options;
-    VALUE key, value;
 
-    Data_Get_Struct(obj, mm_ipc, i_mm);
-    key = rb_ary_entry(arg, 0);
-    value = rb_ary_entry(arg, 1);
-    key = rb_obj_as_string(key);
-    options = StringValuePtr(key);
-    if (strcmp(options, "key") == 0) {
-	i_mm->t->key = rb_funcall2(value, rb_intern("to_int"), 0, 0);
-    }
-    else if (strcmp(options, "permanent") == 0) {
-	if (RTEST(value)) {
-	    i_mm->t->flag &= ~MM_TMP;
-	}
+    GetMmap(obj, i_mm, 0);
+    mm_runlock(i_mm);
+    return Qnil;
+}
+
+#if HAVE_SEMCTL && HAVE_SHMCTL
+/*
+ * timeout given by the arguments (wait = true, options = {}) of the
+ * lock methods
+ */
+static double
+mm_lock_args(int argc, VALUE *argv)
+{
+    VALUE a, options = Qnil;
+    double timeout = -1.0;
+
+    if (argc > 0 && TYPE(argv[argc - 1]) == T_HASH) {
+	options = argv[--argc];
     }
-    else if (strcmp(options, "mode") == 0) {
-	i_mm->t->semid = NUM2INT(value);
+    if (rb_scan_args(argc, argv, "01", &a) && !RTEST(a)) {
+	timeout = 0.0;
     }
-    else {
-	rb_warning("Unknown option `%s'", options);
+    a = mm_i_optval(options, "timeout");
+    if (!NIL_P(a)) {
+	timeout = NUM2DBL(a);
+	if (timeout < 0) timeout = 0.0;
     }
-    return Qnil;
+    return timeout;
 }
-
 #endif
 
 /*
+ * Document-method: semlock
+ * Document-method: write_lock
+ *
  * call-seq:
- *  new(file, mode = "r", protection = Mmap::MAP_SHARED, options = {})
+ *    semlock(wait = true, options = {}) { ... }
+ *    write_lock(wait = true, options = {}) { ... }
  *
- * create a new Mmap object
- * 
- * * <em>file</em>
- * 
- *   Pathname of the file, if <em>nil</em> is given an anonymous map
- *   is created <em>Mmanp::MAP_ANON</em>
- * 
- * * <em>mode</em>
- * 
- *   Mode to open the file, it can be "r", "w", "rw", "a"
- * 
- * * <em>protection</em>
- * 
- *   specify the nature of the mapping
- * 
- *   * <em>Mmap::MAP_SHARED</em>
- * 
- *     Creates a mapping that's shared with all other processes 
- *     mapping the same areas of the file. 
- *     The default value is <em>Mmap::MAP_SHARED</em>
- * 
- *   * <em>Mmap::MAP_PRIVATE</em>
- * 
- *     Creates a private copy-on-write mapping, so changes to the
- *     contents of the mmap object will be private to this process
- * 
- * * <em>options</em>
- * 
- *   Hash. If one of the options <em>length</em> or <em>offset</em>
- *   is specified it will not possible to modify the size of
- *   the mapped file.
- * 
- *   length:: maps <em>length</em> bytes from the file
- * 
- *   offset:: the mapping begin at <em>offset</em>
- * 
- *   advice:: the type of the access (see #madvise)
+ * Create a lock (exclusive : wait until the readers have released
+ * their lock, see #read_lock). If <em>wait</em> is false, or if the
+ * lock is not obtained after "timeout" => seconds, raise
+ * Errno::EAGAIN. The other threads run while the process wait
  */
 static VALUE
-mm_s_new(int argc, VALUE *argv, VALUE obj)
+mm_semlock(int argc, VALUE *argv, VALUE obj)
 {
-    VALUE res = rb_funcall2(obj, rb_intern("allocate"), 0, 0);
-    rb_obj_call_init(res, argc, argv);
-    return res;
+    mm_ipc *i_mm;
+
+    GetMmap(obj, i_mm, 0);
+    if (!(i_mm->t->flag & MM_IPC)) {
+	rb_warning("useless use of #semlock");
+	rb_yield(obj);
+    }
+    else {
+#if HAVE_SEMCTL && HAVE_SHMCTL
+	mm_lock_timeout(i_mm, mm_lock_args(argc, argv));
+	rb_ensure(rb_yield, obj, mm_vunlock, obj);
+#endif
+    }
+    return Qnil;
 }
 
+/*
+ * call-seq: read_lock(wait = true, options = {}) { ... }
+ *
+ * Create a shared lock : several processes can hold it at the same
+ * time, but not at the same time than #semlock (or #write_lock).
+ * While a writer wait, the new readers wait too, so that they can't
+ * starve it. The methods which don't modify the map take it. The
+ * arguments are the same than for #semlock
+ */
 static VALUE
-mm_s_alloc(VALUE obj)
+mm_read_lock(int argc, VALUE *argv, VALUE obj)
 {
-    VALUE res;
     mm_ipc *i_mm;
 
-    res = Data_Make_Struct(obj, mm_ipc, 0, mm_free, i_mm);
-    i_mm->t = ALLOC_N(mm_mmap, 1);
-    MEMZERO(i_mm->t, mm_mmap, 1);
-    i_mm->t->incr = EXP_INCR_SIZE;
-    return res;
+    GetMmap(obj, i_mm, 0);
+    if (!(i_mm->t->flag & MM_IPC)) {
+	rb_warning("useless use of #read_lock");
+	rb_yield(obj);
+    }
+    else {
+#if HAVE_SEMCTL && HAVE_SHMCTL
+	mm_rlock_timeout(i_mm, mm_lock_args(argc, argv));
+	rb_ensure(rb_yield, obj, mm_vrunlock, obj);
+#endif
+    }
+    return Qnil;
+}
+
+#if defined(F_OFD_SETLKW)
+typedef struct {
+    int fd, cmd;
+    struct flock fl;
+} mm_flock;
+
+static void *
+mm_i_lock_range(void *ptr)
+{
+    mm_st *st_mm = (mm_st *)ptr;
+    mm_flock *lk = (mm_flock *)st_mm->data;
+
+    if (fcntl(lk->fd, lk->cmd, &lk->fl) == 0) {
+	st_mm->error = 0;
+    }
+    else if (errno == EINTR) {
+	return 0;
+    }
+    else {
+	st_mm->error = errno;
+    }
+    st_mm->done = 1;
+    return 0;
 }
 
 /*
- * call-seq: initialize
+ * wait for the lock. Without rb_thread_call_without_gvl2() F_OFD_SETLKW
+ * would stop all the threads, so poll with F_OFD_SETLK
+ */
+static VALUE
+mm_i_lock_range_wait(VALUE arg)
+{
+#if HAVE_RB_THREAD_CALL_WITHOUT_GVL2
+    mm_nogvl((mm_st *)arg, mm_i_lock_range, 0);
+#else
+    mm_st *st_mm = (mm_st *)arg;
+    mm_flock *lk = (mm_flock *)st_mm->data;
+    struct timeval tv;
+
+    lk->cmd = F_OFD_SETLK;
+    for (;;) {
+	st_mm->done = 0;
+	mm_i_lock_range(st_mm);
+	if (!st_mm->done) continue;
+	if (st_mm->error != EAGAIN && st_mm->error != EACCES) break;
+	st_mm->error = 0;
+	tv.tv_sec = 0;
+	tv.tv_usec = 1000;
+	rb_thread_wait_for(tv);
+    }
+#endif
+    return Qnil;
+}
+
+static VALUE
+mm_i_range_unlock(VALUE arg)
+{
+    mm_flock *lk = (mm_flock *)arg;
+
+    lk->fl.l_type = F_UNLCK;
+    fcntl(lk->fd, F_OFD_SETLK, &lk->fl);
+    close(lk->fd);
+    return Qnil;
+}
+#endif
+
+/*
+ * call-seq: lock_range(offset, length, options = {}) { ... }
  *
- * Create a new Mmap object
+ * lock the bytes [offset, offset + length) of the file (to the end
+ * of the file if <em>length</em> is 0), yield and release the lock.
+ * The processes which lock disjoint ranges don't wait for each
+ * other. Return the value of the block
+ *
+ * "shared" => true take a read lock, several processes can hold it
+ *
+ * "wait" => false raise Errno::EAGAIN instead of waiting
+ *
+ * The lock is an open file description lock (F_OFD_SETLKW), so the
+ * threads of a process exclude each other, and closing another
+ * descriptor of the file don't release it. Without them (the POSIX
+ * locks would be released by any close of the file in the process)
+ * raise NotImplementedError. The other threads run while the process
+ * wait
  */
 static VALUE
-mm_init(int argc, VALUE *argv, VALUE obj)
+mm_lock_range(int argc, VALUE *argv, VALUE obj)
 {
-    struct stat st;
-    int fd, smode = 0, pmode = 0, vscope, perm, init;
-    MMAP_RETTYPE addr;
-    VALUE fname, fdv, vmode, scope, options;
+#if !defined(F_OFD_SETLKW)
+    rb_raise(rb_eNotImpError, "open file description locks are not available");
+    return Qnil;
+#else
     mm_ipc *i_mm;
-    char *path, *mode;
-    size_t size = 0;
-    off_t offset;
-    int anonymous;
+    mm_flock lk;
+    mm_st st_mm;
+    VALUE voff, vlen, options, wait;
+    long off, len;
+    int shared, state = 0;
 
-    options = Qnil;
-    if (argc > 1 && TYPE(argv[argc - 1]) == T_HASH) {
-	options = argv[argc - 1];
-	argc--;
+    rb_scan_args(argc, argv, "21", &voff, &vlen, &options);
+    GetMmap(obj, i_mm, 0);
+    if (i_mm->t->path == (char *)-1) {
+	rb_raise(rb_eTypeError, "can't lock a range of an anonymous map");
     }
-    rb_scan_args(argc, argv, "12", &fname, &vmode, &scope);
-    vscope = 0;
-    path = 0;
-    fd = -1;
-    anonymous = 0;
-    fdv = Qnil;
-#ifdef MAP_ANON
-    if (NIL_P(fname)) {
-	vscope = MAP_ANON | MAP_SHARED;
-	anonymous = 1;
+    off = NUM2LONG(voff);
+    len = NUM2LONG(vlen);
+    if (off < 0) {
+	off += i_mm->t->real;
     }
-    else 
-#endif
-    {
-	if (rb_safe_level() > 0 && OBJ_TAINTED(fname)){
-	    rb_raise(rb_eSecurityError, "Insecure operation");
-	}
-	rb_secure(4);
-	if (rb_respond_to(fname, rb_intern("fileno"))) {
-	    fdv = rb_funcall2(fname, rb_intern("fileno"), 0, 0);
-	}
-	if (NIL_P(fdv)) {
-	    fname = rb_str_to_str(fname);
-	    SafeStringValue(fname);
-	    path = StringValuePtr(fname);
-	}
-	else {
-	    fd = NUM2INT(fdv);
-	    if (fd < 0) {
-		rb_raise(rb_eArgError, "invalid file descriptor %d", fd);
-	    }
+    if (off < 0) {
+	rb_raise(rb_eIndexError, "offset %ld out of mmap", NUM2LONG(voff));
+    }
+    if (len < 0) {
+	rb_raise(rb_eIndexError, "negative length %ld", len);
+    }
+    shared = mm_i_option(options, "shared");
+    wait = mm_i_optval(options, "wait");
+    if ((lk.fd = open(i_mm->t->path, shared ? O_RDONLY : O_RDWR)) == -1) {
+	rb_sys_fail(i_mm->t->path);
+    }
+    MEMZERO(&lk.fl, struct flock, 1);
+    lk.fl.l_type = shared ? F_RDLCK : F_WRLCK;
+    lk.fl.l_whence = SEEK_SET;
+    lk.fl.l_start = i_mm->t->offset + off;
+    lk.fl.l_len = len;
+    lk.cmd = (NIL_P(wait) || RTEST(wait)) ? F_OFD_SETLKW : F_OFD_SETLK;
+    st_mm.i_mm = i_mm;
+    st_mm.data = &lk;
+    st_mm.error = 0;
+    if (lk.cmd == F_OFD_SETLK) {
+	mm_i_lock_range(&st_mm);
+    }
+    else {
+	rb_protect(mm_i_lock_range_wait, (VALUE)&st_mm, &state);
+    }
+    if (state || st_mm.error) {
+	close(lk.fd);
+	if (state) rb_jump_tag(state);
+	if (st_mm.error == EAGAIN || st_mm.error == EACCES) {
+	    rb_raise(rb_const_get(rb_mErrno, rb_intern("EAGAIN")), "EAGAIN");
 	}
-	if (!NIL_P(scope)) {
-	    vscope = NUM2INT(scope);
-#ifdef MAP_ANON
-	    if (vscope & MAP_ANON) {
-		rb_raise(rb_eArgError, "filename specified for an anonymous map");
-	    }
-#endif
+	if (st_mm.error == EINVAL) {
+	    rb_raise(rb_eNotImpError, "open file description locks are not supported");
 	}
+	errno = st_mm.error;
+	rb_sys_fail("fcntl()");
     }
-    vscope |= NIL_P(scope) ? MAP_SHARED : NUM2INT(scope);
-    size = 0;
-    perm = 0666;
-    if (!anonymous) {
-	if (NIL_P(vmode)) {
-	    mode = "r";
-	}
-	else if (rb_respond_to(vmode, rb_intern("to_ary"))) {
-            VALUE tmp;
+    return rb_ensure(rb_yield, obj, mm_i_range_unlock, (VALUE)&lk);
+#endif
+}
 
-            vmode = rb_convert_type(vmode, T_ARRAY, "Array", "to_ary");
-            if (RARRAY(vmode)->len != 2) {
-                rb_raise(rb_eArgError, "Invalid length %d (expected 2)",
-                         RARRAY(vmode)->len);
-            }
-	    tmp = RARRAY(vmode)->ptr[0];
-	    mode = StringValuePtr(tmp);
-	    perm = NUM2INT(RARRAY(vmode)->ptr[1]);
-	}
-	else {
-	    mode = StringValuePtr(vmode);
-	}
-	if (strcmp(mode, "r") == 0) {
-	    smode = O_RDONLY;
-	    pmode = PROT_READ;
-	}
-	else if (strcmp(mode, "w") == 0) {
-	    smode = O_RDWR | O_TRUNC;
-	    pmode = PROT_READ | PROT_WRITE;
-	}
-	else if (strcmp(mode, "rw") == 0 || strcmp(mode, "wr") == 0) {
-	    smode = O_RDWR;
-	    pmode = PROT_READ | PROT_WRITE;
-	}
-	else if (strcmp(mode, "a") == 0) {
-	    smode = O_RDWR | O_CREAT;
-	    pmode = PROT_READ | PROT_WRITE;
-	}
-	else {
-	    rb_raise(rb_eArgError, "Invalid mode %s", mode);
-	}
-	if (NIL_P(fdv)) {
-	    if ((fd = open(path, smode, perm)) == -1) {
-		rb_raise(rb_eArgError, "Can't open %s", path);
-	    }
-	}
-	if (fstat(fd, &st) == -1) {
-	    rb_raise(rb_eArgError, "Can't stat %s", path);
-	}
-	size = st.st_size;
+/*
+ * return true if the bytes must be swapped for the byte order
+ * :native (or nil), :little, :big or :network
+ */
+static int
+mm_swap_endian(VALUE order)
+{
+    const char *s;
+    int big;
+
+    if (NIL_P(order)) return 0;
+    if (SYMBOL_P(order)) {
+	s = rb_id2name(SYM2ID(order));
     }
     else {
-	fd = -1;
-	if (!NIL_P(vmode) && TYPE(vmode) != T_STRING) {
-	    size = NUM2INT(vmode);
-	}
+	s = StringValuePtr(order);
     }
-    Data_Get_Struct(obj, mm_ipc, i_mm);
-    if (i_mm->t->flag & MM_FROZEN) {
-	rb_raise(rb_eArgError, "frozen mmap");
+    if (strcmp(s, "native") == 0) return 0;
+    if (strcmp(s, "little") == 0) big = 0;
+    else if (strcmp(s, "big") == 0 || strcmp(s, "network") == 0) big = 1;
+    else rb_raise(rb_eArgError, "unknown byte order `%s'", s);
+#ifdef WORDS_BIGENDIAN
+    return !big;
+#else
+    return big;
+#endif
+}
+
+static char *
+mm_scalar_ptr(VALUE obj, VALUE voff, size_t size, int modify)
+{
+    mm_ipc *i_mm;
+    long off;
+
+    GetMmap(obj, i_mm, modify);
+    off = NUM2LONG(voff);
+    if (off < 0) {
+	off += i_mm->t->real;
     }
-    i_mm->t->shmid = 0;
-    i_mm->t->semid = 0;
-    offset = 0;
-    if (options != Qnil) {
-	rb_iterate(rb_each, options, mm_i_options, obj);
-	if (path && (i_mm->t->len + i_mm->t->offset) > st.st_size) {
-	    rb_raise(rb_eArgError, "invalid value for length (%d) or offset (%d)",
-		     i_mm->t->len, i_mm->t->offset);
-	}
-	if (i_mm->t->len) size = i_mm->t->len;
-	offset = i_mm->t->offset;
-#if HAVE_SEMCTL && HAVE_SHMCTL
-	if (i_mm->t->flag & MM_IPC) {
-	    key_t key;
-	    int shmid, semid, mode;
-	    union semun sem_val;
-	    struct shmid_ds buf;
-	    mm_mmap *data;
+    if (off < 0 || i_mm->t->real < (size_t)off + size) {
+	rb_raise(rb_eIndexError, "offset %ld out of mmap", NUM2LONG(voff));
+    }
+    if (modify) {
+	mm_dirty(i_mm, off, size);
+    }
+    return (char *)i_mm->t->addr + off;
+}
 
-	    if (!(vscope & MAP_SHARED)) {
-		rb_warning("Probably it will not do what you expect ...");
-	    }
-	    i_mm->t->key = -1;
-	    i_mm->t->semid = 0;
-	    if (TYPE(i_mm->t->shmid) == T_HASH) {
-		rb_iterate(rb_each, i_mm->t->shmid, mm_i_ipc, obj);
-	    }
-	    i_mm->t->shmid = 0;
-	    if (i_mm->t->semid) {
-		mode = i_mm->t->semid;
-		i_mm->t->semid = 0;
-	    }
-	    else {
-		mode = 0644;
+/*
+ * convert val for an integer field of the type name, raise RangeError
+ * when it is out of [lo, hi]
+ */
+static long long
+mm_num2range(VALUE val, long long lo, long long hi, const char *name)
+{
+    long long v = NUM2LL(val);
+
+    if (v < lo || v > hi) {
+	rb_raise(rb_eRangeError, "value out of range for %s", name);
+    }
+    return v;
+}
+
+static unsigned long long
+mm_num2u64(VALUE val)
+{
+    if (RTEST(rb_funcall(val, '<', 1, INT2FIX(0)))) {
+	rb_raise(rb_eRangeError, "value out of range for u64");
+    }
+    return NUM2ULL(val);
+}
+
+#define MM_NUM2U8(v) mm_num2range(v, 0, 0xff, "u8")
+#define MM_NUM2I8(v) mm_num2range(v, -0x80, 0x7f, "i8")
+#define MM_NUM2U16(v) mm_num2range(v, 0, 0xffff, "u16")
+#define MM_NUM2I16(v) mm_num2range(v, -0x8000, 0x7fff, "i16")
+#define MM_NUM2U32(v) mm_num2range(v, 0, 0xffffffffLL, "u32")
+#define MM_NUM2I32(v) mm_num2range(v, -0x80000000LL, 0x7fffffffLL, "i32")
+
+#define MM_BSWAP8(x) (x)
+#define MM_BSWAP16(x) __builtin_bswap16(x)
+#define MM_BSWAP32(x) __builtin_bswap32(x)
+#define MM_BSWAP64(x) __builtin_bswap64(x)
+
+/*
+ * get_TYPE(offset, order = :native) and put_TYPE(offset, value,
+ * order = :native) read and write directly in the map, without any
+ * String. mm_load_TYPE and mm_store_TYPE are also used by the layouts.
+ * An integer which don't fit in the type raise RangeError
+ */
+#define MM_SCALAR(name, type, utype, bits, to_ruby, from_ruby)		\
+static VALUE								\
+mm_load_##name(const char *ptr, int swap)				\
+{									\
+    utype u;								\
+    type v;								\
+									\
+    memcpy(&u, ptr, sizeof(u));						\
+    if (swap) u = MM_BSWAP##bits(u);					\
+    memcpy(&v, &u, sizeof(v));						\
+    return to_ruby(v);							\
+}									\
+									\
+static void								\
+mm_store_##name(char *ptr, VALUE val, int swap)				\
+{									\
+    utype u;								\
+    type v;								\
+									\
+    v = (type)from_ruby(val);						\
+    memcpy(&u, &v, sizeof(u));						\
+    if (swap) u = MM_BSWAP##bits(u);					\
+    memcpy(ptr, &u, sizeof(u));						\
+}									\
+									\
+static VALUE								\
+mm_get_##name(int argc, VALUE *argv, VALUE obj)				\
+{									\
+    VALUE voff, order;							\
+    int swap;								\
+									\
+    rb_scan_args(argc, argv, "11", &voff, &order);			\
+    swap = mm_swap_endian(order);					\
+    return mm_load_##name(mm_scalar_ptr(obj, voff, sizeof(utype), 0), swap); \
+}									\
+									\
+static VALUE								\
+mm_put_##name(int argc, VALUE *argv, VALUE obj)				\
+{									\
+    VALUE voff, val, order;						\
+    char buf[sizeof(utype)];						\
+    int swap;								\
+									\
+    rb_scan_args(argc, argv, "21", &voff, &val, &order);		\
+    swap = mm_swap_endian(order);					\
+    mm_store_##name(buf, val, swap);					\
+    memcpy(mm_scalar_ptr(obj, voff, sizeof(buf), MM_MODIFY), buf, sizeof(buf)); \
+    return val;								\
+}
+
+MM_SCALAR(u8, uint8_t, uint8_t, 8, INT2FIX, MM_NUM2U8)
+MM_SCALAR(i8, int8_t, uint8_t, 8, INT2FIX, MM_NUM2I8)
+MM_SCALAR(u16, uint16_t, uint16_t, 16, INT2FIX, MM_NUM2U16)
+MM_SCALAR(i16, int16_t, uint16_t, 16, INT2FIX, MM_NUM2I16)
+MM_SCALAR(u32, uint32_t, uint32_t, 32, UINT2NUM, MM_NUM2U32)
+MM_SCALAR(i32, int32_t, uint32_t, 32, INT2NUM, MM_NUM2I32)
+MM_SCALAR(u64, uint64_t, uint64_t, 64, ULL2NUM, mm_num2u64)
+MM_SCALAR(i64, int64_t, uint64_t, 64, LL2NUM, NUM2LL)
+MM_SCALAR(f32, float, uint32_t, 32, rb_float_new, NUM2DBL)
+MM_SCALAR(f64, double, uint64_t, 64, rb_float_new, NUM2DBL)
+
+static struct {
+    const char *name;
+    int size;
+    VALUE (*load) __((const char *, int));
+    void (*store) __((char *, VALUE, int));
+} mm_scalar_types[] = {
+    {"u8", 1, mm_load_u8, mm_store_u8},
+    {"i8", 1, mm_load_i8, mm_store_i8},
+    {"u16", 2, mm_load_u16, mm_store_u16},
+    {"i16", 2, mm_load_i16, mm_store_i16},
+    {"u32", 4, mm_load_u32, mm_store_u32},
+    {"i32", 4, mm_load_i32, mm_store_i32},
+    {"u64", 8, mm_load_u64, mm_store_u64},
+    {"i64", 8, mm_load_i64, mm_store_i64},
+    {"f32", 4, mm_load_f32, mm_store_f32},
+    {"f64", 8, mm_load_f64, mm_store_f64},
+    {0, 0, 0, 0}
+};
+
+#ifdef __ATOMIC_ACQ_REL
+/*
+ * append log : a mm_loghead at the start of the map followed by the
+ * records, aligned on 8 bytes. A producer reserve the space of its
+ * record by adding its size to tail, write it, then publish it by
+ * storing MM_LOG_COMMIT. No lock is taken
+ */
+#define MM_LOG_MAGIC "MMAPLOG1"
+#define MM_LOG_COMMIT 0x21474f4cU
+#define MM_LOG_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+typedef struct {
+    char magic[8];
+    uint64_t tail, size;
+    uint64_t pad[4];
+} mm_loghead;
+
+typedef struct {
+    uint32_t len, commit;
+} mm_logrec;
+
+/*
+ * the header and the records are accessed with 8 bytes atomics, the
+ * map (which may start at an unaligned offset) must be aligned
+ */
+static mm_loghead *
+mm_loghead_ptr(mm_ipc *i_mm)
+{
+    if ((uintptr_t)i_mm->t->addr & 7) {
+	rb_raise(rb_eArgError, "append log in a map not aligned on 8 bytes");
+    }
+    return (mm_loghead *)i_mm->t->addr;
+}
+
+static mm_loghead *
+mm_loghead_get(mm_ipc *i_mm)
+{
+    mm_loghead *head = mm_loghead_ptr(i_mm);
+
+    if (i_mm->t->real < sizeof(mm_loghead) ||
+	memcmp(head->magic, MM_LOG_MAGIC, 8) != 0) {
+	rb_raise(rb_eTypeError, "not an append log (see #log_init)");
+    }
+    if (head->size > i_mm->t->real) {
+	rb_raise(rb_eTypeError, "append log larger than the map");
+    }
+    return head;
+}
+
+/*
+ * call-seq: log_init(reset = false)
+ *
+ * format the map as an append log, which use the current size of the
+ * map (see #extend). Nothing is done if the map is already a log,
+ * unless <em>reset</em> is true. It must be called before the
+ * producers start
+ */
+static VALUE
+mm_log_init(int argc, VALUE *argv, VALUE obj)
+{
+    mm_ipc *i_mm;
+    mm_loghead *head;
+    VALUE reset;
+
+    rb_scan_args(argc, argv, "01", &reset);
+    GetMmap(obj, i_mm, MM_MODIFY);
+    if (i_mm->t->real < sizeof(mm_loghead) + sizeof(mm_logrec)) {
+	rb_raise(rb_eArgError, "map too small for an append log");
+    }
+    head = mm_loghead_ptr(i_mm);
+    if (!RTEST(reset) && memcmp(head->magic, MM_LOG_MAGIC, 8) == 0) {
+	i_mm->t->flag |= MM_SHARED;
+	return obj;
+    }
+    memset(head, 0, i_mm->t->real);
+    head->size = i_mm->t->real & ~(size_t)7;
+    __atomic_store_n(&head->tail, sizeof(mm_loghead), __ATOMIC_RELEASE);
+    memcpy(head->magic, MM_LOG_MAGIC, 8);
+    i_mm->t->flag |= MM_SHARED;
+    mm_dirty(i_mm, 0, i_mm->t->real);
+    return obj;
+}
+
+/*
+ * call-seq: log_append(str)
+ *
+ * append a record to the log, and return its offset. Several
+ * processes can append at the same time. Raise IndexError if the log
+ * is full
+ */
+static VALUE
+mm_log_append(VALUE obj, VALUE str)
+{
+    mm_ipc *i_mm;
+    mm_loghead *head;
+    mm_logrec *rec;
+    char *ptr;
+    long len;
+    size_t size, off;
+
+    /* to_str may unmap the map : convert it first */
+    StringValue(str);
+    GetMmap(obj, i_mm, MM_MODIFY);
+    ptr = RSTRING(str)->ptr;
+    len = RSTRING(str)->len;
+    head = mm_loghead_get(i_mm);
+    if ((unsigned long)len > 0xffffffffUL) {
+	rb_raise(rb_eArgError, "record too large");
+    }
+    size = MM_LOG_ALIGN(sizeof(mm_logrec) + len);
+    off = __atomic_fetch_add(&head->tail, size, __ATOMIC_ACQ_REL);
+    if (off + size > head->size) {
+	rb_raise(rb_eIndexError, "append log full");
+    }
+    rec = (mm_logrec *)((char *)i_mm->t->addr + off);
+    rec->len = len;
+    memcpy(rec + 1, ptr, len);
+    __atomic_store_n(&rec->commit, MM_LOG_COMMIT, __ATOMIC_RELEASE);
+    i_mm->t->flag |= MM_SHARED;
+    mm_dirty(i_mm, 0, sizeof(mm_loghead));
+    mm_dirty(i_mm, off, size);
+    return ULONG2NUM(off);
+}
+
+/*
+ * call-seq: log_each(offset = nil) {|record, next_offset| ... }
+ *
+ * yield the records of the log from <em>offset</em> (the first record
+ * by default) with the offset of the next record. Stop at the first
+ * record which is not yet committed, and return its offset
+ */
+static VALUE
+mm_log_each(int argc, VALUE *argv, VALUE obj)
+{
+    mm_ipc *i_mm;
+    mm_loghead *head;
+    mm_logrec *rec;
+    VALUE voff;
+    size_t off, end, next;
+
+#ifdef RETURN_ENUMERATOR
+    RETURN_ENUMERATOR(obj, argc, argv);
+#endif
+    rb_scan_args(argc, argv, "01", &voff);
+    GetMmap(obj, i_mm, 0);
+    head = mm_loghead_get(i_mm);
+    off = NIL_P(voff) ? sizeof(mm_loghead) : NUM2ULONG(voff);
+    if (off < sizeof(mm_loghead) || (off & 7)) {
+	rb_raise(rb_eArgError, "invalid offset %lu", (unsigned long)off);
+    }
+    for (;;) {
+	end = __atomic_load_n(&head->tail, __ATOMIC_ACQUIRE);
+	if (end > head->size) end = head->size;
+	if (off + sizeof(mm_logrec) > end) break;
+	rec = (mm_logrec *)((char *)i_mm->t->addr + off);
+	if (__atomic_load_n(&rec->commit, __ATOMIC_ACQUIRE) != MM_LOG_COMMIT) break;
+	next = off + MM_LOG_ALIGN(sizeof(mm_logrec) + rec->len);
+	if (next > end) break;
+	rb_yield_values(2, mm_substr(obj, i_mm, off + sizeof(mm_logrec), rec->len, 0),
+			ULONG2NUM(next));
+	GetMmap(obj, i_mm, 0);
+	head = mm_loghead_get(i_mm);
+	off = next;
+    }
+    return ULONG2NUM(off);
+}
+
+static int
+mm_atomic_width(VALUE vwidth)
+{
+    int width = NIL_P(vwidth) ? 8 : NUM2INT(vwidth);
+
+    if (width != 4 && width != 8) {
+	rb_raise(rb_eArgError, "width must be 4 or 8");
+    }
+    return width;
+}
+
+/*
+ * address of an aligned integer of 4 or 8 bytes at offset. The values
+ * must be converted before, a conversion may unmap the map
+ */
+static void *
+mm_atomic_ptr(VALUE obj, VALUE voff, int width, int modify)
+{
+    mm_ipc *i_mm;
+    long off;
+
+    off = NUM2LONG(voff);
+    GetMmap(obj, i_mm, modify);
+    if (off < 0 || i_mm->t->real < (size_t)off + width) {
+	rb_raise(rb_eIndexError, "offset %ld out of mmap", off);
+    }
+    if (((uintptr_t)i_mm->t->addr + off) % width) {
+	rb_raise(rb_eArgError, "offset %ld not aligned on %d bytes in memory", off, width);
+    }
+    if (modify) {
+	i_mm->t->flag |= MM_SHARED;
+	mm_dirty(i_mm, off, width);
+    }
+    return (char *)i_mm->t->addr + off;
+}
+
+/*
+ * call-seq: atomic_load(offset, width = 8)
+ *
+ * read atomically the integer (signed, native byte order) of
+ * <em>width</em> bytes (4 or 8) at <em>offset</em>, which must be
+ * aligned in memory on <em>width</em>. The methods which write raise
+ * RangeError for a value which doesn't fit in <em>width</em> bytes
+ */
+static VALUE
+mm_atomic_load(int argc, VALUE *argv, VALUE obj)
+{
+    VALUE voff, vwidth;
+    void *ptr;
+    int width;
+
+    rb_scan_args(argc, argv, "11", &voff, &vwidth);
+    width = mm_atomic_width(vwidth);
+    ptr = mm_atomic_ptr(obj, voff, width, 0);
+    if (width == 4) {
+	return INT2NUM(__atomic_load_n((int32_t *)ptr, __ATOMIC_SEQ_CST));
+    }
+    return LL2NUM(__atomic_load_n((int64_t *)ptr, __ATOMIC_SEQ_CST));
+}
+
+/*
+ * call-seq: atomic_store(offset, value, width = 8)
+ *
+ * write atomically <em>value</em> at <em>offset</em>
+ */
+static VALUE
+mm_atomic_store(int argc, VALUE *argv, VALUE obj)
+{
+    VALUE voff, val, vwidth;
+    void *ptr;
+    int width;
+    int64_t v;
+
+    rb_scan_args(argc, argv, "21", &voff, &val, &vwidth);
+    width = mm_atomic_width(vwidth);
+    v = (width == 4) ? MM_NUM2I32(val) : NUM2LL(val);
+    ptr = mm_atomic_ptr(obj, voff, width, MM_MODIFY);
+    if (width == 4) {
+	__atomic_store_n((int32_t *)ptr, (int32_t)v, __ATOMIC_SEQ_CST);
+    }
+    else {
+	__atomic_store_n((int64_t *)ptr, v, __ATOMIC_SEQ_CST);
+    }
+    return val;
+}
+
+/*
+ * call-seq: atomic_add(offset, value, width = 8)
+ *
+ * add atomically <em>value</em> to the integer at <em>offset</em>,
+ * and return the new value
+ */
+static VALUE
+mm_atomic_add(int argc, VALUE *argv, VALUE obj)
+{
+    VALUE voff, val, vwidth;
+    void *ptr;
+    int width;
+    int64_t v;
+
+    rb_scan_args(argc, argv, "21", &voff, &val, &vwidth);
+    width = mm_atomic_width(vwidth);
+    v = (width == 4) ? MM_NUM2I32(val) : NUM2LL(val);
+    ptr = mm_atomic_ptr(obj, voff, width, MM_MODIFY);
+    if (width == 4) {
+	return INT2NUM(__atomic_add_fetch((int32_t *)ptr, (int32_t)v,
+					  __ATOMIC_SEQ_CST));
+    }
+    return LL2NUM(__atomic_add_fetch((int64_t *)ptr, v, __ATOMIC_SEQ_CST));
+}
+
+/*
+ * call-seq: compare_and_swap(offset, expected, value, width = 8)
+ *
+ * write atomically <em>value</em> at <em>offset</em> if the integer
+ * is <em>expected</em>, and return <em>true</em> if it was written
+ */
+static VALUE
+mm_compare_and_swap(int argc, VALUE *argv, VALUE obj)
+{
+    VALUE voff, vexp, val, vwidth;
+    void *ptr;
+    int width, res;
+    int64_t e, v;
+
+    rb_scan_args(argc, argv, "31", &voff, &vexp, &val, &vwidth);
+    width = mm_atomic_width(vwidth);
+    e = (width == 4) ? MM_NUM2I32(vexp) : NUM2LL(vexp);
+    v = (width == 4) ? MM_NUM2I32(val) : NUM2LL(val);
+    ptr = mm_atomic_ptr(obj, voff, width, MM_MODIFY);
+    if (width == 4) {
+	int32_t exp = (int32_t)e;
+
+	res = __atomic_compare_exchange_n((int32_t *)ptr, &exp, (int32_t)v,
+					  0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    }
+    else {
+	res = __atomic_compare_exchange_n((int64_t *)ptr, &e, v,
+					  0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    }
+    return res ? Qtrue : Qfalse;
+}
+#endif
+
+/*
+ * call-seq: ipc_key
+ *
+ * Get the ipc key
+ */
+static VALUE
+mm_ipc_key(VALUE obj)
+{
+    mm_ipc *i_mm;
+
+    GetMmap(obj, i_mm, 0);
+    if (i_mm->t->flag & MM_IPC) {
+	return INT2NUM(i_mm->t->key);
+    }
+    return INT2NUM(-1);
+}
+
+static VALUE
+mm_i_for_fd(int fd)
+{
+    const char *mode = "r+";
+    int fl;
+
+    if ((fl = fcntl(fd, F_GETFL)) != -1) {
+	if ((fl & O_ACCMODE) == O_RDONLY) mode = "r";
+	else if ((fl & O_ACCMODE) == O_WRONLY) mode = "w";
+    }
+    return rb_funcall(rb_cIO, rb_intern("for_fd"), 2, INT2FIX(fd),
+		      rb_str_new2(mode));
+}
+
+/*
+ * call-seq: to_io
+ *
+ * return a new IO on the file of the map, for example to give a
+ * "memfd" map to another process with UNIXSocket#send_io
+ */
+static VALUE
+mm_to_io(VALUE obj)
+{
+    mm_ipc *i_mm;
+    int fd;
+
+    GetMmap(obj, i_mm, 0);
+    if (i_mm->t->fd >= 0) {
+	if ((fd = dup(i_mm->t->fd)) == -1) {
+	    rb_sys_fail("dup()");
+	}
+	return mm_i_for_fd(fd);
+    }
+    if (i_mm->t->path == (char *)-1) {
+	rb_raise(rb_eTypeError, "no file for an anonymous map");
+    }
+    return rb_funcall(rb_cFile, rb_intern("new"), 2, rb_str_new2(i_mm->t->path),
+		      rb_str_new2((i_mm->t->smode & O_RDWR) ? "r+" : "r"));
+}
+
+static VALUE
+mm_i_from_fd(VALUE *args)
+{
+    return rb_funcall2(args[0], rb_intern("new"), (int)args[1], (VALUE *)args[2]);
+}
+
+/*
+ * call-seq: from_fd(fd, mode = "r", options = {})
+ *
+ * map the file descriptor <em>fd</em> (an Integer or an IO), for
+ * example a "memfd" map received with UNIXSocket#recv_io. <em>fd</em>
+ * is not closed
+ */
+static VALUE
+mm_s_from_fd(int argc, VALUE *argv, VALUE klass)
+{
+    VALUE io, args[3], *nargv;
+    int fd, i;
+
+    if (argc < 1) {
+	rb_raise(rb_eArgError, "wrong number of arguments (0 for 1)");
+    }
+    if (rb_respond_to(argv[0], rb_intern("fileno"))) {
+	fd = NUM2INT(rb_funcall2(argv[0], rb_intern("fileno"), 0, 0));
+    }
+    else {
+	fd = NUM2INT(argv[0]);
+    }
+    if ((fd = dup(fd)) == -1) {
+	rb_sys_fail("dup()");
+    }
+    io = mm_i_for_fd(fd);
+    nargv = ALLOCA_N(VALUE, argc);
+    nargv[0] = io;
+    for (i = 1; i < argc; i++) {
+	nargv[i] = argv[i];
+    }
+    args[0] = klass;
+    args[1] = (VALUE)argc;
+    args[2] = (VALUE)nargv;
+    /* the map keep its own descriptor */
+    return rb_ensure(mm_i_from_fd, (VALUE)args, rb_io_close, io);
+}
+
+#if HAVE_MEMFD_CREATE && defined(F_ADD_SEALS)
+/*
+ * call-seq: seal(*seals)
+ *
+ * add the seals to a "memfd" map : :seal, :shrink, :grow, :write,
+ * :future_write or the values <em>Mmap::F_SEAL_*</em>. With :write
+ * the map is first remapped read-only, and frozen. The other writable
+ * maps of the file must be unmapped before
+ */
+static VALUE
+mm_seal(int argc, VALUE *argv, VALUE obj)
+{
+    static const struct {
+	const char *name;
+	int seal;
+    } seals[] = {
+	{"seal", F_SEAL_SEAL},
+	{"shrink", F_SEAL_SHRINK},
+	{"grow", F_SEAL_GROW},
+	{"write", F_SEAL_WRITE},
+#ifdef F_SEAL_FUTURE_WRITE
+	{"future_write", F_SEAL_FUTURE_WRITE},
+#endif
+	{0, 0}
+    };
+    mm_ipc *i_mm;
+    const char *name;
+    int i, j, seal = 0;
+
+    GetMmap(obj, i_mm, 0);
+    if (i_mm->t->fd < 0) {
+	rb_raise(rb_eTypeError, "seal for a map without file descriptor");
+    }
+    for (i = 0; i < argc; i++) {
+	if (FIXNUM_P(argv[i])) {
+	    seal |= FIX2INT(argv[i]);
+	    continue;
+	}
+	name = SYMBOL_P(argv[i]) ? rb_id2name(SYM2ID(argv[i])) : StringValuePtr(argv[i]);
+	for (j = 0; seals[j].name; j++) {
+	    if (strcmp(seals[j].name, name) == 0) break;
+	}
+	if (!seals[j].name) {
+	    rb_raise(rb_eArgError, "unknown seal `%s'", name);
+	}
+	seal |= seals[j].seal;
+    }
+    if ((seal & F_SEAL_WRITE) && (i_mm->t->pmode & PROT_WRITE)) {
+	char path[64];
+	void *addr;
+	int fd;
+
+	/*
+	 * F_SEAL_WRITE fail with EBUSY while a shared map can be made
+	 * writable : map again the same pages from a read-only descriptor
+	 */
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", i_mm->t->fd);
+	if ((fd = open(path, O_RDONLY)) == -1) {
+	    rb_sys_fail(path);
+	}
+	addr = mmap(MM_BASE(i_mm->t), MM_MAPLEN(i_mm->t), PROT_READ,
+		    MAP_SHARED | MAP_FIXED, fd, i_mm->t->offset - i_mm->t->delta);
+	close(fd);
+	if (addr == MAP_FAILED) {
+	    rb_sys_fail("mmap()");
+	}
+	i_mm->t->pmode = PROT_READ;
+	i_mm->t->smode = O_RDONLY;
+	i_mm->t->flag |= MM_FROZEN;
+	rb_obj_freeze(obj);
+    }
+    if (fcntl(i_mm->t->fd, F_ADD_SEALS, seal) == -1) {
+	rb_sys_fail("fcntl(F_ADD_SEALS)");
+    }
+    return obj;
+}
+
+/*
+ * call-seq: seals
+ *
+ * return the seals of the file (the values <em>Mmap::F_SEAL_*</em>)
+ */
+static VALUE
+mm_seals(VALUE obj)
+{
+    mm_ipc *i_mm;
+    int seals;
+
+    GetMmap(obj, i_mm, 0);
+    if (i_mm->t->fd < 0) {
+	return INT2FIX(0);
+    }
+    if ((seals = fcntl(i_mm->t->fd, F_GET_SEALS)) == -1) {
+	if (errno == EINVAL) return INT2FIX(0);
+	rb_sys_fail("fcntl(F_GET_SEALS)");
+    }
+    return INT2FIX(seals);
+}
+#endif
+
+static void *
+mm_i_unmap(void *ptr)
+{
+    mm_st *st_mm = (mm_st *)ptr;
+    mm_mmap *t = st_mm->i_mm->t;
+
+    munmap(MM_BASE(t), MM_MAPLEN(t));
+    if (t->fd >= 0) {
+	close(t->fd);
+	t->fd = -1;
+    }
+    if (t->path != (char *)-1) {
+	if (t->real < t->len && t->vscope != MAP_PRIVATE &&
+	    truncate(t->path, t->real) == -1) {
+	    st_mm->error = 1;
+	}
+    }
+    st_mm->done = 1;
+    return 0;
+}
+
+/*
+ * Document-method: munmap
+ * Document-method: unmap
+ *
+ * call-seq: munmap
+ *
+ * terminate the association
+ */
+static VALUE
+mm_unmap(VALUE obj)
+{
+    mm_ipc *i_mm;
+    mm_st st_mm;
+
+    GetMmap(obj, i_mm, 0);
+    if (i_mm->t->path) {
+	mm_prefetch_stop(i_mm);
+	mm_lindex_free(i_mm);
+	mm_lock(i_mm, Qtrue);
+	st_mm.i_mm = i_mm;
+	st_mm.error = 0;
+	mm_nogvl(&st_mm, mm_i_unmap, 1);
+	if (i_mm->t->path != (char *)-1) {
+	    free(i_mm->t->path);
+	}
+	i_mm->t->path = '\0';
+	mm_unlock(i_mm);
+	if (st_mm.error) {
+	    rb_raise(rb_eTypeError, "truncate");
+	}
+    }
+    return Qnil;
+}
+
+/*
+ * call-seq: freeze
+ *
+ * freeze the current file 
+ */
+static VALUE
+mm_freeze(VALUE obj)
+{
+    mm_ipc *i_mm;
+    rb_obj_freeze(obj);
+    GetMmap(obj, i_mm, 0);
+    i_mm->t->flag |= MM_FROZEN;
+    return obj;
+}
+
+static VALUE
+mm_str(VALUE obj, int modify)
+{
+    mm_ipc *i_mm;
+    VALUE ret = Qnil;
+
+    GetMmap(obj, i_mm, modify & ~MM_ORIGIN);
+    if (modify & MM_MODIFY) {
+	if (i_mm->t->flag & MM_FROZEN) rb_error_frozen("mmap");
+	if (!OBJ_TAINTED(ret) && rb_safe_level() >= 4)
+	    rb_raise(rb_eSecurityError, "Insecure: can't modify mmap");
+    }
+    ret = rb_obj_alloc(rb_cString);
+    if (rb_obj_tainted(obj)) {
+	OBJ_TAINT(ret);
+    }
+    RSTRING(ret)->ptr = i_mm->t->addr;
+    RSTRING(ret)->len = i_mm->t->real;
+    if (modify & MM_ORIGIN) {
+	RSTRING(ret)->aux.shared = ret;
+	FL_SET(ret, ELTS_SHARED);
+    }
+    if (i_mm->t->flag & MM_FROZEN) {
+	ret = rb_obj_freeze(ret);
+    }
+    return ret;
+}
+
+/*
+ * call-seq: to_str
+ *
+ * Convert object to a string
+ */
+static VALUE
+mm_to_str(VALUE obj)
+{
+    return mm_str(obj, MM_ORIGIN);
+}
+ 
+extern char *ruby_strdup();
+
+#define MM_EXP_MUNMAP   1
+#define MM_EXP_OPEN     2
+#define MM_EXP_LSEEK    3
+#define MM_EXP_EXTEND   4
+#define MM_EXP_TRUNCATE 5
+#define MM_EXP_MMAP     6
+#define MM_EXP_MREMAP   7
+#define MM_EXP_MADVISE  8
+#define MM_EXP_MLOCK    9
+
+static void *
+mm_i_expand_nogvl(void *ptr)
+{
+    mm_st *st_mm = (mm_st *)ptr;
+    mm_ipc *i_mm = st_mm->i_mm;
+    size_t len = st_mm->len;
+#if HAVE_MREMAP && defined(MREMAP_MAYMOVE)
+    MMAP_RETTYPE addr;
+
+    st_mm->done = 1;
+    if (len > i_mm->t->len && truncate(i_mm->t->path, len) == -1) {
+	st_mm->error = MM_EXP_EXTEND;
+	return 0;
+    }
+    addr = mremap(i_mm->t->addr, i_mm->t->len, len, MREMAP_MAYMOVE);
+    if (addr == MAP_FAILED) {
+	st_mm->error = MM_EXP_MREMAP;
+	st_mm->err = errno;
+	return 0;
+    }
+    i_mm->t->addr = addr;
+    if (len < i_mm->t->len && truncate(i_mm->t->path, len) == -1) {
+	i_mm->t->len = len;
+	st_mm->error = MM_EXP_TRUNCATE;
+	return 0;
+    }
+#else
+    int fd;
+
+    st_mm->done = 1;
+    if (munmap(i_mm->t->addr, i_mm->t->len)) {
+	st_mm->error = MM_EXP_MUNMAP;
+	return 0;
+    }
+    if ((fd = open(i_mm->t->path, i_mm->t->smode)) == -1) {
+	st_mm->error = MM_EXP_OPEN;
+	return 0;
+    }
+    if (len > i_mm->t->len) {
+	if (lseek(fd, len - i_mm->t->len - 1, SEEK_END) == -1) {
+	    st_mm->error = MM_EXP_LSEEK;
+	    return 0;
+	}
+	if (write(fd, "\000", 1) != 1) {
+	    st_mm->error = MM_EXP_EXTEND;
+	    return 0;
+	}
+    }
+    else if (len < i_mm->t->len && truncate(i_mm->t->path, len) == -1) {
+	st_mm->error = MM_EXP_TRUNCATE;
+	return 0;
+    }
+    i_mm->t->addr = mmap(0, len, i_mm->t->pmode, i_mm->t->vscope, fd, i_mm->t->offset);
+    close(fd);
+    if (i_mm->t->addr == MAP_FAILED) {
+	st_mm->error = MM_EXP_MMAP;
+	return 0;
+    }
+#endif
+#ifdef MADV_NORMAL
+    if (i_mm->t->advice && madvise(i_mm->t->addr, len, i_mm->t->advice) == -1) {
+	st_mm->error = MM_EXP_MADVISE;
+	st_mm->err = errno;
+	return 0;
+    }
+#endif
+#ifdef MADV_HUGEPAGE
+    if (i_mm->t->flag & MM_THP) {
+	madvise(i_mm->t->addr, len, MADV_HUGEPAGE);
+    }
+#endif
+    if ((i_mm->t->flag & MM_LOCK) && mlock(i_mm->t->addr, len) == -1) {
+	st_mm->error = MM_EXP_MLOCK;
+	st_mm->err = errno;
+	return 0;
+    }
+    i_mm->t->len  = len;
+    return 0;
+}
+
+static VALUE
+mm_i_expand(mm_st *st_mm)
+{
+    mm_ipc *i_mm = st_mm->i_mm;
+    size_t len;
+
+    if (i_mm->t->hugepage) {
+	st_mm->len = MM_HUGE_ROUND(st_mm->len, i_mm->t->hugepage);
+    }
+    len = st_mm->len;
+    st_mm->error = st_mm->err = 0;
+    /* the map may move : stop the prefetch thread, like munmap */
+    mm_prefetch_stop(i_mm);
+    mm_nogvl(st_mm, mm_i_expand_nogvl, 1);
+    switch (st_mm->error) {
+      case MM_EXP_MUNMAP:
+	rb_raise(rb_eArgError, "munmap failed");
+      case MM_EXP_OPEN:
+	rb_raise(rb_eArgError, "Can't open %s", i_mm->t->path);
+      case MM_EXP_LSEEK:
+	rb_raise(rb_eIOError, "Can't lseek %d", len - i_mm->t->len - 1);
+      case MM_EXP_EXTEND:
+	rb_raise(rb_eIOError, "Can't extend %s", i_mm->t->path);
+      case MM_EXP_TRUNCATE:
+	rb_raise(rb_eIOError, "Can't truncate %s", i_mm->t->path);
+      case MM_EXP_MMAP:
+	rb_raise(rb_eArgError, "mmap failed");
+      case MM_EXP_MREMAP:
+	rb_raise(rb_eArgError, "mremap failed (%d)", st_mm->err);
+      case MM_EXP_MADVISE:
+	rb_raise(rb_eArgError, "madvise(%d)", st_mm->err);
+      case MM_EXP_MLOCK:
+	rb_raise(rb_eArgError, "mlock(%d)", st_mm->err);
+    }
+    return Qnil;
+}
+
+static void
+mm_expandf(mm_ipc *i_mm, size_t len)
+{
+    int status;
+    mm_st st_mm;
+
+    if (i_mm->t->vscope == MAP_PRIVATE) {
+	rb_raise(rb_eTypeError, "expand for a private map");
+    }
+    if (i_mm->t->flag & MM_FIXED) {
+	rb_raise(rb_eTypeError, "expand for a fixed map");
+    }
+    if (!i_mm->t->path || i_mm->t->path == (char *)-1) {
+	rb_raise(rb_eTypeError, "expand for an anonymous map");
+    }
+    st_mm.i_mm = i_mm;
+    st_mm.len = len;
+    if (i_mm->t->flag & MM_IPC) {
+	mm_lock(i_mm, Qtrue);
+	rb_protect((VALUE (*)(VALUE))mm_i_expand, (VALUE)&st_mm, &status);
+	mm_unlock(i_mm);
+	if (status) {
+	    rb_jump_tag(status);
+	}
+    }
+    else {
+	mm_i_expand(&st_mm);
+    }
+}
+
+/*
+ * the map grows by at least "increment" bytes, and by
+ * len * ("growth" - 1) bytes (at most "max_increment") so that
+ * repeated appends only remap a logarithmic number of times
+ */
+static void
+mm_realloc(mm_ipc *i_mm, size_t len)
+{
+    size_t incr;
+
+    if (i_mm->t->flag & MM_FROZEN) rb_error_frozen("mmap");
+    if (len > i_mm->t->len) {
+	incr = i_mm->t->incr;
+	if (i_mm->t->growth > 1.0) {
+	    size_t geo = (size_t)(i_mm->t->len * (i_mm->t->growth - 1.0));
+
+	    if (i_mm->t->max_incr && geo > i_mm->t->max_incr) {
+		geo = i_mm->t->max_incr;
+	    }
+	    if (geo > incr) incr = geo;
+	}
+	if ((len - i_mm->t->len) < incr) {
+	    len = i_mm->t->len + incr;
+	}
+	mm_expandf(i_mm, len);
+    }
+}
+
+/*
+ * call-seq:
+ *   extend(count)
+ *
+ * add <em>count</em> bytes to the file (i.e. pre-extend the file) 
+ */
+static VALUE
+mm_extend(VALUE obj, VALUE a)
+{
+    mm_ipc *i_mm;
+    long len;
+
+    GetMmap(obj, i_mm, MM_MODIFY);
+    len = NUM2LONG(a);
+    if (len > 0) {
+	mm_expandf(i_mm, i_mm->t->len + len);
+    }
+    return UINT2NUM(i_mm->t->len);
+}
+
+/*
+ * default size of the huge pages, given by /proc/meminfo
+ */
+static size_t
+mm_hugepagesize(void)
+{
+    static size_t size = 0;
+    char line[128];
+    unsigned long kb;
+    FILE *f;
+
+    if (size) return size;
+    size = 2 * 1024 * 1024;
+    if ((f = fopen("/proc/meminfo", "r")) != NULL) {
+	while (fgets(line, sizeof(line), f)) {
+	    if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1) {
+		size = kb * 1024;
+		break;
+	    }
+	}
+	fclose(f);
+    }
+    return size;
+}
+
+/*
+ * "hugepages" => true use MAP_HUGETLB for an anonymous map, and
+ * fall back on the transparent huge pages when none is reserved,
+ * :transparent only give MADV_HUGEPAGE, a size (2 Mb, 1 Gb) select
+ * the huge pages of this size
+ */
+static void
+mm_i_hugepages(mm_ipc *i_mm, VALUE value)
+{
+    const char *s;
+    size_t size;
+
+    if (!RTEST(value)) return;
+    if (value == Qtrue) {
+	i_mm->t->flag |= MM_HUGETLB | MM_THP;
+	return;
+    }
+    if (SYMBOL_P(value) || TYPE(value) == T_STRING) {
+	s = SYMBOL_P(value) ? rb_id2name(SYM2ID(value)) : StringValuePtr(value);
+	if (strcmp(s, "transparent") != 0) {
+	    rb_raise(rb_eArgError, "Invalid value for hugepages %s", s);
+	}
+	i_mm->t->flag |= MM_THP;
+	return;
+    }
+    size = NUM2ULONG(value);
+    if (size < mm_pagesize || (size & (size - 1))) {
+	rb_raise(rb_eArgError, "Invalid value for hugepages %lu",
+		 (unsigned long)size);
+    }
+    i_mm->t->flag |= MM_HUGETLB;
+    i_mm->t->hugepage = size;
+}
+
+static VALUE
+mm_i_options(VALUE arg, VALUE obj)
+{
+    mm_ipc *i_mm;
+    char *options;
+    VALUE key, value;
+
+    Data_Get_Struct(obj, mm_ipc, i_mm);
+    key = rb_ary_entry(arg, 0);
+    value = rb_ary_entry(arg, 1);
+    key = rb_obj_as_string(key);
+    options = StringValuePtr(key);
+    if (strcmp(options, "length") == 0) {
+	i_mm->t->len = NUM2UINT(value);
+	if (i_mm->t->len <= 0) {
+	    rb_raise(rb_eArgError, "Invalid value for length %d", i_mm->t->len);
+	}
+	i_mm->t->flag |= MM_FIXED;
+    }
+    else if (strcmp(options, "offset") == 0) {
+	i_mm->t->offset = NUM2LL(value);
+	if (i_mm->t->offset < 0) {
+	    rb_raise(rb_eArgError, "Invalid value for offset %lld",
+		     (long long)i_mm->t->offset);
+	}
+	i_mm->t->flag |= MM_FIXED;
+    }
+    else if (strcmp(options, "advice") == 0) {
+	i_mm->t->advice = NUM2INT(value);
+    }
+    else if (strcmp(options, "increment") == 0) {
+	int incr =  NUM2INT(value);
+	if (incr < 0) {
+	    rb_raise(rb_eArgError, "Invalid value for increment %d", incr);
+	}
+	i_mm->t->incr = incr;
+    }
+    else if (strcmp(options, "growth") == 0) {
+	double growth = NUM2DBL(value);
+	if (growth < 1.0) {
+	    rb_raise(rb_eArgError, "Invalid value for growth %f", growth);
+	}
+	i_mm->t->growth = growth;
+    }
+    else if (strcmp(options, "max_increment") == 0) {
+	long max_incr = NUM2LONG(value);
+	if (max_incr < 0) {
+	    rb_raise(rb_eArgError, "Invalid value for max_increment %ld", max_incr);
+	}
+	i_mm->t->max_incr = max_incr;
+    }
+    else if (strcmp(options, "initialize") == 0) {
+    }
+    else if (strcmp(options, "populate") == 0) {
+    }
+    else if (strcmp(options, "memfd") == 0) {
+    }
+    else if (strcmp(options, "hugepages") == 0) {
+	mm_i_hugepages(i_mm, value);
+    }
+    else if (strcmp(options, "readahead") == 0) {
+	if (value == Qtrue) {
+	    i_mm->readahead = EXP_READAHEAD_SIZE;
+	}
+	else if (RTEST(value)) {
+	    long readahead = NUM2LONG(value);
+	    if (readahead < 0) {
+		rb_raise(rb_eArgError, "Invalid value for readahead %ld", readahead);
+	    }
+	    i_mm->readahead = readahead;
+	}
+    }
+#if HAVE_SEMCTL && HAVE_SHMCTL
+    else if (strcmp(options, "ipc") == 0) {
+	if (value != Qtrue && TYPE(value) != T_HASH) {
+	    rb_raise(rb_eArgError, "Expected an Hash for :ipc");
+	}
+	i_mm->t->shmid = value;
+	i_mm->t->flag |= (MM_IPC | MM_TMP);
+    }
+#endif
+    else {
+	rb_warning("Unknown option `%s'", options);
+    }
+    return Qnil;
+}
+
+#if HAVE_SEMCTL && HAVE_SHMCTL
+
+static VALUE
+mm_i_ipc(VALUE arg, VALUE obj)
+{
+    mm_ipc *i_mm;
+    char *options;
+    VALUE key, value;
+
+    Data_Get_Struct(obj, mm_ipc, i_mm);
+    key = rb_ary_entry(arg, 0);
+    value = rb_ary_entry(arg, 1);
+    key = rb_obj_as_string(key);
+    options = StringValuePtr(key);
+    if (strcmp(options, "key") == 0) {
+	i_mm->t->key = rb_funcall2(value, rb_intern("to_int"), 0, 0);
+    }
+    else if (strcmp(options, "permanent") == 0) {
+	if (RTEST(value)) {
+	    i_mm->t->flag &= ~MM_TMP;
+	}
+    }
+    else if (strcmp(options, "mode") == 0) {
+	i_mm->t->semid = NUM2INT(value);
+    }
+    else {
+	rb_warning("Unknown option `%s'", options);
+    }
+    return Qnil;
+}
+
+#endif
+
+/*
+ * call-seq:
+ *  new(file, mode = "r", protection = Mmap::MAP_SHARED, options = {})
+ *
+ * create a new Mmap object
+ * 
+ * * <em>file</em>
+ * 
+ *   Pathname of the file, if <em>nil</em> is given an anonymous map
+ *   is created <em>Mmanp::MAP_ANON</em>
+ * 
+ * * <em>mode</em>
+ * 
+ *   Mode to open the file, it can be "r", "w", "rw", "a"
+ * 
+ * * <em>protection</em>
+ * 
+ *   specify the nature of the mapping
+ * 
+ *   * <em>Mmap::MAP_SHARED</em>
+ * 
+ *     Creates a mapping that's shared with all other processes 
+ *     mapping the same areas of the file. 
+ *     The default value is <em>Mmap::MAP_SHARED</em>
+ * 
+ *   * <em>Mmap::MAP_PRIVATE</em>
+ * 
+ *     Creates a private copy-on-write mapping, so changes to the
+ *     contents of the mmap object will be private to this process
+ * 
+ * * <em>options</em>
+ * 
+ *   Hash. If one of the options <em>length</em> or <em>offset</em>
+ *   is specified it will not possible to modify the size of
+ *   the mapped file.
+ * 
+ *   length:: maps <em>length</em> bytes from the file
+ * 
+ *   offset:: the mapping begin at <em>offset</em>, which doesn't need
+ *   to be aligned on a page
+ * 
+ *   advice:: the type of the access (see #madvise)
+ *
+ *   increment:: the minimum number of bytes added when the map grows
+ *
+ *   growth:: the map grows by <em>size * (growth - 1)</em> bytes
+ *   (default 2.0, i.e. the size is doubled). With 1.0 only
+ *   <em>increment</em> is used
+ *
+ *   max_increment:: upper limit for a geometric growth step
+ *   (default 64 Mb, 0 means no limit)
+ *
+ *   readahead:: size of the window prefetched in background ahead of
+ *   the current position of #each_line, #each_byte and #scan
+ *   (<em>true</em> means 8 Mb)
+ *
+ *   populate:: fault in all the pages before returning : with
+ *   MAP_POPULATE for a small map, or with MADV_POPULATE_READ or
+ *   MADV_POPULATE_WRITE split across several threads (see #populate).
+ *   <em>:read</em> or <em>:write</em> select the access, <em>true</em>
+ *   is :write for an anonymous map and :read otherwise
+ *
+ *   memfd:: an anonymous map is backed by a file created with
+ *   memfd_create(2) (<em>memfd</em> can be its name), which accept
+ *   the seals (see #seal) and can be given to other processes with
+ *   #to_io
+ *
+ *   hugepages:: <em>true</em> map an anonymous map with huge pages
+ *   (MAP_HUGETLB), or with transparent huge pages when none is
+ *   reserved; <em>:transparent</em> only advise MADV_HUGEPAGE; a size
+ *   (2 Mb, 1 Gb) select the huge pages of this size. The length is
+ *   rounded to a multiple of the huge pages. A file in hugetlbfs is
+ *   always mapped with its huge pages
+ */
+static VALUE
+mm_s_new(int argc, VALUE *argv, VALUE obj)
+{
+    VALUE res = rb_funcall2(obj, rb_intern("allocate"), 0, 0);
+    rb_obj_call_init(res, argc, argv);
+    return res;
+}
+
+static VALUE
+mm_s_alloc(VALUE obj)
+{
+    VALUE res;
+    mm_ipc *i_mm;
+
+    res = Data_Make_Struct(obj, mm_ipc, mm_mark, mm_free, i_mm);
+    i_mm->wowner = Qnil;
+    i_mm->readers = Qnil;
+    i_mm->waiters = Qnil;
+    i_mm->t = ALLOC_N(mm_mmap, 1);
+    MEMZERO(i_mm->t, mm_mmap, 1);
+    i_mm->t->incr = EXP_INCR_SIZE;
+    i_mm->t->growth = EXP_GROWTH;
+    i_mm->t->max_incr = EXP_MAX_INCR_SIZE;
+    i_mm->t->fd = -1;
+    return res;
+}
+
+/*
+ * call-seq: initialize
+ *
+ * Create a new Mmap object
+ */
+static VALUE
+mm_init(int argc, VALUE *argv, VALUE obj)
+{
+    struct stat st;
+    int fd, smode = 0, pmode = 0, vscope, perm, init;
+    MMAP_RETTYPE addr;
+    VALUE fname, fdv, vmode, scope, options, vpop, vmemfd;
+    mm_ipc *i_mm;
+    char *path, *mode;
+    size_t size = 0, mlen, hugetlbfs = 0, delta = 0;
+    off_t offset;
+    int anonymous, hflags = 0, populate = 0, pwrite = 0, memfd = 0;
+
+    options = Qnil;
+    if (argc > 1 && TYPE(argv[argc - 1]) == T_HASH) {
+	options = argv[argc - 1];
+	argc--;
+    }
+    rb_scan_args(argc, argv, "12", &fname, &vmode, &scope);
+    vscope = 0;
+    path = 0;
+    fd = -1;
+    anonymous = 0;
+    fdv = Qnil;
+#ifdef MAP_ANON
+    if (NIL_P(fname)) {
+	vscope = MAP_ANON | MAP_SHARED;
+	anonymous = 1;
+    }
+    else 
+#endif
+    {
+	if (rb_safe_level() > 0 && OBJ_TAINTED(fname)){
+	    rb_raise(rb_eSecurityError, "Insecure operation");
+	}
+	rb_secure(4);
+	if (rb_respond_to(fname, rb_intern("fileno"))) {
+	    fdv = rb_funcall2(fname, rb_intern("fileno"), 0, 0);
+	}
+	if (NIL_P(fdv)) {
+	    fname = rb_str_to_str(fname);
+	    SafeStringValue(fname);
+	    path = StringValuePtr(fname);
+	}
+	else {
+	    fd = NUM2INT(fdv);
+	    if (fd < 0) {
+		rb_raise(rb_eArgError, "invalid file descriptor %d", fd);
+	    }
+	}
+	if (!NIL_P(scope)) {
+	    vscope = NUM2INT(scope);
+#ifdef MAP_ANON
+	    if (vscope & MAP_ANON) {
+		rb_raise(rb_eArgError, "filename specified for an anonymous map");
+	    }
+#endif
+	}
+    }
+    vscope |= NIL_P(scope) ? MAP_SHARED : NUM2INT(scope);
+    size = 0;
+    perm = 0666;
+    if (!anonymous) {
+	if (NIL_P(vmode)) {
+	    mode = "r";
+	}
+	else if (rb_respond_to(vmode, rb_intern("to_ary"))) {
+            VALUE tmp;
+
+            vmode = rb_convert_type(vmode, T_ARRAY, "Array", "to_ary");
+            if (RARRAY(vmode)->len != 2) {
+                rb_raise(rb_eArgError, "Invalid length %d (expected 2)",
+                         RARRAY(vmode)->len);
+            }
+	    tmp = RARRAY(vmode)->ptr[0];
+	    mode = StringValuePtr(tmp);
+	    perm = NUM2INT(RARRAY(vmode)->ptr[1]);
+	}
+	else {
+	    mode = StringValuePtr(vmode);
+	}
+	if (strcmp(mode, "r") == 0) {
+	    smode = O_RDONLY;
+	    pmode = PROT_READ;
+	}
+	else if (strcmp(mode, "w") == 0) {
+	    smode = O_RDWR | O_TRUNC;
+	    pmode = PROT_READ | PROT_WRITE;
+	}
+	else if (strcmp(mode, "rw") == 0 || strcmp(mode, "wr") == 0) {
+	    smode = O_RDWR;
+	    pmode = PROT_READ | PROT_WRITE;
+	}
+	else if (strcmp(mode, "a") == 0) {
+	    smode = O_RDWR | O_CREAT;
+	    pmode = PROT_READ | PROT_WRITE;
+	}
+	else {
+	    rb_raise(rb_eArgError, "Invalid mode %s", mode);
+	}
+	if (NIL_P(fdv)) {
+	    if ((fd = open(path, smode, perm)) == -1) {
+		rb_raise(rb_eArgError, "Can't open %s", path);
+	    }
+	}
+	if (fstat(fd, &st) == -1) {
+	    rb_raise(rb_eArgError, "Can't stat %s", path);
+	}
+	size = st.st_size;
+#if HAVE_SYS_VFS_H
+	{
+	    struct statfs sfs;
+
+	    if (fstatfs(fd, &sfs) == 0 && sfs.f_type == HUGETLBFS_MAGIC) {
+		hugetlbfs = sfs.f_bsize;
+	    }
+	}
+#endif
+    }
+    else {
+	fd = -1;
+	if (!NIL_P(vmode) && TYPE(vmode) != T_STRING) {
+	    size = NUM2INT(vmode);
+	}
+    }
+    Data_Get_Struct(obj, mm_ipc, i_mm);
+    if (i_mm->t->flag & MM_FROZEN) {
+	rb_raise(rb_eArgError, "frozen mmap");
+    }
+    i_mm->t->shmid = 0;
+    i_mm->t->semid = 0;
+    offset = 0;
+    if (options != Qnil) {
+	rb_iterate(rb_each, options, mm_i_options, obj);
+	if (path && (i_mm->t->len + i_mm->t->offset) > st.st_size) {
+	    rb_raise(rb_eArgError, "invalid value for length (%d) or offset (%d)",
+		     i_mm->t->len, i_mm->t->offset);
+	}
+	offset = i_mm->t->offset;
+	if (i_mm->t->len) size = i_mm->t->len;
+	else if (!anonymous) {
+	    if ((size_t)offset > size) {
+		rb_raise(rb_eArgError, "offset (%ld) beyond the end of the file (%ld)",
+			 (long)offset, (long)size);
+	    }
+	    size -= offset;
+	}
+#if HAVE_SEMCTL && HAVE_SHMCTL
+	if (i_mm->t->flag & MM_IPC) {
+	    key_t key;
+	    int shmid, semid, mode;
+	    union semun sem_val;
+	    struct shmid_ds buf;
+	    mm_mmap *data;
+
+	    if (!(vscope & MAP_SHARED)) {
+		rb_warning("Probably it will not do what you expect ...");
+	    }
+	    i_mm->t->key = -1;
+	    i_mm->t->semid = 0;
+	    if (TYPE(i_mm->t->shmid) == T_HASH) {
+		rb_iterate(rb_each, i_mm->t->shmid, mm_i_ipc, obj);
+	    }
+	    i_mm->t->shmid = 0;
+	    if (i_mm->t->semid) {
+		mode = i_mm->t->semid;
+		i_mm->t->semid = 0;
+	    }
+	    else {
+		mode = 0644;
 	    }
 	    if ((int)i_mm->t->key <= 0) {
 		mode |= IPC_CREAT;
@@ -774,1403 +2591,5677 @@ mm_init(int argc, VALUE *argv, VALUE obj)
 		}
 	    }
 	    else {
-		key = (key_t)i_mm->t->key;
+		key = (key_t)i_mm->t->key;
+	    }
+	    if ((shmid = shmget(key, sizeof(mm_ipc), mode)) == -1) {
+		rb_sys_fail("shmget()");
+	    }
+	    data = shmat(shmid, (void *)0, 0);
+	    if (data == (mm_mmap *)-1) {
+		rb_sys_fail("shmat()");
+	    }
+	    if (i_mm->t->flag & MM_TMP) {
+		if (shmctl(shmid, IPC_RMID, &buf) == -1) {
+		    rb_sys_fail("shmctl()");
+		}
+	    }
+	    if ((semid = semget(key, 2, mode)) == -1) {
+		rb_sys_fail("semget()");
+	    }
+	    if (mode & IPC_CREAT) {
+		sem_val.val = 1;
+		if (semctl(semid, 0, SETVAL, sem_val) == -1) {
+		    rb_sys_fail("semctl()");
+		}
+		sem_val.val = 0;
+		if (semctl(semid, 1, SETVAL, sem_val) == -1) {
+		    rb_sys_fail("semctl()");
+		}
+	    }
+	    memcpy(data, i_mm->t, sizeof(mm_mmap));
+	    free(i_mm->t);
+	    i_mm->t = data;
+	    i_mm->t->key = key;
+	    i_mm->t->semid = semid;
+	    i_mm->t->shmid = shmid;
+	    if (i_mm->t->flag & MM_TMP) {
+		i_mm->t->template = ALLOC_N(char, strlen(template) + 1);
+		strcpy(i_mm->t->template, template);
+	    }
+        }
+#endif
+    }
+    init = 0;
+    if (hugetlbfs) {
+	/* the size of a file in hugetlbfs is a multiple of its pages */
+	i_mm->t->flag = (i_mm->t->flag & ~MM_THP) | MM_HUGETLB;
+	i_mm->t->hugepage = hugetlbfs;
+    }
+    else if (!anonymous && (i_mm->t->flag & MM_HUGETLB)) {
+	i_mm->t->flag = (i_mm->t->flag & ~MM_HUGETLB) | MM_THP;
+	i_mm->t->hugepage = 0;
+    }
+    if (anonymous) {
+	if (size <= 0) {
+	    rb_raise(rb_eArgError, "length not specified for an anonymous map");
+	}
+	if (offset) {
+	    rb_warning("Ignoring offset for an anonymous map");
+	    offset = 0;
+	}
+	smode = O_RDWR;
+	pmode = PROT_READ | PROT_WRITE;
+	i_mm->t->flag |= MM_FIXED | MM_ANON;
+#ifdef MAP_HUGETLB
+	if (i_mm->t->flag & MM_HUGETLB) {
+	    hflags = MAP_HUGETLB;
+	    if (i_mm->t->hugepage) {
+		size_t huge = i_mm->t->hugepage;
+		int shift = 0;
+
+		while (huge >>= 1) shift++;
+		hflags |= shift << MAP_HUGE_SHIFT;
+	    }
+	    else {
+		i_mm->t->hugepage = mm_hugepagesize();
 	    }
-	    if ((shmid = shmget(key, sizeof(mm_ipc), mode)) == -1) {
-		rb_sys_fail("shmget()");
+	}
+#endif
+	vmemfd = mm_i_optval(options, "memfd");
+	if (RTEST(vmemfd)) {
+#if HAVE_MEMFD_CREATE
+	    unsigned int mflags = MFD_CLOEXEC | MFD_ALLOW_SEALING;
+	    const char *name = "ruby_mmap";
+
+	    if (TYPE(vmemfd) == T_STRING) {
+		name = StringValuePtr(vmemfd);
 	    }
-	    data = shmat(shmid, (void *)0, 0);
-	    if (data == (mm_mmap *)-1) {
-		rb_sys_fail("shmat()");
+#ifdef MAP_HUGETLB
+	    if (hflags & MAP_HUGETLB) {
+		/* memfd_create use the same encoding of the size */
+		mflags |= MFD_HUGETLB | (hflags & (0x3f << MAP_HUGE_SHIFT));
 	    }
-	    if (i_mm->t->flag & MM_TMP) {
-		if (shmctl(shmid, IPC_RMID, &buf) == -1) {
-		    rb_sys_fail("shmctl()");
+#endif
+	    fd = memfd_create(name, mflags);
+#ifdef MAP_HUGETLB
+	    if (fd == -1 && hflags && (i_mm->t->flag & MM_THP)) {
+		i_mm->t->flag &= ~MM_HUGETLB;
+		fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	    }
+#endif
+	    if (fd == -1) {
+		rb_sys_fail("memfd_create()");
+	    }
+	    memfd = 1;
+	    hflags = 0;
+	    vscope &= ~MAP_ANON;
+#else
+	    rb_raise(rb_eNotImpError, "memfd_create() is not available");
+#endif
+	}
+    }
+    else {
+	if (size == 0 && (smode & O_RDWR)) {
+	    if (hugetlbfs) {
+		if (ftruncate(fd, hugetlbfs) == -1) {
+		    rb_raise(rb_eIOError, "Can't extend %s", path);
+		}
+		size = hugetlbfs;
+	    }
+	    else {
+		if (lseek(fd, i_mm->t->incr - 1, SEEK_END) == -1) {
+		    rb_raise(rb_eIOError, "Can't lseek %d", i_mm->t->incr - 1);
 		}
+		if (write(fd, "\000", 1) != 1) {
+		    rb_raise(rb_eIOError, "Can't extend %s", path);
+		}
+		size = i_mm->t->incr;
+	    }
+	    init = 1;
+	}
+	if (!NIL_P(fdv)) {
+	    i_mm->t->flag |= MM_FIXED;
+	}
+    }
+    vpop = mm_i_optval(options, "populate");
+    if (RTEST(vpop)) {
+	populate = 1;
+	pwrite = anonymous;
+	if (SYMBOL_P(vpop)) {
+	    const char *s = rb_id2name(SYM2ID(vpop));
+
+	    if (strcmp(s, "write") == 0) pwrite = 1;
+	    else if (strcmp(s, "read") == 0) pwrite = 0;
+	    else rb_raise(rb_eArgError, "Invalid value for populate %s", s);
+	}
+	if (pwrite && !(pmode & PROT_WRITE)) {
+	    rb_raise(rb_eArgError, "can't populate a read-only map for writing");
+	}
+    }
+    if (offset) {
+	/* mmap only accept an offset aligned on a page */
+	delta = offset & ((hugetlbfs ? hugetlbfs : mm_pagesize) - 1);
+	offset -= delta;
+    }
+    mlen = size + delta;
+    if (i_mm->t->hugepage) {
+	mlen = MM_HUGE_ROUND(mlen, i_mm->t->hugepage);
+    }
+    else if (anonymous && (i_mm->t->flag & MM_THP)) {
+	mlen = MM_HUGE_ROUND(mlen, mm_hugepagesize());
+    }
+#ifdef MAP_POPULATE
+    if (populate && mlen < 2 * MM_POPULATE_CHUNK) {
+	/* small enough to be populated by mmap itself */
+	hflags |= MAP_POPULATE;
+	populate = 0;
+    }
+#endif
+    if (memfd && ftruncate(fd, mlen) == -1) {
+	close(fd);
+	rb_sys_fail("ftruncate()");
+    }
+    addr = mmap(0, mlen, pmode, vscope | hflags, fd, offset);
+#ifdef MAP_HUGETLB
+    if (addr == MAP_FAILED && hflags && (i_mm->t->flag & MM_THP)) {
+	/* no huge page reserved, use the transparent huge pages */
+	i_mm->t->flag &= ~MM_HUGETLB;
+	hflags &= ~(MAP_HUGETLB | (0x3f << MAP_HUGE_SHIFT));
+	addr = mmap(0, mlen, pmode, vscope | hflags, fd, offset);
+    }
+#endif
+    if (NIL_P(fdv) && !anonymous) {
+	close(fd);
+    }
+    if (addr == MAP_FAILED || !addr) {
+	if (memfd) close(fd);
+	rb_raise(rb_eArgError, "mmap failed (%d)", errno);
+    }
+    if (memfd) {
+	i_mm->t->fd = fd;
+    }
+    else if (!NIL_P(fdv)) {
+	/* kept for #to_io and #seal */
+	i_mm->t->fd = dup(fd);
+    }
+    if (i_mm->t->flag & MM_HUGETLB) {
+	i_mm->t->flag &= ~MM_THP;
+    }
+    else if (anonymous) {
+	i_mm->t->hugepage = 0;
+    }
+#ifdef MADV_NORMAL
+    if (i_mm->t->advice && madvise(addr, mlen, i_mm->t->advice) == -1) {
+	rb_raise(rb_eArgError, "madvise(%d)", errno);
+    }
+#endif
+#ifdef MADV_HUGEPAGE
+    if ((i_mm->t->flag & MM_THP) && madvise(addr, mlen, MADV_HUGEPAGE) == -1) {
+	rb_warning("madvise(MADV_HUGEPAGE) failed (%d)", errno);
+    }
+#endif
+    if (anonymous && TYPE(options) == T_HASH) {
+	VALUE val;
+	char *ptr;
+
+	val = rb_hash_aref(options, rb_str_new2("initialize"));
+	if (!NIL_P(val)) {
+	    ptr = StringValuePtr(val);
+	    memset(addr, ptr[0], size);
+	}
+    }
+    i_mm->t->addr  = (char *)addr + delta;
+    i_mm->t->delta = delta;
+    i_mm->t->len = mlen - delta;
+    if (!init) i_mm->t->real = size;
+    i_mm->t->pmode = pmode;
+    i_mm->t->vscope = vscope;
+    i_mm->t->smode = smode & ~O_TRUNC;
+    i_mm->t->path = (path)?ruby_strdup(path):(char *)-1;
+    if (populate) {
+	mm_populate_range(i_mm, 0, i_mm->t->len, pwrite, 0);
+    }
+    if (smode == O_RDONLY) {
+	obj = rb_obj_freeze(obj);
+	i_mm->t->flag |= MM_FROZEN;
+    }
+    else {
+	if (smode == O_WRONLY) {
+	    i_mm->t->flag |= MM_FIXED;
+	}
+	OBJ_TAINT(obj);
+    }
+    return obj;
+}
+
+/*
+ * call-seq: initialize
+ *
+ * Create a new Mmap object
+ */
+static VALUE
+mm_init_copy(VALUE obj, VALUE other)
+{
+    rb_raise(rb_eTypeError, "can't copy %s", rb_obj_classname(other));
+}
+
+/*
+ * convert (offset, length) to a page aligned range of the map
+ */
+static void
+mm_page_range(mm_ipc *i_mm, VALUE voff, VALUE vlen, size_t *beg, size_t *len)
+{
+    long off, l;
+    size_t end;
+
+    off = NIL_P(voff) ? 0 : NUM2LONG(voff);
+    if (off < 0) {
+	off += i_mm->t->real;
+    }
+    if (off < 0 || i_mm->t->len < (size_t)off) {
+	rb_raise(rb_eIndexError, "offset %ld out of mmap", off);
+    }
+    end = i_mm->t->len;
+    if (!NIL_P(vlen)) {
+	l = NUM2LONG(vlen);
+	if (l < 0) {
+	    rb_raise(rb_eIndexError, "negative length %ld", l);
+	}
+	if ((size_t)l < i_mm->t->len - off) {
+	    end = off + l;
+	}
+    }
+    *beg = off & ~(mm_pagesize - 1);
+    end = (end + mm_pagesize - 1) & ~(mm_pagesize - 1);
+    if (end > i_mm->t->len) {
+	end = i_mm->t->len;
+    }
+    *len = end - *beg;
+}
+
+/*
+ * address, aligned on a page, of the range which start at beg, and
+ * extend len to cover the same bytes
+ */
+static char *
+mm_page_addr(mm_mmap *t, size_t beg, size_t *len)
+{
+    size_t pos = t->delta + beg, pbeg = pos & ~(mm_pagesize - 1);
+
+    *len += pos - pbeg;
+    return MM_BASE(t) + pbeg;
+}
+
+static void *
+mm_i_msync(void *ptr)
+{
+    mm_st *st_mm = (mm_st *)ptr;
+
+    st_mm->error = msync(st_mm->addr, st_mm->len, st_mm->flag);
+    st_mm->err = errno;
+    st_mm->done = 1;
+    return 0;
+}
+
+static void
+mm_sync_range(mm_ipc *i_mm, size_t beg, size_t len, int flag)
+{
+    mm_st st_mm;
+
+    mm_dirty_clear(i_mm, beg, beg + len);
+    st_mm.i_mm = i_mm;
+    st_mm.len = len;
+    st_mm.addr = mm_page_addr(i_mm->t, beg, &st_mm.len);
+    st_mm.flag = flag;
+    mm_nogvl(&st_mm, mm_i_msync, 1);
+    if (st_mm.error != 0) {
+	mm_dirty(i_mm, beg, len);
+	rb_raise(rb_eArgError, "msync(%d)", st_mm.error);
+    }
+}
+
+/*
+ * Document-method: msync
+ * Document-method: sync
+ * Document-method: flush
+ *
+ * call-seq:
+ *   msync(flag = Mmap::MS_SYNC)
+ *   msync(offset, length, flag = Mmap::MS_SYNC)
+ *
+ * flush the file. With <em>offset</em> and <em>length</em> only
+ * the pages which contain this range are written, otherwise only
+ * the pages modified by this object (see #dirty_ranges), or all the
+ * map for an IPC map and a map used by #log_init, #log_append or the
+ * atomic methods, which the other processes write too. The pages that
+ * another process has modified with []= are written by its own
+ * #msync, or with an explicit range
+ */
+static VALUE
+mm_msync(int argc, VALUE *argv, VALUE obj)
+{
+    mm_ipc *i_mm;
+    VALUE voff, vlen, oflag;
+    mm_range tmp[MM_DIRTY_MAX + 2];
+    size_t beg, len;
+    int i, n, flag = MS_SYNC;
+
+    voff = vlen = oflag = Qnil;
+    if (argc == 1) {
+	rb_scan_args(argc, argv, "01", &oflag);
+    }
+    else if (argc) {
+	rb_scan_args(argc, argv, "21", &voff, &vlen, &oflag);
+    }
+    if (!NIL_P(oflag)) {
+	flag = NUM2INT(oflag);
+    }
+    GetMmap(obj, i_mm, MM_MODIFY);
+    if (argc > 1) {
+	mm_page_range(i_mm, voff, vlen, &beg, &len);
+	mm_sync_range(i_mm, beg, len, flag);
+	return obj;
+    }
+    if (i_mm->t->flag & (MM_IPC | MM_SHARED)) {
+	mm_sync_range(i_mm, 0, i_mm->t->len, flag);
+    }
+    else {
+	n = i_mm->ndirty;
+	MEMCPY(tmp, i_mm->dirty, mm_range, n);
+	mm_dirty_clear(i_mm, i_mm->t->len, (size_t)-1);
+	for (i = 0; i < n && tmp[i].beg < i_mm->t->len; i++) {
+	    len = tmp[i].end - tmp[i].beg;
+	    if (tmp[i].end > i_mm->t->len) {
+		len = i_mm->t->len - tmp[i].beg;
+	    }
+	    mm_sync_range(i_mm, tmp[i].beg, len, flag);
+	}
+    }
+    if (i_mm->t->real < i_mm->t->len && i_mm->t->vscope != MAP_PRIVATE)
+	mm_expandf(i_mm, i_mm->t->real);
+    return obj;
+}
+
+/*
+ * call-seq: dirty_ranges
+ *
+ * return the list of the ranges <em>[offset, length]</em> (page aligned)
+ * modified since the last #msync
+ */
+static VALUE
+mm_dirty_ranges(VALUE obj)
+{
+    mm_ipc *i_mm;
+    VALUE res;
+    int i;
+
+    GetMmap(obj, i_mm, 0);
+    res = rb_ary_new2(i_mm->ndirty);
+    for (i = 0; i < i_mm->ndirty; i++) {
+	rb_ary_push(res, rb_assoc_new(ULONG2NUM(i_mm->dirty[i].beg),
+				      ULONG2NUM(i_mm->dirty[i].end -
+						i_mm->dirty[i].beg)));
+    }
+    return res;
+}
+
+typedef struct {
+    VALUE obj;
+    MMAP_RETTYPE addr;
+    size_t len, dbeg, dend;
+    off_t offset;
+    int fd, error, err;
+    volatile int done;
+#if HAVE_PTHREAD_H
+    int started, intr;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+#endif
+} mm_flush;
+
+static void *
+mm_i_flush(void *ptr)
+{
+    mm_flush *fl = (mm_flush *)ptr;
+
+#if HAVE_SYNC_FILE_RANGE
+    if (fl->fd >= 0) {
+	fl->error = sync_file_range(fl->fd, fl->offset, fl->len,
+				    SYNC_FILE_RANGE_WAIT_BEFORE |
+				    SYNC_FILE_RANGE_WRITE |
+				    SYNC_FILE_RANGE_WAIT_AFTER);
+	fl->err = errno;
+	close(fl->fd);
+	fl->fd = -1;
+    }
+    else
+#endif
+    {
+	fl->error = msync(fl->addr, fl->len, MS_SYNC);
+	fl->err = errno;
+    }
+#if HAVE_PTHREAD_H
+    pthread_mutex_lock(&fl->lock);
+    fl->done = 1;
+    pthread_cond_broadcast(&fl->cond);
+    pthread_mutex_unlock(&fl->lock);
+#else
+    fl->done = 1;
+#endif
+    return 0;
+}
+
+#if HAVE_PTHREAD_H && HAVE_RB_THREAD_CALL_WITHOUT_GVL2
+static void *
+mm_i_flush_wait(void *ptr)
+{
+    mm_flush *fl = (mm_flush *)ptr;
+
+    pthread_mutex_lock(&fl->lock);
+    while (!fl->done && !fl->intr) {
+	pthread_cond_wait(&fl->cond, &fl->lock);
+    }
+    fl->intr = 0;
+    pthread_mutex_unlock(&fl->lock);
+    return 0;
+}
+
+static void
+mm_flush_ubf(void *ptr)
+{
+    mm_flush *fl = (mm_flush *)ptr;
+
+    pthread_mutex_lock(&fl->lock);
+    fl->intr = 1;
+    pthread_cond_broadcast(&fl->cond);
+    pthread_mutex_unlock(&fl->lock);
+}
+#endif
+
+static void
+mm_flush_join(mm_flush *fl)
+{
+#if HAVE_PTHREAD_H
+    if (fl->started) {
+	pthread_join(fl->thread, 0);
+	fl->started = 0;
+    }
+#endif
+}
+
+/*
+ * the write back failed : mark again as dirty the pages it has
+ * forgotten, if the map still exists
+ */
+static void
+mm_flush_restore(mm_flush *fl)
+{
+    mm_ipc *i_mm;
+    size_t end = fl->dend;
+
+    Data_Get_Struct(fl->obj, mm_ipc, i_mm);
+    if (i_mm->t->path && fl->dbeg < i_mm->t->real) {
+	if (end > i_mm->t->real) end = i_mm->t->real;
+	mm_dirty(i_mm, fl->dbeg, end - fl->dbeg);
+    }
+    fl->dend = fl->dbeg;
+}
+
+static void
+mm_flush_mark(mm_flush *fl)
+{
+    rb_gc_mark(fl->obj);
+}
+
+static void
+mm_flush_free(mm_flush *fl)
+{
+    mm_flush_join(fl);
+    if (fl->fd >= 0) {
+	close(fl->fd);
+    }
+#if HAVE_PTHREAD_H
+    pthread_cond_destroy(&fl->cond);
+    pthread_mutex_destroy(&fl->lock);
+#endif
+    free(fl);
+}
+
+/*
+ * call-seq: flush_async(offset = nil, length = nil)
+ *
+ * start to write back the pages which contain the range and return
+ * immediately a <em>Mmap::Flush</em> object, see Mmap::Flush#wait
+ * and Mmap::Flush#done?. Without argument the range covers all the
+ * modified pages (see #dirty_ranges, all the map in the cases given
+ * for #msync), when no page was modified the Flush is already done. If the write back fail, the pages are marked
+ * again as modified
+ */
+static VALUE
+mm_flush_async(int argc, VALUE *argv, VALUE obj)
+{
+    mm_ipc *i_mm;
+    mm_flush *fl;
+    VALUE voff, vlen, res;
+    size_t beg, len;
+
+    rb_scan_args(argc, argv, "02", &voff, &vlen);
+    GetMmap(obj, i_mm, MM_MODIFY);
+    res = Data_Make_Struct(mm_cFlush, mm_flush, mm_flush_mark, mm_flush_free, fl);
+    fl->obj = obj;
+    fl->fd = -1;
+#if HAVE_PTHREAD_H
+    pthread_mutex_init(&fl->lock, 0);
+    pthread_cond_init(&fl->cond, 0);
+#endif
+    if (!argc && !(i_mm->t->flag & (MM_IPC | MM_SHARED))) {
+	if (!i_mm->ndirty) {
+	    fl->done = 1;
+	    return res;
+	}
+	voff = ULONG2NUM(i_mm->dirty[0].beg);
+	vlen = ULONG2NUM(i_mm->dirty[i_mm->ndirty - 1].end - i_mm->dirty[0].beg);
+    }
+    mm_page_range(i_mm, voff, vlen, &beg, &len);
+    fl->len = len;
+    fl->offset = i_mm->t->offset + beg;
+    fl->addr = mm_page_addr(i_mm->t, beg, &fl->len);
+#if HAVE_SYNC_FILE_RANGE
+    if (i_mm->t->path != (char *)-1 && i_mm->t->vscope != MAP_PRIVATE) {
+	fl->fd = open(i_mm->t->path, O_RDONLY);
+	if (fl->fd >= 0 &&
+	    sync_file_range(fl->fd, fl->offset, fl->len, SYNC_FILE_RANGE_WRITE) == -1) {
+	    rb_sys_fail("sync_file_range()");
+	}
+    }
+#endif
+    mm_dirty_clear(i_mm, beg, beg + len);
+    fl->dbeg = beg;
+    fl->dend = beg + len;
+#if HAVE_PTHREAD_H
+    if (pthread_create(&fl->thread, 0, mm_i_flush, fl) == 0) {
+	fl->started = 1;
+	return res;
+    }
+#endif
+    mm_i_flush(fl);
+    return res;
+}
+
+/*
+ * call-seq: done?
+ *
+ * return <em>true</em> if the write back is finished
+ */
+static VALUE
+mm_flush_done(VALUE obj)
+{
+    mm_flush *fl;
+
+    Data_Get_Struct(obj, mm_flush, fl);
+    return fl->done ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq: wait
+ *
+ * wait until the write back is finished
+ */
+static VALUE
+mm_flush_wait(VALUE obj)
+{
+    mm_flush *fl;
+#if !(HAVE_PTHREAD_H && HAVE_RB_THREAD_CALL_WITHOUT_GVL2)
+    struct timeval tv;
+#endif
+
+    Data_Get_Struct(obj, mm_flush, fl);
+#if HAVE_PTHREAD_H && HAVE_RB_THREAD_CALL_WITHOUT_GVL2
+    while (!fl->done) {
+	rb_thread_call_without_gvl2(mm_i_flush_wait, fl, mm_flush_ubf, fl);
+	if (!fl->done) rb_thread_check_ints();
+    }
+#else
+    while (!fl->done) {
+	tv.tv_sec = 0;
+	tv.tv_usec = 1000;
+	rb_thread_wait_for(tv);
+    }
+#endif
+    mm_flush_join(fl);
+    if (fl->error == -1) {
+	mm_flush_restore(fl);
+	errno = fl->err;
+	rb_sys_fail("flush");
+    }
+    return obj;
+}
+
+/*
+ * Document-method: mprotect
+ * Document-method: protect
+ *
+ * call-seq: mprotect(mode)
+ *
+ * change the mode, value must be "r", "w" or "rw"
+ */
+static VALUE
+mm_mprotect(VALUE obj, VALUE a)
+{
+    mm_ipc *i_mm;
+    int ret, pmode;
+    char *smode;
+
+    GetMmap(obj, i_mm, 0);
+    if (TYPE(a) == T_STRING) {
+	smode = StringValuePtr(a);
+	if (strcmp(smode, "r") == 0) pmode = PROT_READ;
+	else if (strcmp(smode, "w") == 0) pmode = PROT_WRITE;
+	else if (strcmp(smode, "rw") == 0 || strcmp(smode, "wr") == 0)
+	    pmode = PROT_READ | PROT_WRITE;
+	else {
+	    rb_raise(rb_eArgError, "Invalid mode %s", smode);
+	}
+    }
+    else {
+	pmode = NUM2INT(a);
+    }
+    if ((pmode & PROT_WRITE) && (i_mm->t->flag & MM_FROZEN)) 
+	rb_error_frozen("mmap");
+    if ((ret = mprotect(MM_BASE(i_mm->t), MM_MAPLEN(i_mm->t), pmode | PROT_READ)) != 0) {
+	rb_raise(rb_eArgError, "mprotect(%d)", ret);
+    }
+    i_mm->t->pmode = pmode;
+    if (pmode & PROT_READ) {
+	if (pmode & PROT_WRITE) i_mm->t->smode = O_RDWR;
+	else {
+	    i_mm->t->smode = O_RDONLY;
+	    obj = rb_obj_freeze(obj);
+	    i_mm->t->flag |= MM_FROZEN;
+	}
+    }
+    else if (pmode & PROT_WRITE) {
+	i_mm->t->flag |= MM_FIXED;
+	i_mm->t->smode = O_WRONLY;
+    }
+    return obj;
+}
+
+#ifdef MADV_NORMAL
+static void *
+mm_i_madvise(void *ptr)
+{
+    mm_st *st_mm = (mm_st *)ptr;
+
+    st_mm->error = madvise(st_mm->addr, st_mm->len, st_mm->flag);
+    st_mm->err = errno;
+    st_mm->done = 1;
+    return 0;
+}
+
+/*
+ * Document-method: madvise
+ * Document-method: advise
+ *
+ * call-seq: madvise(advice, offset = nil, length = nil)
+ *
+ * <em>advice</em> can have the value <em>Mmap::MADV_NORMAL</em>,
+ * <em>Mmap::MADV_RANDOM</em>, <em>Mmap::MADV_SEQUENTIAL</em>,
+ * <em>Mmap::MADV_WILLNEED</em>, <em>Mmap::MADV_DONTNEED</em>
+ * and, when the system define them, <em>Mmap::MADV_HUGEPAGE</em>,
+ * <em>Mmap::MADV_NOHUGEPAGE</em>, <em>Mmap::MADV_FREE</em>,
+ * <em>Mmap::MADV_COLD</em>, <em>Mmap::MADV_PAGEOUT</em>,
+ * <em>Mmap::MADV_POPULATE_READ</em>, <em>Mmap::MADV_POPULATE_WRITE</em>,
+ * <em>Mmap::MADV_DONTFORK</em>, <em>Mmap::MADV_DOFORK</em>
+ *
+ * With <em>offset</em> and <em>length</em> the advice is only given
+ * for the pages which contain this range, and it's not applied again
+ * when the map is expanded
+ */
+static VALUE
+mm_madvise(int argc, VALUE *argv, VALUE obj)
+{
+    mm_ipc *i_mm;
+    mm_st st_mm;
+    VALUE a, voff, vlen;
+    size_t beg, len;
+    
+    rb_scan_args(argc, argv, "12", &a, &voff, &vlen);
+    GetMmap(obj, i_mm, 0);
+    beg = 0;
+    len = i_mm->t->len;
+    if (argc > 1) {
+	mm_page_range(i_mm, voff, vlen, &beg, &len);
+    }
+    st_mm.i_mm = i_mm;
+    st_mm.len = len;
+    st_mm.addr = mm_page_addr(i_mm->t, beg, &st_mm.len);
+    st_mm.flag = NUM2INT(a);
+    mm_nogvl(&st_mm, mm_i_madvise, 1);
+    if (st_mm.error == -1) {
+	rb_raise(rb_eTypeError, "madvise(%d)", st_mm.err);
+    }
+    if (argc == 1) {
+	i_mm->t->advice = NUM2INT(a);
+    }
+    return Qnil;
+}
+#endif
+
+#define MM_PREFETCH_QUEUE 64
+
+struct mm_prefetch {
+#if HAVE_PTHREAD_H
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+#endif
+    MMAP_RETTYPE addr;
+    size_t len;
+    mm_range queue[MM_PREFETCH_QUEUE];
+    int head, count, stop;
+    pid_t pid;
+};
+
+static void
+mm_i_prefetch_range(MMAP_RETTYPE addr, size_t len, mm_range r)
+{
+#ifdef MADV_NORMAL
+    if (r.end > len) r.end = len;
+    if (r.beg >= r.end) return;
+#ifdef MADV_POPULATE_READ
+    if (mm_madv_populate &&
+	madvise((char *)addr + r.beg, r.end - r.beg, MADV_POPULATE_READ) == 0) {
+	return;
+    }
+#endif
+    madvise((char *)addr + r.beg, r.end - r.beg, MADV_WILLNEED);
+#endif
+}
+
+#if HAVE_PTHREAD_H
+static void *
+mm_i_prefetch(void *ptr)
+{
+    struct mm_prefetch *pf = (struct mm_prefetch *)ptr;
+    MMAP_RETTYPE addr;
+    size_t len;
+    mm_range r;
+
+    pthread_mutex_lock(&pf->lock);
+    for (;;) {
+	while (!pf->count && !pf->stop) {
+	    pthread_cond_wait(&pf->cond, &pf->lock);
+	}
+	if (pf->stop) break;
+	r = pf->queue[pf->head];
+	pf->head = (pf->head + 1) % MM_PREFETCH_QUEUE;
+	pf->count--;
+	addr = pf->addr;
+	len = pf->len;
+	pthread_mutex_unlock(&pf->lock);
+	mm_i_prefetch_range(addr, len, r);
+	pthread_mutex_lock(&pf->lock);
+    }
+    pthread_mutex_unlock(&pf->lock);
+    return 0;
+}
+#endif
+
+/*
+ * queue the range [beg, end) for the background thread, which is
+ * started the first time. When the queue is full the oldest request
+ * is dropped
+ */
+static void
+mm_prefetch_push(mm_ipc *i_mm, size_t beg, size_t end)
+{
+    struct mm_prefetch *pf = i_mm->prefetch;
+    mm_range r;
+
+    /* the ranges of the queue are relative to the start of the mapping */
+    r.beg = (i_mm->t->delta + beg) & ~(mm_pagesize - 1);
+    r.end = i_mm->t->delta + end;
+#if HAVE_PTHREAD_H
+    if (pf && pf->pid != getpid()) {
+	/* the thread was not duplicated by fork() */
+	pf = i_mm->prefetch = 0;
+    }
+    if (!pf) {
+	pf = ALLOC(struct mm_prefetch);
+	MEMZERO(pf, struct mm_prefetch, 1);
+	pthread_mutex_init(&pf->lock, 0);
+	pthread_cond_init(&pf->cond, 0);
+	pf->pid = getpid();
+	if (pthread_create(&pf->thread, 0, mm_i_prefetch, pf) != 0) {
+	    pthread_mutex_destroy(&pf->lock);
+	    pthread_cond_destroy(&pf->cond);
+	    free(pf);
+	    mm_i_prefetch_range(MM_BASE(i_mm->t), MM_MAPLEN(i_mm->t), r);
+	    return;
+	}
+	i_mm->prefetch = pf;
+    }
+    pthread_mutex_lock(&pf->lock);
+    pf->addr = MM_BASE(i_mm->t);
+    pf->len = MM_MAPLEN(i_mm->t);
+    if (pf->count == MM_PREFETCH_QUEUE) {
+	pf->head = (pf->head + 1) % MM_PREFETCH_QUEUE;
+	pf->count--;
+    }
+    pf->queue[(pf->head + pf->count) % MM_PREFETCH_QUEUE] = r;
+    pf->count++;
+    pthread_cond_signal(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+#else
+    mm_i_prefetch_range(MM_BASE(i_mm->t), MM_MAPLEN(i_mm->t), r);
+#endif
+}
+
+static void
+mm_prefetch_stop(mm_ipc *i_mm)
+{
+#if HAVE_PTHREAD_H
+    struct mm_prefetch *pf = i_mm->prefetch;
+
+    if (!pf) return;
+    i_mm->prefetch = 0;
+    if (pf->pid != getpid()) return;
+    pthread_mutex_lock(&pf->lock);
+    pf->stop = 1;
+    pthread_cond_signal(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+    pthread_join(pf->thread, 0);
+    pthread_mutex_destroy(&pf->lock);
+    pthread_cond_destroy(&pf->cond);
+    free(pf);
+#endif
+}
+
+/*
+ * called by the iterators with the current position : keep the
+ * "readahead" window prefetched in front of it
+ */
+static void
+mm_readahead(mm_ipc *i_mm, size_t pos)
+{
+    size_t end;
+
+    if (!i_mm->readahead) return;
+    if (pos < i_mm->ranext && i_mm->ranext - pos > i_mm->readahead / 2) return;
+    end = pos + i_mm->readahead;
+    if (end > i_mm->t->real) end = i_mm->t->real;
+    if (end <= i_mm->ranext && pos < i_mm->ranext) return;
+    mm_prefetch_push(i_mm, (pos < i_mm->ranext) ? i_mm->ranext : pos, end);
+    i_mm->ranext = end;
+}
+
+/*
+ * call-seq:
+ *   prefetch(offset = nil, length = nil)
+ *   prefetch(range)
+ *
+ * read in background the pages which contain this range
+ * (all the map by default) and return immediately
+ */
+static VALUE
+mm_prefetch(int argc, VALUE *argv, VALUE obj)
+{
+    mm_ipc *i_mm;
+    VALUE voff, vlen;
+    size_t beg, len;
+    long rbeg, rlen;
+
+    rb_scan_args(argc, argv, "02", &voff, &vlen);
+    GetMmap(obj, i_mm, 0);
+    if (argc == 1 && !FIXNUM_P(voff) &&
+	rb_range_beg_len(voff, &rbeg, &rlen, i_mm->t->real, 1)) {
+	voff = LONG2NUM(rbeg);
+	vlen = LONG2NUM(rlen);
+    }
+    mm_page_range(i_mm, voff, vlen, &beg, &len);
+    mm_prefetch_push(i_mm, beg, beg + len);
+    return obj;
+}
+
+typedef struct {
+    char *addr;
+    size_t len;
+    int write, err;
+} mm_pchunk;
+
+/*
+ * fault in the pages of the range, with MADV_POPULATE_READ or
+ * MADV_POPULATE_WRITE when the kernel know them (see
+ * mm_madv_populate) and otherwise by reading one byte of each page
+ */
+static void *
+mm_i_populate_range(void *ptr)
+{
+    mm_pchunk *pc = (mm_pchunk *)ptr;
+    volatile char c;
+    size_t i;
+
+#if defined(MADV_POPULATE_READ) && defined(MADV_POPULATE_WRITE)
+    if (mm_madv_populate) {
+	if (madvise(pc->addr, pc->len,
+		    pc->write ? MADV_POPULATE_WRITE : MADV_POPULATE_READ) == -1) {
+	    pc->err = errno;
+	}
+	return 0;
+    }
+#endif
+    for (i = 0; i < pc->len; i += mm_pagesize) {
+	c = pc->addr[i];
+    }
+    (void)c;
+    return 0;
+}
+
+/*
+ * populate st_mm->addr, st_mm->len (for writing when st_mm->flag is
+ * set) with st_mm->count threads, and the first error in st_mm->err
+ */
+static void *
+mm_i_populate(void *ptr)
+{
+    mm_st *st_mm = (mm_st *)ptr;
+    mm_pchunk pc[MM_POPULATE_THREADS];
+#if HAVE_PTHREAD_H
+    pthread_t thread[MM_POPULATE_THREADS];
+    int started[MM_POPULATE_THREADS];
+#endif
+    size_t chunk;
+    int i, n = st_mm->count;
+
+    chunk = (st_mm->len / n + mm_pagesize - 1) & ~(mm_pagesize - 1);
+    for (i = 0; i < n; i++) {
+	pc[i].addr = (char *)st_mm->addr + i * chunk;
+	pc[i].len = (i == n - 1) ? st_mm->len - i * chunk : chunk;
+	pc[i].write = st_mm->flag;
+	pc[i].err = 0;
+#if HAVE_PTHREAD_H
+	started[i] = (i > 0 && pthread_create(&thread[i], 0, mm_i_populate_range, &pc[i]) == 0);
+#endif
+    }
+    for (i = 0; i < n; i++) {
+#if HAVE_PTHREAD_H
+	if (started[i]) {
+	    pthread_join(thread[i], 0);
+	    continue;
+	}
+#endif
+	mm_i_populate_range(&pc[i]);
+    }
+    st_mm->err = 0;
+    for (i = 0; i < n && !st_mm->err; i++) {
+	st_mm->err = pc[i].err;
+    }
+    st_mm->done = 1;
+    return 0;
+}
+
+static void
+mm_populate_range(mm_ipc *i_mm, size_t beg, size_t len, int write, int threads)
+{
+    mm_st st_mm;
+    long ncpu = 1;
+
+    if (write && !(i_mm->t->pmode & PROT_WRITE)) {
+	rb_raise(rb_eArgError, "can't populate a read-only map for writing");
+    }
+    if (!len) return;
+    if (threads <= 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	threads = len / MM_POPULATE_CHUNK;
+	if (threads > ncpu) threads = ncpu;
+    }
+    if (threads > MM_POPULATE_THREADS) threads = MM_POPULATE_THREADS;
+    if ((size_t)threads > len / mm_pagesize) threads = len / mm_pagesize;
+    if (threads < 1) threads = 1;
+    st_mm.i_mm = i_mm;
+    st_mm.len = len;
+    st_mm.addr = mm_page_addr(i_mm->t, beg, &st_mm.len);
+    st_mm.flag = write;
+    st_mm.count = threads;
+    mm_nogvl(&st_mm, mm_i_populate, 1);
+    if (st_mm.err) {
+	errno = st_mm.err;
+	rb_sys_fail("madvise(MADV_POPULATE)");
+    }
+}
+
+/*
+ * call-seq:
+ *   populate(offset = nil, length = nil, options = {})
+ *   populate(range, options = {})
+ *
+ * fault in the pages which contain this range (all the map by
+ * default), and return when they are all mapped. The options are
+ *
+ *   threads:: the number of threads (by default one for each 64 Mb,
+ *   at most one for each processor)
+ *
+ *   write:: populate the pages for writing (MADV_POPULATE_WRITE), raise
+ *   ArgumentError for a read-only map
+ */
+static VALUE
+mm_populate(int argc, VALUE *argv, VALUE obj)
+{
+    mm_ipc *i_mm;
+    VALUE voff, vlen, options = Qnil, threads;
+    size_t beg, len;
+    long rbeg, rlen;
+
+    if (argc > 0 && TYPE(argv[argc - 1]) == T_HASH) {
+	options = argv[--argc];
+    }
+    rb_scan_args(argc, argv, "02", &voff, &vlen);
+    GetMmap(obj, i_mm, 0);
+    if (argc == 1 && !FIXNUM_P(voff) &&
+	rb_range_beg_len(voff, &rbeg, &rlen, i_mm->t->real, 1)) {
+	voff = LONG2NUM(rbeg);
+	vlen = LONG2NUM(rlen);
+    }
+    mm_page_range(i_mm, voff, vlen, &beg, &len);
+    threads = mm_i_optval(options, "threads");
+    mm_populate_range(i_mm, beg, len, mm_i_option(options, "write"),
+		      NIL_P(threads) ? 0 : NUM2INT(threads));
+    return obj;
+}
+
+/*
+ * sliding window over a file : Mmap::Window
+ */
+#define MM_WINDOW_SIZE (64 * 1024 * 1024)
+#define MM_WINDOW_DROP (1024 * 1024)
+
+typedef struct {
+    int fd;
+    char *addr;
+    size_t len, size;
+    off_t beg, pos, fsize, dropped;
+} mm_window;
+
+static void
+mm_window_unmap(mm_window *w)
+{
+    if (w->addr) {
+	munmap(w->addr, w->len);
+	w->addr = 0;
+	w->len = 0;
+    }
+}
+
+static void
+mm_window_free(mm_window *w)
+{
+    mm_window_unmap(w);
+    if (w->fd >= 0) close(w->fd);
+    free(w);
+}
+
+static mm_window *
+mm_window_get(VALUE obj)
+{
+    mm_window *w;
+
+    Data_Get_Struct(obj, mm_window, w);
+    if (w->fd < 0) {
+	rb_raise(rb_eIOError, "closed window");
+    }
+    return w;
+}
+
+/*
+ * map the window which start at the page of pos
+ */
+static void
+mm_window_map(mm_window *w, off_t pos)
+{
+    off_t beg = pos & ~(off_t)(mm_pagesize - 1);
+    size_t len = w->size;
+    void *addr;
+
+    mm_window_unmap(w);
+    if ((off_t)len > w->fsize - beg) len = w->fsize - beg;
+    if (!len) return;
+    addr = mmap(0, len, PROT_READ, MAP_SHARED, w->fd, beg);
+    if (addr == MAP_FAILED) {
+	rb_sys_fail("mmap()");
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(addr, len, MADV_SEQUENTIAL);
+#endif
+    w->addr = addr;
+    w->len = len;
+    w->beg = w->dropped = beg;
+}
+
+/*
+ * return the address of pos, remapping the window when pos is not in
+ * it, and set *avail to the number of bytes mapped after pos
+ */
+static char *
+mm_window_at(mm_window *w, off_t pos, size_t *avail)
+{
+    if (!w->addr || pos < w->beg || pos >= w->beg + (off_t)w->len) {
+	mm_window_map(w, pos);
+    }
+    *avail = w->beg + w->len - pos;
+    return w->addr + (pos - w->beg);
+}
+
+/*
+ * move the cursor, and give back the pages behind it
+ */
+static void
+mm_window_seek(mm_window *w, off_t pos)
+{
+    off_t end;
+
+    w->pos = pos;
+    if (!w->addr || pos < w->beg) return;
+    end = pos & ~(off_t)(mm_pagesize - 1);
+    if (end > w->beg + (off_t)w->len) end = w->beg + w->len;
+    if (end - w->dropped >= MM_WINDOW_DROP) {
+#ifdef MADV_DONTNEED
+	madvise(w->addr + (w->dropped - w->beg), end - w->dropped, MADV_DONTNEED);
+#endif
+	w->dropped = end;
+    }
+}
+
+/*
+ * call-seq: new(file, size = 64 Mb)
+ *
+ * open <em>file</em> (a path or an IO) for reading through a window of
+ * <em>size</em> bytes, which follow the cursor : the pages behind the
+ * cursor are released, so the memory used doesn't depend on the size
+ * of the file
+ */
+static VALUE
+mm_window_s_new(int argc, VALUE *argv, VALUE klass)
+{
+    VALUE file, vsize, res, fdv = Qnil;
+    mm_window *w;
+    struct stat st;
+    long size;
+
+    rb_scan_args(argc, argv, "11", &file, &vsize);
+    size = NIL_P(vsize) ? MM_WINDOW_SIZE : NUM2LONG(vsize);
+    if (size <= 0) {
+	rb_raise(rb_eArgError, "Invalid value for size %ld", size);
+    }
+    res = Data_Make_Struct(klass, mm_window, 0, mm_window_free, w);
+    w->fd = -1;
+    w->size = (size + mm_pagesize - 1) & ~(mm_pagesize - 1);
+    if (rb_respond_to(file, rb_intern("fileno"))) {
+	fdv = rb_funcall2(file, rb_intern("fileno"), 0, 0);
+    }
+    if (NIL_P(fdv)) {
+	SafeStringValue(file);
+	if ((w->fd = open(RSTRING(file)->ptr, O_RDONLY)) == -1) {
+	    rb_sys_fail(RSTRING(file)->ptr);
+	}
+    }
+    else if ((w->fd = dup(NUM2INT(fdv))) == -1) {
+	rb_sys_fail("dup()");
+    }
+    if (fstat(w->fd, &st) == -1) {
+	rb_sys_fail("fstat()");
+    }
+    w->fsize = st.st_size;
+    return res;
+}
+
+/*
+ * call-seq: read(length = nil)
+ *
+ * read at most <em>length</em> bytes (up to the end of the file by
+ * default) from the cursor, return nil at the end of the file
+ */
+static VALUE
+mm_window_read(int argc, VALUE *argv, VALUE obj)
+{
+    mm_window *w = mm_window_get(obj);
+    VALUE vlen, res;
+    off_t len;
+    size_t avail, n;
+    char *ptr;
+
+    rb_scan_args(argc, argv, "01", &vlen);
+    if (w->pos >= w->fsize) return Qnil;
+    len = w->fsize - w->pos;
+    if (!NIL_P(vlen)) {
+	if (NUM2LONG(vlen) < 0) {
+	    rb_raise(rb_eArgError, "negative length %ld", NUM2LONG(vlen));
+	}
+	if (NUM2LONG(vlen) < len) len = NUM2LONG(vlen);
+    }
+    res = rb_str_new(0, len);
+    for (n = 0; (off_t)n < len; ) {
+	ptr = mm_window_at(w, w->pos, &avail);
+	if (avail > len - n) avail = len - n;
+	memcpy(RSTRING(res)->ptr + n, ptr, avail);
+	n += avail;
+	mm_window_seek(w, w->pos + avail);
+    }
+    return res;
+}
+
+/*
+ * call-seq: gets(rs = $/)
+ *
+ * read the next line, return nil at the end of the file
+ */
+static VALUE
+mm_window_gets(int argc, VALUE *argv, VALUE obj)
+{
+    mm_window *w = mm_window_get(obj);
+    VALUE rs, res = Qnil;
+    size_t avail, n;
+    char *ptr, *p;
+
+    if (rb_scan_args(argc, argv, "01", &rs) == 0) {
+	rs = rb_rs;
+    }
+    if (w->pos >= w->fsize) return Qnil;
+    if (NIL_P(rs)) return mm_window_read(0, 0, obj);
+    StringValue(rs);
+    if (RSTRING(rs)->len != 1) {
+	rb_raise(rb_eArgError, "the separator must be one character");
+    }
+    while (w->pos < w->fsize) {
+	ptr = mm_window_at(w, w->pos, &avail);
+	p = memchr(ptr, RSTRING(rs)->ptr[0], avail);
+	n = p ? (size_t)(p - ptr) + 1 : avail;
+	if (NIL_P(res)) res = rb_str_new(ptr, n);
+	else rb_str_cat(res, ptr, n);
+	mm_window_seek(w, w->pos + n);
+	if (p) break;
+    }
+    return res;
+}
+
+/*
+ * call-seq: each_line(rs = $/) {|line| ...}
+ *
+ * iterate on the lines from the cursor
+ */
+static VALUE
+mm_window_each_line(int argc, VALUE *argv, VALUE obj)
+{
+    VALUE line;
+
+#ifdef RETURN_ENUMERATOR
+    RETURN_ENUMERATOR(obj, argc, argv);
+#endif
+    while (!NIL_P(line = mm_window_gets(argc, argv, obj))) {
+	rb_yield(line);
+    }
+    return obj;
+}
+
+/*
+ * call-seq: pos
+ *
+ * return the position of the cursor
+ */
+static VALUE
+mm_window_pos(VALUE obj)
+{
+    return LL2NUM(mm_window_get(obj)->pos);
+}
+
+/*
+ * call-seq: pos=(offset)
+ *
+ * move the cursor to <em>offset</em>
+ */
+static VALUE
+mm_window_set_pos(VALUE obj, VALUE vpos)
+{
+    mm_window *w = mm_window_get(obj);
+    off_t pos = NUM2LL(vpos);
+
+    if (pos < 0) pos += w->fsize;
+    if (pos < 0) {
+	rb_raise(rb_eArgError, "negative offset %lld", (long long)NUM2LL(vpos));
+    }
+    mm_window_seek(w, pos);
+    return vpos;
+}
+
+/*
+ * call-seq: size
+ *
+ * return the size of the file
+ */
+static VALUE
+mm_window_size(VALUE obj)
+{
+    return LL2NUM(mm_window_get(obj)->fsize);
+}
+
+/*
+ * call-seq: eof?
+ *
+ * return true when the cursor is at the end of the file
+ */
+static VALUE
+mm_window_eof(VALUE obj)
+{
+    mm_window *w = mm_window_get(obj);
+
+    return (w->pos >= w->fsize) ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq: window
+ *
+ * return the offset and the length of the mapped part of the file
+ */
+static VALUE
+mm_window_window(VALUE obj)
+{
+    mm_window *w = mm_window_get(obj);
+
+    return rb_assoc_new(LL2NUM(w->beg), ULONG2NUM(w->len));
+}
+
+/*
+ * call-seq: close
+ *
+ * unmap the window and close the file
+ */
+static VALUE
+mm_window_close(VALUE obj)
+{
+    mm_window *w = mm_window_get(obj);
+
+    mm_window_unmap(w);
+    close(w->fd);
+    w->fd = -1;
+    return Qnil;
+}
+
+#if HAVE_MINCORE
+#define MM_MINCORE_CHUNK 65536
+
+typedef struct {
+    size_t npages, resident;
+    VALUE res;
+    unsigned char *bitmap;
+    long rbeg, rend, base, end;
+} mm_core;
+
+/*
+ * push the resident range of pages [rbeg, rend) as map offsets, clipped
+ * to the map
+ */
+static void
+mm_i_core_push(mm_core *core)
+{
+    long beg, end;
+
+    beg = core->base + core->rbeg * (long)mm_pagesize;
+    end = core->base + core->rend * (long)mm_pagesize;
+    if (beg < 0) beg = 0;
+    if (end > core->end) end = core->end;
+    if (beg < end) {
+	rb_ary_push(core->res, rb_assoc_new(LONG2NUM(beg), LONG2NUM(end - beg)));
+    }
+}
+
+static void
+mm_i_core_count(mm_core *core, size_t page, unsigned char *vec, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+	if (vec[i] & 1) core->resident++;
+    }
+}
+
+static void
+mm_i_core_bitmap(mm_core *core, size_t page, unsigned char *vec, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+	if (vec[i] & 1) {
+	    core->bitmap[(page + i) >> 3] |= 1 << ((page + i) & 7);
+	}
+    }
+}
+
+static void
+mm_i_core_ranges(mm_core *core, size_t page, unsigned char *vec, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+	if (vec[i] & 1) {
+	    if (core->rbeg < 0) core->rbeg = page + i;
+	    core->rend = page + i + 1;
+	}
+	else if (core->rbeg >= 0) {
+	    mm_i_core_push(core);
+	    core->rbeg = -1;
+	}
+    }
+}
+
+/*
+ * call mincore(2) on the pages which contain (offset, length), at most
+ * MM_MINCORE_CHUNK pages at a time, and give the result to func. 
+ * <em>page</em> is the index of the first page, relative to offset
+ */
+static void
+mm_mincore(int argc, VALUE *argv, VALUE obj, mm_core *core,
+	   void (*func)(mm_core *, size_t, unsigned char *, size_t))
+{
+    mm_ipc *i_mm;
+    VALUE voff, vlen;
+    size_t beg, len, page, n;
+    unsigned char *vec;
+    char *addr;
+
+    rb_scan_args(argc, argv, "02", &voff, &vlen);
+    GetMmap(obj, i_mm, 0);
+    mm_page_range(i_mm, voff, vlen, &beg, &len);
+    addr = mm_page_addr(i_mm->t, beg, &len);
+    core->base = addr - (char *)i_mm->t->addr;
+    core->end = i_mm->t->len;
+    core->npages = (len + mm_pagesize - 1) / mm_pagesize;
+    if (func == mm_i_core_bitmap) {
+	core->res = rb_str_new(0, (core->npages + 7) / 8);
+	core->bitmap = (unsigned char *)RSTRING(core->res)->ptr;
+	MEMZERO(core->bitmap, unsigned char, RSTRING(core->res)->len);
+    }
+    n = core->npages < MM_MINCORE_CHUNK ? core->npages : MM_MINCORE_CHUNK;
+    vec = ALLOCA_N(unsigned char, n ? n : 1);
+    for (page = 0; page < core->npages; page += n) {
+	if (core->npages - page < n) {
+	    n = core->npages - page;
+	}
+	if (mincore(addr + page * mm_pagesize,
+		    (page + n) * mm_pagesize > len ? len - page * mm_pagesize
+		    : n * mm_pagesize, (void *)vec) == -1) {
+	    rb_sys_fail("mincore()");
+	}
+	(*func)(core, page, vec, n);
+    }
+}
+
+/*
+ * call-seq: residency(offset = nil, length = nil)
+ *
+ * return the fraction (between 0.0 and 1.0) of the pages of the range
+ * which are in memory
+ */
+static VALUE
+mm_residency(int argc, VALUE *argv, VALUE obj)
+{
+    mm_core core;
+
+    MEMZERO(&core, mm_core, 1);
+    mm_mincore(argc, argv, obj, &core, mm_i_core_count);
+    if (!core.npages) return rb_float_new(0.0);
+    return rb_float_new((double)core.resident / core.npages);
+}
+
+/*
+ * call-seq: resident_ranges(offset = nil, length = nil)
+ *
+ * return the list of the ranges <em>[offset, length]</em> which are in
+ * memory. The offsets are relative to the start of the map, like
+ * <em>offset</em>, and the ranges cover whole pages clipped to the map
+ */
+static VALUE
+mm_resident_ranges(int argc, VALUE *argv, VALUE obj)
+{
+    mm_core core;
+
+    MEMZERO(&core, mm_core, 1);
+    core.res = rb_ary_new();
+    core.rbeg = -1;
+    mm_mincore(argc, argv, obj, &core, mm_i_core_ranges);
+    if (core.rbeg >= 0) {
+	mm_i_core_push(&core);
+    }
+    return core.res;
+}
+
+/*
+ * call-seq: residency_bitmap(offset = nil, length = nil)
+ *
+ * return a String with one bit for each page of the range (the bit
+ * <em>n % 8</em> of the byte <em>n / 8</em> for the page <em>n</em>),
+ * set when the page is in memory
+ */
+static VALUE
+mm_residency_bitmap(int argc, VALUE *argv, VALUE obj)
+{
+    mm_core core;
+
+    MEMZERO(&core, mm_core, 1);
+    mm_mincore(argc, argv, obj, &core, mm_i_core_bitmap);
+    return core.res;
+}
+#endif
+
+#define StringMmap(b, bp, bl)						   \
+do {									   \
+    if (TYPE(b) == T_DATA && RDATA(b)->dfree == (RUBY_DATA_FUNC)mm_free) { \
+	mm_ipc *b_mm;							   \
+	GetMmap(b, b_mm, 0);						   \
+	bp = b_mm->t->addr;						   \
+	bl = b_mm->t->real;						   \
+    }									   \
+    else {								   \
+	bp = StringValuePtr(b);						   \
+	bl = RSTRING(b)->len;						   \
+    }									   \
+} while (0);
+
+/*
+ * the bytes [beg, beg + len) are replaced by the next rlen bytes of
+ * the replacements. The splices are sorted and don't overlap
+ */
+typedef struct {
+    size_t beg, len, rlen;
+} mm_splice;
+
+/*
+ * apply n splices with at most one remap, each byte of the file is
+ * moved only once. The parts which go to the left are moved from left
+ * to right, then the parts which go to the right from right to left,
+ * then the replacements are copied
+ */
+static void
+mm_splice_apply(mm_ipc *i_mm, mm_splice *sp, long n, const char *repl)
+{
+    size_t real, nreal, beg, end;
+    char *addr;
+    long i, delta;
+
+    if (n <= 0) return;
+    real = nreal = i_mm->t->real;
+    for (i = 0; i < n; i++) {
+	nreal += sp[i].rlen - sp[i].len;
+    }
+    if ((i_mm->t->flag & MM_FIXED) && nreal != real) {
+	rb_raise(rb_eTypeError, "try to change the size of a fixed map");
+    }
+    if (nreal > i_mm->t->len) {
+	mm_realloc(i_mm, nreal);
+    }
+    addr = (char *)i_mm->t->addr;
+    delta = 0;
+    for (i = 0; i < n; i++) {
+	delta += (long)sp[i].rlen - (long)sp[i].len;
+	if (delta < 0) {
+	    beg = sp[i].beg + sp[i].len;
+	    end = (i + 1 < n) ? sp[i + 1].beg : real;
+	    memmove(addr + beg + delta, addr + beg, end - beg);
+	}
+    }
+    for (i = n - 1; i >= 0; i--) {
+	if (delta > 0) {
+	    beg = sp[i].beg + sp[i].len;
+	    end = (i + 1 < n) ? sp[i + 1].beg : real;
+	    memmove(addr + beg + delta, addr + beg, end - beg);
+	}
+	delta -= (long)sp[i].rlen - (long)sp[i].len;
+    }
+    for (i = 0; i < n; i++) {
+	memcpy(addr + sp[i].beg + delta, repl, sp[i].rlen);
+	repl += sp[i].rlen;
+	delta += (long)sp[i].rlen - (long)sp[i].len;
+    }
+    i_mm->t->real = nreal;
+    end = (nreal != real) ? nreal : sp[n - 1].beg + sp[n - 1].len;
+    mm_dirty(i_mm, sp[0].beg, end - sp[0].beg);
+}
+
+static void
+mm_update(mm_ipc *str, long beg, long len, VALUE val)
+{
+    char *valp;
+    long vall;
+
+    if (str->t->flag & MM_FROZEN) rb_error_frozen("mmap");
+    if (len < 0) rb_raise(rb_eIndexError, "negative length %d", len);
+    mm_lock(str, Qfalse);
+    if (beg < 0) {
+	beg += str->t->real;
+    }
+    if (beg < 0 || str->t->real < (size_t)beg) {
+	if (beg < 0) {
+	    beg -= str->t->real;
+	}
+	mm_unlock(str);
+	rb_raise(rb_eIndexError, "index %d out of string", beg);
+    }
+    if (str->t->real < (size_t)(beg + len)) {
+	len = str->t->real - beg;
+    }
+
+    mm_unlock(str);
+    StringMmap(val, valp, vall);
+    mm_lock(str, Qfalse);
+
+    if ((str->t->flag & MM_FIXED) && vall != len) {
+	mm_unlock(str);
+	rb_raise(rb_eTypeError, "try to change the size of a fixed map");
+    }
+    if (len < vall) {
+	mm_realloc(str, str->t->real + vall - len);
+    }
+
+    if (vall != len) {
+	memmove((char *)str->t->addr + beg + vall,
+		(char *)str->t->addr + beg + len,
+		str->t->real - (beg + len));
+    }
+    if (str->t->real < (size_t)beg && len < 0) {
+	MEMZERO(str->t->addr + str->t->real, char, -len);
+    }
+    if (vall > 0) {
+	memmove((char *)str->t->addr + beg, valp, vall);
+    }
+    str->t->real += vall - len;
+    mm_dirty(str, beg, (vall != len) ? str->t->real - beg : vall);
+    mm_unlock(str);
+}
+
+/*
+ * call-seq: =~(other)
+ *
+ * return an index of the match 
+ */
+static VALUE
+mm_match(VALUE x, VALUE y)
+{
+    VALUE reg, res;
+    long start;
+
+    x = mm_str(x, MM_ORIGIN);
+    if (TYPE(y) == T_DATA && RDATA(y)->dfree == (RUBY_DATA_FUNC)mm_free) {
+	y = mm_to_str(y);
+    }
+    switch (TYPE(y)) {
+      case T_REGEXP:
+	res = rb_reg_match(y, x);
+	break;
+
+      case T_STRING:
+	reg = rb_reg_regcomp(y);
+	start = rb_reg_search(reg, x, 0, 0);
+	if (start == -1) res = Qnil;
+	else res = INT2NUM(start);
+	break;
+
+      default:
+	res = rb_funcall(y, rb_intern("=~"), 1, x);
+	break;
+    }
+    return res;
+}
+
+static VALUE
+get_pat(VALUE pat)
+{
+    switch (TYPE(pat)) {
+      case T_REGEXP:
+	break;
+
+      case T_STRING:
+	pat = rb_reg_regcomp(pat);
+	break;
+
+      default:
+	/* type failed */
+	Check_Type(pat, T_REGEXP);
+    }
+    return pat;
+}
+
+static int
+mm_correct_backref(void)
+{
+    VALUE match;
+    int i, start;
+
+    match = rb_backref_get();
+    if (NIL_P(match)) return 0;
+    if (RMATCH(match)->BEG(0) == -1) return 0;
+    start = RMATCH(match)->BEG(0);
+    RMATCH(match)->str = rb_str_new(StringValuePtr(RMATCH(match)->str) + start,
+				    RMATCH(match)->END(0) - start);
+    if (OBJ_TAINTED(match)) OBJ_TAINT(RMATCH(match)->str);
+    for (i = 0; i < RMATCH(match)->regs->num_regs && RMATCH(match)->BEG(i) != -1; i++) {
+	RMATCH(match)->BEG(i) -= start;
+	RMATCH(match)->END(i) -= start;
+    }
+    rb_backref_set(match);
+    return start;
+}
+
+static VALUE
+mm_sub_bang_int(mm_bang *bang_st)
+{
+    int argc = bang_st->argc;
+    VALUE *argv = bang_st->argv;
+    VALUE obj = bang_st->obj;
+    VALUE pat, repl = Qnil, match, str, res;
+    struct re_registers *regs;
+    int start, iter = 0;
+    int tainted = 0;
+    long plen;
+    mm_ipc *i_mm;
+    char *ptr;
+
+    if (argc == 1 && rb_block_given_p()) {
+	iter = 1;
+    }
+    else if (argc == 2) {
+	repl = rb_str_to_str(argv[1]);
+	if (OBJ_TAINTED(repl)) tainted = 1;
+    }
+    else {
+	rb_raise(rb_eArgError, "wrong # of arguments(%d for 2)", argc);
+    }
+    GetMmap(obj, i_mm, MM_MODIFY);
+    str = mm_str(obj, MM_MODIFY | MM_ORIGIN);
+
+    pat = get_pat(argv[0]);
+    res = Qnil;
+    if (rb_reg_search(pat, str, 0, 0) >= 0) {
+	start = mm_correct_backref();
+	match = rb_backref_get();
+	regs = RMATCH(match)->regs;
+	if (iter) {
+	    rb_match_busy(match);
+	    repl = rb_obj_as_string(rb_yield(rb_reg_nth_match(0, match)));
+	    rb_backref_set(match);
+	}
+	else {
+	    RSTRING(str)->ptr += start;
+	    repl = rb_reg_regsub(repl, str, regs);
+	    RSTRING(str)->ptr -= start;
+	}
+	if (OBJ_TAINTED(repl)) tainted = 1;
+	plen = END(0) - BEG(0);
+	if (RSTRING(repl)->len > plen) {
+	    mm_realloc(i_mm, RSTRING(str)->len + RSTRING(repl)->len - plen);
+	    RSTRING(str)->ptr = i_mm->t->addr;
+	}
+	ptr = RSTRING(str)->ptr + start + BEG(0);
+	if (RSTRING(repl)->len != plen) {
+	    if (i_mm->t->flag & MM_FIXED) {
+		rb_raise(rb_eTypeError, "try to change the size of a fixed map");
 	    }
-	    if ((semid = semget(key, 1, mode)) == -1) {
-		rb_sys_fail("semget()");
+	    memmove(ptr + RSTRING(repl)->len,
+		    ptr + plen,
+		    RSTRING(str)->len - start - BEG(0) - plen);
+	}
+	memcpy(ptr, RSTRING(repl)->ptr, RSTRING(repl)->len);
+	i_mm->t->real += RSTRING(repl)->len - plen;
+	mm_dirty(i_mm, ptr - (char *)i_mm->t->addr,
+		 (RSTRING(repl)->len != plen) ?
+		 i_mm->t->real - (ptr - (char *)i_mm->t->addr) : plen);
+	if (tainted) OBJ_TAINT(obj);
+
+	res = obj;
+    }
+    rb_gc_force_recycle(str);
+    return res;
+}
+
+/*
+ * call-seq:
+ *    str.sub!(pattern, replacement)      => str or nil
+ *    str.sub!(pattern) {|match| block }  => str or nil
+ *
+ * substitution 
+ */
+static VALUE
+mm_sub_bang(int argc, VALUE *argv, VALUE obj)
+{
+    VALUE res;
+    mm_bang bang_st;
+    mm_ipc *i_mm;
+
+    bang_st.argc = argc;
+    bang_st.argv = argv;
+    bang_st.obj = obj;
+    GetMmap(obj, i_mm, MM_MODIFY);
+    if (i_mm->t->flag & MM_IPC) {
+	mm_lock(i_mm, Qtrue);
+	res = rb_ensure(mm_sub_bang_int, (VALUE)&bang_st, mm_vunlock, obj);
+    }
+    else {
+	res = mm_sub_bang_int(&bang_st);
+    }
+    return res;
+}
+
+static VALUE
+mm_gsub_bang_int(mm_bang *bang_st)
+{
+    int argc = bang_st->argc;
+    VALUE *argv = bang_st->argv;
+    VALUE obj = bang_st->obj;
+    VALUE pat, val, repl = Qnil, match, str, buf, edits;
+    struct re_registers *regs;
+    long beg, offset;
+    int start, iter = 0;
+    int tainted = 0;
+    mm_ipc *i_mm;
+    mm_splice sp;
+    MMAP_RETTYPE addr;
+    size_t real;
+
+    if (argc == 1 && rb_block_given_p()) {
+	iter = 1;
+    }
+    else if (argc == 2) {
+	repl = rb_str_to_str(argv[1]);
+	if (OBJ_TAINTED(repl)) tainted = 1;
+    }
+    else {
+	rb_raise(rb_eArgError, "wrong # of arguments(%d for 2)", argc);
+    }
+    GetMmap(obj, i_mm, MM_MODIFY);
+    str = mm_str(obj, MM_MODIFY | MM_ORIGIN);
+
+    pat = get_pat(argv[0]);
+    beg = rb_reg_search(pat, str, 0, 0);
+    if (beg < 0) {
+	rb_gc_force_recycle(str);
+	return Qnil;
+    }
+    /*
+     * the matches are searched in the original content, the splices
+     * and the replacements are accumulated and applied in one pass
+     */
+    addr = i_mm->t->addr;
+    real = i_mm->t->real;
+    edits = rb_str_buf_new(0);
+    buf = rb_str_buf_new(0);
+    while (beg >= 0) {
+	start = mm_correct_backref();
+	match = rb_backref_get();
+	regs = RMATCH(match)->regs;
+	if (iter) {
+	    rb_match_busy(match);
+	    val = rb_obj_as_string(rb_yield(rb_reg_nth_match(0, match)));
+	    rb_backref_set(match);
+	    if (i_mm->t->addr != addr || i_mm->t->real != real) {
+		rb_raise(rb_eRuntimeError, "mmap modified");
 	    }
-	    if (mode & IPC_CREAT) {
-		sem_val.val = 1;
-		if (semctl(semid, 0, SETVAL, sem_val) == -1) {
-		    rb_sys_fail("semctl()");
-		}
+	}
+	else {
+	    RSTRING(str)->ptr += start;
+	    val = rb_reg_regsub(repl, str, regs);
+	    RSTRING(str)->ptr -= start;
+	}
+	if (OBJ_TAINTED(val)) tainted = 1;
+	sp.beg = start + BEG(0);
+	sp.len = END(0) - BEG(0);
+	sp.rlen = RSTRING(val)->len;
+	rb_str_buf_cat(edits, (char *)&sp, sizeof(mm_splice));
+	rb_str_buf_cat(buf, RSTRING(val)->ptr, RSTRING(val)->len);
+	offset = start + END(0);
+	if (BEG(0) == END(0)) {
+	    if (offset >= RSTRING(str)->len) break;
+	    offset += mbclen2(RSTRING(str)->ptr[offset], pat);
+	}
+	if (offset > RSTRING(str)->len) break;
+	beg = rb_reg_search(pat, str, offset, 0);
+    }
+    rb_backref_set(match);
+    mm_splice_apply(i_mm, (mm_splice *)RSTRING(edits)->ptr,
+		    RSTRING(edits)->len / sizeof(mm_splice), RSTRING(buf)->ptr);
+    if (tainted) OBJ_TAINT(obj);
+    rb_gc_force_recycle(str);
+    return obj;
+}
+
+/*
+ * call-seq:
+ *    str.gsub!(pattern, replacement)        => str or nil
+ *    str.gsub!(pattern) {|match| block }    => str or nil
+ *
+ * global substitution
+ */
+static VALUE
+mm_gsub_bang(int argc, VALUE *argv, VALUE obj)
+{
+    VALUE res;
+    mm_bang bang_st;
+    mm_ipc *i_mm;
+
+    bang_st.argc = argc;
+    bang_st.argv = argv;
+    bang_st.obj = obj;
+    GetMmap(obj, i_mm, MM_MODIFY);
+    if (i_mm->t->flag & MM_IPC) {
+	mm_lock(i_mm, Qtrue);
+	res = rb_ensure(mm_gsub_bang_int, (VALUE)&bang_st, mm_vunlock, obj);
+    }
+    else {
+	res = mm_gsub_bang_int(&bang_st);
+    }
+    return res;
+}
+
+/*
+ * edits queued by a Mmap::Batch, the offsets refer to the content of
+ * the map before the batch
+ */
+typedef struct {
+    size_t beg, len, rlen, roff;
+    long seq;
+} mm_edit;
+
+typedef struct {
+    VALUE obj, edits, repl;
+    long seq;
+    int done;
+} mm_edits;
+
+static void
+mm_edits_mark(mm_edits *bt)
+{
+    rb_gc_mark(bt->obj);
+    rb_gc_mark(bt->edits);
+    rb_gc_mark(bt->repl);
+}
+
+/*
+ * sort the edits by offset. At the same offset the insertions come
+ * first, in the order of the calls, then the replacement or deletion
+ */
+static int
+mm_edit_cmp(const void *a, const void *b)
+{
+    const mm_edit *x = (const mm_edit *)a, *y = (const mm_edit *)b;
+
+    if (x->beg != y->beg) return (x->beg < y->beg) ? -1 : 1;
+    if ((x->len == 0) != (y->len == 0)) return (x->len == 0) ? -1 : 1;
+    return (x->seq < y->seq) ? -1 : (x->seq > y->seq);
+}
+
+static mm_edits *
+mm_batch_get(VALUE obj)
+{
+    mm_edits *bt;
+
+    Data_Get_Struct(obj, mm_edits, bt);
+    if (bt->done) {
+	rb_raise(rb_eRuntimeError, "batch already applied");
+    }
+    return bt;
+}
+
+static VALUE
+mm_batch_push(VALUE obj, VALUE voff, long len, VALUE val)
+{
+    mm_edits *bt = mm_batch_get(obj);
+    mm_ipc *i_mm;
+    mm_edit ed;
+    long off;
+
+    GetMmap(bt->obj, i_mm, MM_MODIFY);
+    off = NUM2LONG(voff);
+    if (off < 0) {
+	off += i_mm->t->real;
+    }
+    if (off < 0 || i_mm->t->real < (size_t)off) {
+	rb_raise(rb_eIndexError, "index %ld out of mmap", NUM2LONG(voff));
+    }
+    if (len < 0) {
+	rb_raise(rb_eIndexError, "negative length %ld", len);
+    }
+    if (i_mm->t->real < (size_t)(off + len)) {
+	len = i_mm->t->real - off;
+    }
+    ed.beg = off;
+    ed.len = len;
+    ed.rlen = 0;
+    ed.roff = RSTRING(bt->repl)->len;
+    ed.seq = bt->seq++;
+    if (!NIL_P(val)) {
+	char *valp;
+	long vall;
+
+	StringMmap(val, valp, vall);
+	rb_str_buf_cat(bt->repl, valp, vall);
+	ed.rlen = vall;
+    }
+    rb_str_buf_cat(bt->edits, (char *)&ed, sizeof(mm_edit));
+    return obj;
+}
+
+/*
+ * call-seq: replace(offset, length, str)
+ *
+ * replace <em>length</em> bytes at <em>offset</em> with <em>str</em>
+ */
+static VALUE
+mm_batch_replace(VALUE obj, VALUE off, VALUE len, VALUE str)
+{
+    return mm_batch_push(obj, off, NUM2LONG(len), str);
+}
+
+/*
+ * call-seq: insert(offset, str)
+ *
+ * insert <em>str</em> at <em>offset</em>
+ */
+static VALUE
+mm_batch_insert(VALUE obj, VALUE off, VALUE str)
+{
+    return mm_batch_push(obj, off, 0, str);
+}
+
+/*
+ * call-seq: delete(offset, length)
+ *
+ * remove <em>length</em> bytes at <em>offset</em>
+ */
+static VALUE
+mm_batch_delete(VALUE obj, VALUE off, VALUE len)
+{
+    return mm_batch_push(obj, off, NUM2LONG(len), Qnil);
+}
+
+/*
+ * call-seq: size
+ *
+ * return the number of queued edits
+ */
+static VALUE
+mm_batch_size(VALUE obj)
+{
+    mm_edits *bt;
+
+    Data_Get_Struct(obj, mm_edits, bt);
+    return LONG2NUM(RSTRING(bt->edits)->len / sizeof(mm_edit));
+}
+
+static VALUE
+mm_i_batch_apply(VALUE arg)
+{
+    mm_edits *bt = (mm_edits *)arg;
+    mm_ipc *i_mm;
+    mm_edit *ed;
+    mm_splice sp;
+    VALUE splices, repl;
+    long i, n;
+
+    GetMmap(bt->obj, i_mm, MM_MODIFY);
+    n = RSTRING(bt->edits)->len / sizeof(mm_edit);
+    ed = (mm_edit *)RSTRING(bt->edits)->ptr;
+    qsort(ed, n, sizeof(mm_edit), mm_edit_cmp);
+    splices = rb_str_buf_new(n * sizeof(mm_splice));
+    repl = rb_str_buf_new(RSTRING(bt->repl)->len);
+    for (i = 0; i < n; i++) {
+	if (i_mm->t->real < ed[i].beg + ed[i].len) {
+	    rb_raise(rb_eIndexError, "edit out of mmap");
+	}
+	if (i > 0 && ed[i - 1].beg + ed[i - 1].len > ed[i].beg) {
+	    rb_raise(rb_eArgError, "overlapping edits at %lu", (unsigned long)ed[i].beg);
+	}
+	sp.beg = ed[i].beg;
+	sp.len = ed[i].len;
+	sp.rlen = ed[i].rlen;
+	rb_str_buf_cat(splices, (char *)&sp, sizeof(mm_splice));
+	rb_str_buf_cat(repl, RSTRING(bt->repl)->ptr + ed[i].roff, ed[i].rlen);
+    }
+    mm_splice_apply(i_mm, (mm_splice *)RSTRING(splices)->ptr, n, RSTRING(repl)->ptr);
+    return Qnil;
+}
+
+/*
+ * call-seq: batch {|batch| ... }
+ *
+ * yield a <em>Mmap::Batch</em> which queue the edits (see
+ * Mmap::Batch#replace, Mmap::Batch#insert and Mmap::Batch#delete),
+ * and apply them in one pass when the block returns : the file is
+ * resized at most once and each byte is moved at most once.
+ *
+ * The offsets refer to the content before the batch, the edits must
+ * not overlap. Nothing is modified if the block raise an exception
+ */
+static VALUE
+mm_batch(VALUE obj)
+{
+    mm_ipc *i_mm;
+    mm_edits *bt;
+    VALUE res;
+
+    GetMmap(obj, i_mm, MM_MODIFY);
+    res = Data_Make_Struct(mm_cBatch, mm_edits, mm_edits_mark, free, bt);
+    bt->obj = obj;
+    bt->edits = rb_str_buf_new(0);
+    bt->repl = rb_str_buf_new(0);
+    rb_yield(res);
+    bt = mm_batch_get(res);
+    bt->done = 1;
+    GetMmap(obj, i_mm, MM_MODIFY);
+    if (i_mm->t->flag & MM_IPC) {
+	mm_lock(i_mm, Qtrue);
+	rb_ensure(mm_i_batch_apply, (VALUE)bt, mm_vunlock, obj);
+    }
+    else {
+	mm_i_batch_apply((VALUE)bt);
+    }
+    return obj;
+}
+
+static VALUE mm_index __((int, VALUE *, VALUE));
+
+static void
+mm_subpat_set(VALUE obj, VALUE re, int offset, VALUE val)
+{
+    VALUE str, match;
+    int start, end, len;
+    mm_ipc *i_mm;
+    
+    str = mm_str(obj, MM_MODIFY | MM_ORIGIN);
+    if (rb_reg_search(re, str, 0, 0) < 0) {
+	rb_raise(rb_eIndexError, "regexp not matched");
+    }
+    match = rb_backref_get();
+    if (offset >= RMATCH(match)->regs->num_regs) {
+	rb_raise(rb_eIndexError, "index %d out of regexp", offset);
+    }
+
+    start = RMATCH(match)->BEG(offset);
+    if (start == -1) {
+	rb_raise(rb_eIndexError, "regexp group %d not matched", offset);
+    }
+    end = RMATCH(match)->END(offset);
+    len = end - start;
+    GetMmap(obj, i_mm, MM_MODIFY);
+    mm_update(i_mm, start, len, val);
+}
+
+static VALUE
+mm_aset(VALUE str, VALUE indx, VALUE val)
+{
+    long idx;
+    mm_ipc *i_mm;
+
+    GetMmap(str, i_mm, MM_MODIFY);
+    switch (TYPE(indx)) {
+      case T_FIXNUM:
+      num_index:
+	idx = NUM2INT(indx);
+	if (idx < 0) {
+	    idx += i_mm->t->real;
+	}
+	if (idx < 0 || i_mm->t->real <= (size_t)idx) {
+	    rb_raise(rb_eIndexError, "index %d out of string", idx);
+	}
+	if (FIXNUM_P(val)) {
+	    if (i_mm->t->real == (size_t)idx) {
+		i_mm->t->real += 1;
+		mm_realloc(i_mm, i_mm->t->real);
 	    }
-	    memcpy(data, i_mm->t, sizeof(mm_mmap));
-	    free(i_mm->t);
-	    i_mm->t = data;
-	    i_mm->t->key = key;
-	    i_mm->t->semid = semid;
-	    i_mm->t->shmid = shmid;
-	    if (i_mm->t->flag & MM_TMP) {
-		i_mm->t->template = ALLOC_N(char, strlen(template) + 1);
-		strcpy(i_mm->t->template, template);
+	    ((char *)i_mm->t->addr)[idx] = NUM2INT(val) & 0xff;
+	    mm_dirty(i_mm, idx, 1);
+	}
+	else {
+	    mm_update(i_mm, idx, 1, val);
+	}
+	return val;
+
+      case T_REGEXP:
+	  mm_subpat_set(str, indx, 0, val);
+	return val;
+
+      case T_STRING:
+      {
+	  VALUE res;
+
+	  res = mm_index(1, &indx, str);
+	  if (!NIL_P(res)) {
+	      mm_update(i_mm, NUM2LONG(res), RSTRING(indx)->len, val);
+	  }
+	  return val;
+      }
+
+      default:
+	/* check if indx is Range */
+	{
+	    long beg, len;
+	    if (rb_range_beg_len(indx, &beg, &len, i_mm->t->real, 2)) {
+		mm_update(i_mm, beg, len, val);
+		return val;
 	    }
-        }
+	}
+	idx = NUM2LONG(indx);
+	goto num_index;
+    }
+}
+
+/*
+ * call-seq: []=(args)
+ *
+ * Element assignement - with the following syntax
+ *
+ *   self[nth] = val
+ *
+ * change the <em>nth</em> character with <em>val</em>
+ *
+ *   self[start..last] = val
+ *
+ * change substring from <em>start</em> to <em>last</em> with <em>val</em>
+ *
+ *   self[start, len] = val
+ * 
+ * replace <em>length</em> characters from <em>start</em> with <em>val</em>.
+ * 
+ */
+static VALUE
+mm_aset_m(int argc, VALUE *argv, VALUE str)
+{
+    mm_ipc *i_mm;
+
+    GetMmap(str, i_mm, MM_MODIFY);
+    if (argc == 3) {
+	long beg, len;
+
+	if (TYPE(argv[0]) == T_REGEXP) {
+	    mm_subpat_set(str, argv[0], NUM2INT(argv[1]), argv[2]);
+	}
+	else {
+	    beg = NUM2INT(argv[0]);
+	    len = NUM2INT(argv[1]);
+	    mm_update(i_mm, beg, len, argv[2]);
+	}
+	return argv[2];
+    }
+    if (argc != 2) {
+	rb_raise(rb_eArgError, "wrong # of arguments(%d for 2)", argc);
+    }
+    return mm_aset(str, argv[0], argv[1]);
+}
+
+/*
+ * call-seq: insert(index, str)
+ *
+ * insert <em>str</em> at <em>index</em>
+ */
+static VALUE
+mm_insert(VALUE str, VALUE idx, VALUE str2)
+{
+    mm_ipc *i_mm;
+    long pos = NUM2LONG(idx);
+
+    GetMmap(str, i_mm, MM_MODIFY);
+    if (pos == -1) {
+	pos = RSTRING(str)->len;
+    }
+    else if (pos < 0) {
+	pos++;
+    }
+    mm_update(i_mm, pos, 0, str2);
+    return str;
+}
+
+static VALUE mm_aref_m(int, VALUE *, VALUE);
+
+/*
+ * call-seq: slice!(str)
+ *
+ * delete the specified portion of the file
+ */
+static VALUE
+mm_slice_bang(int argc, VALUE *argv, VALUE str)
+{
+    VALUE result;
+    VALUE buf[3];
+    int i;
+
+    if (argc < 1 || 2 < argc) {
+	rb_raise(rb_eArgError, "wrong # of arguments(%d for 1)", argc);
+    }
+    for (i = 0; i < argc; i++) {
+	buf[i] = argv[i];
+    }
+    buf[i] = rb_str_new(0,0);
+    result = mm_aref_m(argc, buf, str);
+    if (!NIL_P(result)) {
+	mm_aset_m(argc+1, buf, str);
+    }
+    return result;
+}
+
+static VALUE
+mm_cat(VALUE str, const char *ptr, long len)
+{
+    mm_ipc *i_mm;
+    char *sptr;
+
+    GetMmap(str, i_mm, MM_MODIFY);
+    if (len > 0) {
+	int poffset = -1;
+	sptr = (char *)i_mm->t->addr;
+
+	if (sptr <= ptr &&
+	    ptr < sptr + i_mm->t->real) {
+	    poffset = ptr - sptr;
+	}
+	mm_lock(i_mm, Qtrue);
+	mm_realloc(i_mm, i_mm->t->real + len);
+	sptr = (char *)i_mm->t->addr;
+	if (ptr) {
+	    if (poffset >= 0) ptr = sptr + poffset;
+	    memcpy(sptr + i_mm->t->real, ptr, len);
+	}
+	mm_dirty(i_mm, i_mm->t->real, len);
+	i_mm->t->real += len;
+	mm_unlock(i_mm);
+    }
+    return str;
+}
+
+static VALUE
+mm_append(VALUE str1, VALUE str2)
+{
+    str2 = rb_str_to_str(str2);
+    str1 = mm_cat(str1, StringValuePtr(str2), RSTRING(str2)->len);
+    return str1;
+}
+
+/*
+ * Document-method: concat
+ * Document-method: <<
+ *
+ * call-seq: concat(other)
+ *
+ * append the contents of <em>other</em>
+ */
+static VALUE
+mm_concat(VALUE str1, VALUE str2)
+{
+    if (FIXNUM_P(str2)) {
+	int i = FIX2INT(str2);
+	if (0 <= i && i <= 0xff) { /* byte */
+	    char c = i;
+	    return mm_cat(str1, &c, 1);
+	}
+    }
+    str1 = mm_append(str1, str2);
+    return str1;
+}
+
+/*
+ * call-seq: lstrip!
+ *
+ * removes leading whitespace
+ */
+static VALUE
+mm_lstrip_bang(VALUE str)
+{
+    char *s, *t, *e;
+    mm_ipc *i_mm;
+
+    GetMmap(str, i_mm, MM_MODIFY);
+    mm_lock(i_mm, Qtrue);
+    s = (char *)i_mm->t->addr;
+    e = t = s + i_mm->t->real;
+    while (s < t && ISSPACE(*s)) s++;
+
+    if (i_mm->t->real != (size_t)(t - s) && (i_mm->t->flag & MM_FIXED)) {
+	mm_unlock(i_mm);
+	rb_raise(rb_eTypeError, "try to change the size of a fixed map");
+    }
+    i_mm->t->real = t - s;
+    if (s > (char *)i_mm->t->addr) { 
+	memmove(i_mm->t->addr, s, i_mm->t->real);
+	((char *)i_mm->t->addr)[i_mm->t->real] = '\0';
+	mm_dirty(i_mm, 0, i_mm->t->real + 1);
+	mm_unlock(i_mm);
+	return str;
+    }
+    mm_unlock(i_mm);
+    return Qnil;
+}
+
+/*
+ * call-seq: rstrip!
+ *
+ * removes trailing whitespace
+ */
+static VALUE
+mm_rstrip_bang(VALUE str)
+{
+    char *s, *t, *e;
+    mm_ipc *i_mm;
+
+    GetMmap(str, i_mm, MM_MODIFY);
+    mm_lock(i_mm, Qtrue);
+    s = (char *)i_mm->t->addr;
+    e = t = s + i_mm->t->real;
+    t--;
+    while (s <= t && ISSPACE(*t)) t--;
+    t++;
+    if (i_mm->t->real != (size_t)(t - s) && (i_mm->t->flag & MM_FIXED)) {
+	mm_unlock(i_mm);
+	rb_raise(rb_eTypeError, "try to change the size of a fixed map");
+    }
+    i_mm->t->real = t - s;
+    if (t < e) {
+	((char *)i_mm->t->addr)[i_mm->t->real] = '\0';
+	mm_unlock(i_mm);
+	return str;
+    }
+    mm_unlock(i_mm);
+    return Qnil;
+}
+
+static VALUE
+mm_strip_bang(VALUE str)
+{
+    VALUE l = mm_lstrip_bang(str);
+    VALUE r = mm_rstrip_bang(str);
+
+    if (NIL_P(l) && NIL_P(r)) return Qnil;
+    return str;
+}
+
+#define MmapStr(b, recycle)						    \
+do {									    \
+    recycle = 0;							    \
+    if (TYPE(b) == T_DATA &&  RDATA(b)->dfree == (RUBY_DATA_FUNC)mm_free) { \
+	recycle = 1;							    \
+	b = mm_str(b, MM_ORIGIN);					    \
+    }									    \
+    else {								    \
+	b = rb_str_to_str(b);						    \
+    }									    \
+} while (0);
+ 
+ 
+/*
+ * call-seq: <=>(other)
+ *
+ * comparison : return -1, 0, 1
+ */
+static VALUE
+mm_cmp(VALUE a, VALUE b)
+{
+    int result;
+    int recycle = 0;
+
+    a = mm_str(a, MM_ORIGIN);
+    MmapStr(b, recycle);
+    result = rb_str_cmp(a, b);
+    rb_gc_force_recycle(a);
+    if (recycle) rb_gc_force_recycle(b);
+    return INT2FIX(result);
+}
+
+/*
+ * call-seq: casecmp(other)
+ *
+ * only with ruby >= 1.7.1
+ */
+static VALUE
+mm_casecmp(VALUE a, VALUE b)
+{
+    VALUE result;
+    int recycle = 0;
+
+    a = mm_str(a, MM_ORIGIN);
+    MmapStr(b, recycle);
+    result = rb_funcall2(a, rb_intern("casecmp"), 1, &b);
+    rb_gc_force_recycle(a);
+    if (recycle) rb_gc_force_recycle(b);
+    return result;
+}
+
+/*
+ * Document-method: ==
+ * Document-method: ===
+ *
+ * call-seq: ==
+ *
+ * comparison
+ */
+static VALUE
+mm_equal(VALUE a, VALUE b)
+{
+    VALUE result;
+    mm_ipc *i_mm, *u_mm;
+
+    if (a == b) return Qtrue;
+    if (TYPE(b) != T_DATA || RDATA(b)->dfree != (RUBY_DATA_FUNC)mm_free)
+	return Qfalse;
+
+    GetMmap(a, i_mm, 0);
+    GetMmap(b, u_mm, 0);
+    if (i_mm->t->real != u_mm->t->real)
+        return Qfalse;
+    a = mm_str(a, MM_ORIGIN);
+    b = mm_str(b, MM_ORIGIN);
+    result = rb_funcall2(a, rb_intern("=="), 1, &b);
+    rb_gc_force_recycle(a);
+    rb_gc_force_recycle(b);
+    return result;
+}
+
+/*
+ * call-seq: eql?(other)
+ *
+ * Is this eql? to +other+ ?
+ */
+static VALUE
+mm_eql(VALUE a, VALUE b)
+{
+    VALUE result;
+    mm_ipc *i_mm, *u_mm;
+    
+    if (a == b) return Qtrue;
+    if (TYPE(b) != T_DATA || RDATA(b)->dfree != (RUBY_DATA_FUNC)mm_free)
+	return Qfalse;
+
+    GetMmap(a, i_mm, 0);
+    GetMmap(b, u_mm, 0);
+    if (i_mm->t->real != u_mm->t->real)
+        return Qfalse;
+    a = mm_str(a, MM_ORIGIN);
+    b = mm_str(b, MM_ORIGIN);
+    result = rb_funcall2(a, rb_intern("eql?"), 1, &b);
+    rb_gc_force_recycle(a);
+    rb_gc_force_recycle(b);
+    return result;
+}
+
+/*
+ * call-seq: hash
+ *
+ * Get the hash value
+ */
+static VALUE
+mm_hash(VALUE a)
+{
+    VALUE b;
+    int res;
+
+    b = mm_str(a, MM_ORIGIN);
+    res = rb_str_hash(b);
+    rb_gc_force_recycle(b);
+    return INT2FIX(res);
+}
+
+/*
+ * Document-method: length
+ * Document-method: size
+ *
+ * return the size of the file
+ */
+static VALUE
+mm_size(VALUE a)
+{
+    mm_ipc *i_mm;
+
+    GetMmap(a, i_mm, 0);
+    return UINT2NUM(i_mm->t->real);
+}
+
+/*
+ * call-seq: empty?
+ *
+ * return <em>true</em> if the file is empty
+ */
+static VALUE
+mm_empty(VALUE a)
+{
+    mm_ipc *i_mm;
+
+    GetMmap(a, i_mm, 0);
+    if (i_mm->t->real == 0) return Qtrue;
+    return Qfalse;
+}
+
+static VALUE
+mm_protect_bang(VALUE *t)
+{
+    return rb_funcall2(t[0], (ID)t[1], (int)t[2], (VALUE *)t[3]);
+}
+
+static VALUE
+mm_recycle(VALUE str)
+{
+    rb_gc_force_recycle(str);
+    return str;
+}
+
+static VALUE
+mm_i_bang(mm_bang *bang_st)
+{
+    VALUE str, res;
+    mm_ipc *i_mm;
+    
+    str = mm_str(bang_st->obj, bang_st->flag);
+    if (bang_st->flag & MM_PROTECT) {
+	VALUE tmp[4];
+	tmp[0] = str;
+	tmp[1] = (VALUE)bang_st->id;
+	tmp[2] = (VALUE)bang_st->argc;
+	tmp[3] = (VALUE)bang_st->argv;
+	res = rb_ensure(mm_protect_bang, (VALUE)tmp, mm_recycle, str);
+    }
+    else {
+	res = rb_funcall2(str, bang_st->id, bang_st->argc, bang_st->argv);
+	rb_gc_force_recycle(str);
+    }
+    if (res != Qnil) {
+	GetMmap(bang_st->obj, i_mm, 0);
+	i_mm->t->real = RSTRING(str)->len;
+	if (bang_st->flag & MM_MODIFY) {
+	    mm_dirty(i_mm, 0, i_mm->t->real);
+	}
+    }
+    return res;
+}
+
+
+static VALUE
+mm_bang_i(VALUE obj, int flag, int id, int argc, VALUE *argv)
+{
+    VALUE res;
+    mm_ipc *i_mm;
+    mm_bang bang_st;
+
+    GetMmap(obj, i_mm, 0);
+    if ((flag & MM_CHANGE) && (i_mm->t->flag & MM_FIXED)) {
+	rb_raise(rb_eTypeError, "try to change the size of a fixed map");
+    }
+    bang_st.obj = obj;
+    bang_st.flag = flag;
+    bang_st.id = id;
+    bang_st.argc = argc;
+    bang_st.argv = argv;
+    if ((i_mm->t->flag & MM_IPC) && !(flag & MM_MODIFY)) {
+	mm_rlock(i_mm);
+	res = rb_ensure(mm_i_bang, (VALUE)&bang_st, mm_vrunlock, obj);
+    }
+    else if (i_mm->t->flag & MM_IPC) {
+	mm_lock(i_mm, Qtrue);
+	res = rb_ensure(mm_i_bang, (VALUE)&bang_st, mm_vunlock, obj);
+    }
+    else {
+	res = mm_i_bang(&bang_st);
+    }
+    if (res == Qnil) return res;
+    return (flag & MM_ORIGIN)?res:obj;
+
+}
+
+/*
+ * call-seq: match(pattern)
+ *
+ * convert <em>pattern</em> to a <em>Regexp</em> and then call
+ * <em>match</em> on <em>self</em>
+ */
+static VALUE
+mm_match_m(VALUE a, VALUE b)
+{
+    return mm_bang_i(a, MM_ORIGIN, rb_intern("match"), 1, &b);
+}
+
+/*
+ * call-seq: upcase!
+ *
+ * replaces all lowercase characters to downcase characters
+ */
+static VALUE
+mm_upcase_bang(VALUE a)
+{
+    return mm_bang_i(a, MM_MODIFY, rb_intern("upcase!"), 0, 0);
+}
+
+/*
+ * call-seq: downcase!
+ *
+ * change all uppercase character to lowercase character
+ */
+static VALUE
+mm_downcase_bang(VALUE a)
+{
+    return mm_bang_i(a, MM_MODIFY, rb_intern("downcase!"), 0, 0);
+}
+
+/*
+ * call-seq: capitalize!
+ *
+ * change the first character to uppercase letter
+ */
+static VALUE
+mm_capitalize_bang(VALUE a)
+{
+    return mm_bang_i(a, MM_MODIFY, rb_intern("capitalize!"), 0, 0);
+}
+
+/*
+ * call-seq: swapcase!
+ *
+ * replaces all lowercase characters to uppercase characters, and vice-versa
+ */
+static VALUE
+mm_swapcase_bang(VALUE a)
+{
+    return mm_bang_i(a, MM_MODIFY, rb_intern("swapcase!"), 0, 0);
+}
+ 
+/*
+ * call-seq: reverse!
+ *
+ * reverse the content of the file 
+ */
+static VALUE
+mm_reverse_bang(VALUE a)
+{
+    return mm_bang_i(a, MM_MODIFY, rb_intern("reverse!"), 0, 0);
+}
+
+/*
+ * call-seq: chop!
+ *
+ * chop off the last character
+ */
+static VALUE
+mm_chop_bang(VALUE a)
+{
+    return mm_bang_i(a, MM_CHANGE, rb_intern("chop!"), 0, 0);
+}
+
+static VALUE
+mm_inspect(VALUE a)
+{
+    return rb_any_to_s(a);
+}
+
+/*
+ * call-seq: chomp!(rs = $/)
+ *
+ * chop off the  line ending character, specified by <em>rs</em>
+ */
+static VALUE
+mm_chomp_bang(int argc, VALUE *argv, VALUE obj)
+{
+    return mm_bang_i(obj, MM_CHANGE | MM_PROTECT, rb_intern("chomp!"), argc, argv);
+}
+
+/*
+ * call-seq: delete!(str)
+ *
+ * delete every characters included in <em>str</em>
+ */
+static VALUE
+mm_delete_bang(int argc, VALUE *argv, VALUE obj)
+{
+    return mm_bang_i(obj, MM_CHANGE | MM_PROTECT, rb_intern("delete!"), argc, argv);
+}
+
+/*
+ * squeeze!(str)
+ *
+ * squeezes sequences of the same characters which is included in <em>str</em>
+ */
+static VALUE
+mm_squeeze_bang(int argc, VALUE *argv, VALUE obj)
+{
+    return mm_bang_i(obj, MM_CHANGE | MM_PROTECT, rb_intern("squeeze!"), argc, argv);
+}
+
+/*
+ * call-seq: tr!(search, replace)
+ *
+ * translate the character from <em>search</em> to <em>replace</em> 
+ */
+static VALUE
+mm_tr_bang(VALUE obj, VALUE a, VALUE b)
+{
+    VALUE tmp[2];
+    tmp[0] = a;
+    tmp[1] = b;
+    return mm_bang_i(obj, MM_MODIFY | MM_PROTECT, rb_intern("tr!"), 2, tmp);
+}
+
+/*
+ * call-seq: tr_s!(search, replace)
+ *
+ * translate the character from <em>search</em> to <em>replace</em>, then
+ * squeeze sequence of the same characters 
+ */
+static VALUE
+mm_tr_s_bang(VALUE obj, VALUE a, VALUE b)
+{
+    VALUE tmp[2];
+    tmp[0] = a;
+    tmp[1] = b;
+    return mm_bang_i(obj, MM_CHANGE | MM_PROTECT, rb_intern("tr_s!"), 2, tmp);
+}
+
+/*
+ * call-seq: crypt
+ *
+ * crypt with <em>salt</em> 
+ */
+static VALUE
+mm_crypt(VALUE a, VALUE b)
+{
+    return mm_bang_i(a, MM_ORIGIN, rb_intern("crypt"), 1, &b);
+}
+
+#if defined(__GNUC__)
+#define mm_ctz(x) __builtin_ctz(x)
+#define mm_clz(x) __builtin_clz(x)
+#else
+static int
+mm_ctz(unsigned int x)
+{
+    int n = 0;
+
+    while (!(x & 1)) { x >>= 1; n++; }
+    return n;
+}
+
+static int
+mm_clz(unsigned int x)
+{
+    int n = 0;
+
+    while (!(x & 0x80000000U)) { x <<= 1; n++; }
+    return n;
+}
+#endif
+
+#ifdef MM_AVX2
+/*
+ * compare 32 positions at a time with the first and the last byte of
+ * the needle, then check the candidates with memcmp()
+ */
+__attribute__((target("avx2")))
+static long
+mm_memsearch_avx2(const char *hay, size_t hlen, const char *ndl, size_t nlen, size_t *pos)
+{
+    __m256i first = _mm256_set1_epi8(ndl[0]);
+    __m256i last = _mm256_set1_epi8(ndl[nlen - 1]);
+    size_t i;
+    unsigned int mask;
+
+    for (i = 0; i + nlen - 1 + 32 <= hlen; i += 32) {
+	__m256i bf = _mm256_loadu_si256((const __m256i *)(hay + i));
+	__m256i bl = _mm256_loadu_si256((const __m256i *)(hay + i + nlen - 1));
+
+	mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(first, bf),
+						     _mm256_cmpeq_epi8(last, bl)));
+	while (mask) {
+	    size_t k = i + mm_ctz(mask);
+
+	    if (memcmp(hay + k + 1, ndl + 1, nlen - 2) == 0) return k;
+	    mask &= mask - 1;
+	}
+    }
+    *pos = i;
+    return -1;
+}
 #endif
+
+/*
+ * return the offset of the first occurrence of ndl in hay, or -1
+ */
+static long
+mm_memsearch(const char *hay, size_t hlen, const char *ndl, size_t nlen)
+{
+    const char *p;
+    size_t i = 0;
+
+    if (nlen == 0) return 0;
+    if (nlen > hlen) return -1;
+    if (nlen == 1) {
+	p = memchr(hay, ndl[0], hlen);
+	return p ? p - hay : -1;
     }
-    init = 0;
-    if (anonymous) {
-	if (size <= 0) {
-	    rb_raise(rb_eArgError, "length not specified for an anonymous map");
+#ifdef __SSE2__
+    {
+	__m128i first = _mm_set1_epi8(ndl[0]);
+	__m128i last = _mm_set1_epi8(ndl[nlen - 1]);
+	unsigned int mask;
+
+#ifdef MM_AVX2
+	if (__builtin_cpu_supports("avx2")) {
+	    long res = mm_memsearch_avx2(hay, hlen, ndl, nlen, &i);
+	    if (res >= 0) return res;
 	}
-	if (offset) {
-	    rb_warning("Ignoring offset for an anonymous map");
-	    offset = 0;
+#endif
+	for (; i + nlen - 1 + 16 <= hlen; i += 16) {
+	    __m128i bf = _mm_loadu_si128((const __m128i *)(hay + i));
+	    __m128i bl = _mm_loadu_si128((const __m128i *)(hay + i + nlen - 1));
+
+	    mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, bf),
+						   _mm_cmpeq_epi8(last, bl)));
+	    while (mask) {
+		size_t k = i + mm_ctz(mask);
+
+		if (memcmp(hay + k + 1, ndl + 1, nlen - 2) == 0) return k;
+		mask &= mask - 1;
+	    }
 	}
-	smode = O_RDWR;
-	pmode = PROT_READ | PROT_WRITE;
-	i_mm->t->flag |= MM_FIXED | MM_ANON;
     }
-    else {
-	if (size == 0 && (smode & O_RDWR)) {
-	    if (lseek(fd, i_mm->t->incr - 1, SEEK_END) == -1) {
-		rb_raise(rb_eIOError, "Can't lseek %d", i_mm->t->incr - 1);
-	    }
-	    if (write(fd, "\000", 1) != 1) {
-		rb_raise(rb_eIOError, "Can't extend %s", path);
+#endif
+    while (i + nlen <= hlen) {
+	p = memchr(hay + i, ndl[0], hlen - nlen + 1 - i);
+	if (!p) return -1;
+	if (memcmp(p + 1, ndl + 1, nlen - 1) == 0) return p - hay;
+	i = p - hay + 1;
+    }
+    return -1;
+}
+
+/*
+ * return the offset of the last occurrence of ndl in hay, or -1
+ */
+static long
+mm_memrsearch(const char *hay, size_t hlen, const char *ndl, size_t nlen)
+{
+    size_t i;
+
+    if (nlen > hlen) return -1;
+    if (nlen == 0) return hlen;
+    i = hlen - nlen + 1;
+#ifdef __SSE2__
+    if (nlen > 1) {
+	__m128i first = _mm_set1_epi8(ndl[0]);
+	__m128i last = _mm_set1_epi8(ndl[nlen - 1]);
+	unsigned int mask;
+
+	/* i is the number of candidate positions not yet examined */
+	while (i >= 16) {
+	    __m128i bf = _mm_loadu_si128((const __m128i *)(hay + i - 16));
+	    __m128i bl = _mm_loadu_si128((const __m128i *)(hay + i - 16 + nlen - 1));
+
+	    mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, bf),
+						   _mm_cmpeq_epi8(last, bl)));
+	    while (mask) {
+		int bit = 31 - mm_clz(mask);
+		size_t k = i - 16 + bit;
+
+		if (memcmp(hay + k + 1, ndl + 1, nlen - 2) == 0) return k;
+		mask &= ~(1U << bit);
 	    }
-	    init = 1;
-	    size = i_mm->t->incr;
+	    i -= 16;
 	}
-	if (!NIL_P(fdv)) {
-	    i_mm->t->flag |= MM_FIXED;
+    }
+#endif
+    while (i > 0) {
+	i--;
+	if (hay[i] == ndl[0] && memcmp(hay + i + 1, ndl + 1, nlen - 1) == 0) {
+	    return i;
 	}
     }
-    addr = mmap(0, size, pmode, vscope, fd, offset);
-    if (NIL_P(fdv) && !anonymous) {
-	close(fd);
+    return -1;
+}
+
+/*
+ * native search for a String (or a Mmap) needle : return the index,
+ * -1 if not found, or -2 if <em>sub</em> must be given to String
+ */
+static long
+mm_search(VALUE obj, VALUE sub, long pos, int reverse)
+{
+    mm_ipc *i_mm;
+    char *ptr;
+    long len, res;
+
+    if (TYPE(sub) != T_STRING &&
+	!(TYPE(sub) == T_DATA && RDATA(sub)->dfree == (RUBY_DATA_FUNC)mm_free)) {
+	return -2;
     }
-    if (addr == MAP_FAILED || !addr) {
-	rb_raise(rb_eArgError, "mmap failed (%d)", errno);
+    GetMmap(obj, i_mm, 0);
+    StringMmap(sub, ptr, len);
+    mm_rlock(i_mm);
+    if (pos < 0) {
+	pos += i_mm->t->real;
     }
-#ifdef MADV_NORMAL
-    if (i_mm->t->advice && madvise(addr, size, i_mm->t->advice) == -1) {
-	rb_raise(rb_eArgError, "madvise(%d)", errno);
+    if (pos < 0 || (!reverse && (size_t)pos > i_mm->t->real)) {
+	mm_runlock(i_mm);
+	return -1;
     }
-#endif
-    if (anonymous && TYPE(options) == T_HASH) {
-	VALUE val;
-	char *ptr;
-
-	val = rb_hash_aref(options, rb_str_new2("initialize"));
-	if (!NIL_P(val)) {
-	    ptr = StringValuePtr(val);
-	    memset(addr, ptr[0], size);
+    if (reverse) {
+	if ((size_t)pos > i_mm->t->real) {
+	    pos = i_mm->t->real;
+	}
+	if ((size_t)(pos + len) > i_mm->t->real) {
+	    res = mm_memrsearch(i_mm->t->addr, i_mm->t->real, ptr, len);
+	}
+	else {
+	    res = mm_memrsearch(i_mm->t->addr, pos + len, ptr, len);
 	}
-    }
-    i_mm->t->addr  = addr;
-    i_mm->t->len = size;
-    if (!init) i_mm->t->real = size;
-    i_mm->t->pmode = pmode;
-    i_mm->t->vscope = vscope;
-    i_mm->t->smode = smode & ~O_TRUNC;
-    i_mm->t->path = (path)?ruby_strdup(path):(char *)-1;
-    if (smode == O_RDONLY) {
-	obj = rb_obj_freeze(obj);
-	i_mm->t->flag |= MM_FROZEN;
     }
     else {
-	if (smode == O_WRONLY) {
-	    i_mm->t->flag |= MM_FIXED;
-	}
-	OBJ_TAINT(obj);
+	res = mm_memsearch((char *)i_mm->t->addr + pos, i_mm->t->real - pos, ptr, len);
+	if (res >= 0) res += pos;
     }
-    return obj;
+    mm_runlock(i_mm);
+    return res;
 }
 
 /*
- * call-seq: initialize
+ * call-seq: include?(other)
  *
- * Create a new Mmap object
+ * return <em>true</em> if <em>other</em> is found
  */
 static VALUE
-mm_init_copy(VALUE obj, VALUE other)
+mm_include(VALUE a, VALUE b)
 {
-    rb_raise(rb_eTypeError, "can't copy %s", rb_obj_classname(other));
+    long res = mm_search(a, b, 0, 0);
+
+    if (res == -2) {
+	return mm_bang_i(a, MM_ORIGIN, rb_intern("include?"), 1, &b);
+    }
+    return (res >= 0) ? Qtrue : Qfalse;
 }
 
 /*
- * Document-method: msync
- * Document-method: sync
- * Document-method: flush
- *
- * call-seq: msync
+ * call-seq: index(substr, pos = 0)
  *
- * flush the file
+ * return the index of <em>substr</em> 
  */
 static VALUE
-mm_msync(int argc, VALUE *argv, VALUE obj)
+mm_index(int argc, VALUE *argv, VALUE obj)
 {
-    mm_ipc *i_mm;
-    VALUE oflag;
-    int ret;
-    int flag = MS_SYNC;
+    VALUE sub, initpos;
+    long res;
 
-    if (argc) {
-	rb_scan_args(argc, argv, "01", &oflag);
-	flag = NUM2INT(oflag);
-    }
-    GetMmap(obj, i_mm, MM_MODIFY);
-    if ((ret = msync(i_mm->t->addr, i_mm->t->len, flag)) != 0) {
-	rb_raise(rb_eArgError, "msync(%d)", ret);
+    rb_scan_args(argc, argv, "11", &sub, &initpos);
+    res = mm_search(obj, sub, NIL_P(initpos) ? 0 : NUM2LONG(initpos), 0);
+    if (res == -2) {
+	return mm_bang_i(obj, MM_ORIGIN, rb_intern("index"), argc, argv);
     }
-    if (i_mm->t->real < i_mm->t->len && i_mm->t->vscope != MAP_PRIVATE)
-	mm_expandf(i_mm, i_mm->t->real);
-    return obj;
+    return (res >= 0) ? LONG2NUM(res) : Qnil;
 }
 
 /*
- * Document-method: mprotect
- * Document-method: protect
- *
- * call-seq: mprotect(mode)
+ * call-seq: rindex(sibstr, pos = nil)
  *
- * change the mode, value must be "r", "w" or "rw"
+ * return the index of the last occurrence of <em>substr</em>
  */
 static VALUE
-mm_mprotect(VALUE obj, VALUE a)
+mm_rindex(int argc, VALUE *argv, VALUE obj)
 {
+    VALUE sub, initpos;
+    long res, pos;
     mm_ipc *i_mm;
-    int ret, pmode;
-    char *smode;
 
-    GetMmap(obj, i_mm, 0);
-    if (TYPE(a) == T_STRING) {
-	smode = StringValuePtr(a);
-	if (strcmp(smode, "r") == 0) pmode = PROT_READ;
-	else if (strcmp(smode, "w") == 0) pmode = PROT_WRITE;
-	else if (strcmp(smode, "rw") == 0 || strcmp(smode, "wr") == 0)
-	    pmode = PROT_READ | PROT_WRITE;
-	else {
-	    rb_raise(rb_eArgError, "Invalid mode %s", smode);
-	}
+    rb_scan_args(argc, argv, "11", &sub, &initpos);
+    if (NIL_P(initpos)) {
+	GetMmap(obj, i_mm, 0);
+	pos = i_mm->t->real;
     }
     else {
-	pmode = NUM2INT(a);
-    }
-    if ((pmode & PROT_WRITE) && (i_mm->t->flag & MM_FROZEN)) 
-	rb_error_frozen("mmap");
-    if ((ret = mprotect(i_mm->t->addr, i_mm->t->len, pmode | PROT_READ)) != 0) {
-	rb_raise(rb_eArgError, "mprotect(%d)", ret);
-    }
-    i_mm->t->pmode = pmode;
-    if (pmode & PROT_READ) {
-	if (pmode & PROT_WRITE) i_mm->t->smode = O_RDWR;
-	else {
-	    i_mm->t->smode = O_RDONLY;
-	    obj = rb_obj_freeze(obj);
-	    i_mm->t->flag |= MM_FROZEN;
-	}
+	pos = NUM2LONG(initpos);
     }
-    else if (pmode & PROT_WRITE) {
-	i_mm->t->flag |= MM_FIXED;
-	i_mm->t->smode = O_WRONLY;
+    res = mm_search(obj, sub, pos, 1);
+    if (res == -2) {
+	return mm_bang_i(obj, MM_ORIGIN, rb_intern("rindex"), argc, argv);
     }
-    return obj;
+    return (res >= 0) ? LONG2NUM(res) : Qnil;
 }
 
-#ifdef MADV_NORMAL
 /*
- * Document-method: madvise
- * Document-method: advise
+ * Document-method: []
+ * Document-method: slice
  *
- * call-seq: madvise(advice)
+ * call-seq: [](args)
  *
- * <em>advice</em> can have the value <em>Mmap::MADV_NORMAL</em>,
- * <em>Mmap::MADV_RANDOM</em>, <em>Mmap::MADV_SEQUENTIAL</em>,
- * <em>Mmap::MADV_WILLNEED</em>, <em>Mmap::MADV_DONTNEED</em>
+ * Element reference - with the following syntax:
+ * 
+ *   self[nth] 
+ * 
+ * retrieve the <em>nth</em> character
+ * 
+ *   self[start..last]
+ * 
+ * return a substring from <em>start</em> to <em>last</em>
+ * 
+ *   self[start, length]
+ * 
+ * return a substring of <em>lenght</em> characters from <em>start</em> 
+ */
+static VALUE
+mm_aref_m(int argc, VALUE *argv, VALUE obj)
+{
+    return mm_bang_i(obj, MM_ORIGIN, rb_intern("[]"), argc, argv);
+}
+
+/*
+ * call-seq: sum(bits = 16)
  *
+ * return a checksum
  */
 static VALUE
-mm_madvise(VALUE obj, VALUE a)
+mm_sum(int argc, VALUE *argv, VALUE obj)
 {
-    mm_ipc *i_mm;
-    
-    GetMmap(obj, i_mm, 0);
-    if (madvise(i_mm->t->addr, i_mm->t->len, NUM2INT(a)) == -1) {
-	rb_raise(rb_eTypeError, "madvise(%d)", errno);
+    return mm_bang_i(obj, MM_ORIGIN, rb_intern("sum"), argc, argv);
+}
+
+/*
+ * call-seq: split(sep, limit = 0)
+ *
+ * splits into a list of strings and return this array
+ */
+static VALUE
+mm_split(int argc, VALUE *argv, VALUE obj)
+{
+    return mm_bang_i(obj, MM_ORIGIN, rb_intern("split"), argc, argv);
+}
+
+#ifdef MM_AVX2
+__attribute__((target("avx2")))
+static size_t
+mm_memcount_avx2(const char *ptr, size_t len, int c, size_t *pos)
+{
+    __m256i pat = _mm256_set1_epi8(c), zero = _mm256_setzero_si256();
+    size_t i = 0, count = 0;
+    int n;
+
+    while (i + 32 <= len) {
+	__m256i acc = zero, sum;
+
+	/* each byte of acc counts at most 255 matches */
+	for (n = 0; n < 255 && i + 32 <= len; n++, i += 32) {
+	    __m256i b = _mm256_loadu_si256((const __m256i *)(ptr + i));
+	    acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(b, pat));
+	}
+	sum = _mm256_sad_epu8(acc, zero);
+	count += _mm256_extract_epi64(sum, 0) + _mm256_extract_epi64(sum, 1) +
+	    _mm256_extract_epi64(sum, 2) + _mm256_extract_epi64(sum, 3);
+    }
+    *pos = i;
+    return count;
+}
+#endif
+
+/*
+ * return the number of bytes c in [ptr, ptr + len)
+ */
+static size_t
+mm_memcount(const char *ptr, size_t len, int c)
+{
+    size_t i = 0, count = 0;
+
+#ifdef __SSE2__
+    __m128i pat = _mm_set1_epi8(c), zero = _mm_setzero_si128();
+    int n;
+
+#ifdef MM_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+	count = mm_memcount_avx2(ptr, len, c, &i);
+    }
+#endif
+    while (i + 16 <= len) {
+	__m128i acc = zero, sum;
+
+	for (n = 0; n < 255 && i + 16 <= len; n++, i += 16) {
+	    __m128i b = _mm_loadu_si128((const __m128i *)(ptr + i));
+	    acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(b, pat));
+	}
+	sum = _mm_sad_epu8(acc, zero);
+	count += _mm_cvtsi128_si32(sum) + _mm_extract_epi16(sum, 4);
     }
-    i_mm->t->advice = NUM2INT(a);
-    return Qnil;
-}
 #endif
+    for (; i < len; i++) {
+	if (ptr[i] == (char)c) count++;
+    }
+    return count;
+}
 
-#define StringMmap(b, bp, bl)						   \
-do {									   \
-    if (TYPE(b) == T_DATA && RDATA(b)->dfree == (RUBY_DATA_FUNC)mm_free) { \
-	mm_ipc *b_mm;							   \
-	GetMmap(b, b_mm, 0);						   \
-	bp = b_mm->t->addr;						   \
-	bl = b_mm->t->real;						   \
-    }									   \
-    else {								   \
-	bp = StringValuePtr(b);						   \
-	bl = RSTRING(b)->len;						   \
-    }									   \
-} while (0);
+#define MM_COUNT_CHUNK (16 * 1024 * 1024)
+#define MM_COUNT_THREADS 16
 
-static void
-mm_update(mm_ipc *str, long beg, long len, VALUE val)
+#if HAVE_PTHREAD_H
+static void *
+mm_i_count_thread(void *ptr)
 {
-    char *valp;
-    long vall;
+    mm_st *st_mm = (mm_st *)ptr;
 
-    if (str->t->flag & MM_FROZEN) rb_error_frozen("mmap");
-    if (len < 0) rb_raise(rb_eIndexError, "negative length %d", len);
-    mm_lock(str, Qfalse);
-    if (beg < 0) {
-	beg += str->t->real;
-    }
-    if (beg < 0 || str->t->real < (size_t)beg) {
-	if (beg < 0) {
-	    beg -= str->t->real;
+    st_mm->count = mm_memcount(st_mm->addr, st_mm->len, st_mm->flag);
+    return 0;
+}
+#endif
+
+/*
+ * count the byte st_mm->flag, with up to one thread for each
+ * MM_COUNT_CHUNK bytes
+ */
+static void *
+mm_i_count(void *ptr)
+{
+    mm_st *st_mm = (mm_st *)ptr;
+#if HAVE_PTHREAD_H
+    mm_st sub[MM_COUNT_THREADS];
+    pthread_t thread[MM_COUNT_THREADS];
+    int started[MM_COUNT_THREADS];
+    long ncpu = 1;
+    size_t chunk;
+    int i, n;
+
+#ifdef _SC_NPROCESSORS_ONLN
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    n = st_mm->len / MM_COUNT_CHUNK;
+    if (n > ncpu) n = ncpu;
+    if (n > MM_COUNT_THREADS) n = MM_COUNT_THREADS;
+    if (n > 1) {
+	chunk = (st_mm->len + n - 1) / n;
+	for (i = 0; i < n; i++) {
+	    sub[i] = *st_mm;
+	    sub[i].addr = (char *)st_mm->addr + i * chunk;
+	    sub[i].len = (i == n - 1) ? st_mm->len - i * chunk : chunk;
+	    started[i] = (i > 0 && pthread_create(&thread[i], 0, mm_i_count_thread, &sub[i]) == 0);
 	}
-	mm_unlock(str);
-	rb_raise(rb_eIndexError, "index %d out of string", beg);
-    }
-    if (str->t->real < (size_t)(beg + len)) {
-	len = str->t->real - beg;
+	st_mm->count = 0;
+	for (i = 0; i < n; i++) {
+	    if (started[i]) {
+		pthread_join(thread[i], 0);
+	    }
+	    else {
+		mm_i_count_thread(&sub[i]);
+	    }
+	    st_mm->count += sub[i].count;
+	}
+	st_mm->done = 1;
+	return 0;
     }
+#endif
+    st_mm->count = mm_memcount(st_mm->addr, st_mm->len, st_mm->flag);
+    st_mm->done = 1;
+    return 0;
+}
 
-    mm_unlock(str);
-    StringMmap(val, valp, vall);
-    mm_lock(str, Qfalse);
+/*
+ * convert (offset, length) or (range) to a range of bytes of the file
+ */
+static void
+mm_byte_range(mm_ipc *i_mm, VALUE voff, VALUE vlen, size_t *beg, size_t *len)
+{
+    long off, l;
 
-    if ((str->t->flag & MM_FIXED) && vall != len) {
-	mm_unlock(str);
-	rb_raise(rb_eTypeError, "try to change the size of a fixed map");
+    if (NIL_P(vlen) && !NIL_P(voff) && !FIXNUM_P(voff) &&
+	rb_range_beg_len(voff, &off, &l, i_mm->t->real, 1)) {
+	*beg = off;
+	*len = l;
+	return;
     }
-    if (len < vall) {
-	mm_realloc(str, str->t->real + vall - len);
+    off = NIL_P(voff) ? 0 : NUM2LONG(voff);
+    if (off < 0) {
+	off += i_mm->t->real;
     }
-
-    if (vall != len) {
-	memmove((char *)str->t->addr + beg + vall,
-		(char *)str->t->addr + beg + len,
-		str->t->real - (beg + len));
+    if (off < 0 || i_mm->t->real < (size_t)off) {
+	rb_raise(rb_eIndexError, "offset %ld out of mmap", off);
     }
-    if (str->t->real < (size_t)beg && len < 0) {
-	MEMZERO(str->t->addr + str->t->real, char, -len);
+    *beg = off;
+    *len = i_mm->t->real - off;
+    if (!NIL_P(vlen)) {
+	l = NUM2LONG(vlen);
+	if (l < 0) {
+	    rb_raise(rb_eIndexError, "negative length %ld", l);
+	}
+	if ((size_t)l < *len) {
+	    *len = l;
+	}
     }
-    if (vall > 0) {
-	memmove((char *)str->t->addr + beg, valp, vall);
+}
+
+static size_t
+mm_count_range(mm_ipc *i_mm, int c, size_t beg, size_t len)
+{
+    mm_st st_mm;
+
+    st_mm.i_mm = i_mm;
+    st_mm.addr = (char *)i_mm->t->addr + beg;
+    st_mm.len = len;
+    st_mm.flag = c;
+    st_mm.count = 0;
+    mm_rlock(i_mm);
+    if (len < MM_COUNT_CHUNK) {
+	mm_i_count(&st_mm);
     }
-    str->t->real += vall - len;
-    mm_unlock(str);
+    else {
+	mm_nogvl(&st_mm, mm_i_count, 1);
+    }
+    mm_runlock(i_mm);
+    return st_mm.count;
 }
 
 /*
- * call-seq: =~(other)
+ * call-seq: count(o1, *args)
  *
- * return an index of the match 
+ * each parameter defines a set of character to count
  */
 static VALUE
-mm_match(VALUE x, VALUE y)
+mm_count(int argc, VALUE *argv, VALUE obj)
 {
-    VALUE reg, res;
-    long start;
+    mm_ipc *i_mm;
 
-    x = mm_str(x, MM_ORIGIN);
-    if (TYPE(y) == T_DATA && RDATA(y)->dfree == (RUBY_DATA_FUNC)mm_free) {
-	y = mm_to_str(y);
+    if (argc == 1 && TYPE(argv[0]) == T_STRING && RSTRING(argv[0])->len == 1) {
+	GetMmap(obj, i_mm, 0);
+	return ULONG2NUM(mm_count_range(i_mm, (unsigned char)RSTRING(argv[0])->ptr[0],
+					0, i_mm->t->real));
     }
-    switch (TYPE(y)) {
-      case T_REGEXP:
-	res = rb_reg_match(y, x);
-	break;
+    return mm_bang_i(obj, MM_ORIGIN, rb_intern("count"), argc, argv);
+}
 
-      case T_STRING:
-	reg = rb_reg_regcomp(y);
-	start = rb_reg_search(reg, x, 0, 0);
-	if (start == -1) res = Qnil;
-	else res = INT2NUM(start);
-	break;
+/*
+ * call-seq:
+ *   count_byte(byte, offset = nil, length = nil)
+ *   count_byte(byte, range)
+ *
+ * return the number of <em>byte</em> (an Integer or a String of
+ * one character) in the range
+ */
+static VALUE
+mm_count_byte(int argc, VALUE *argv, VALUE obj)
+{
+    mm_ipc *i_mm;
+    VALUE vbyte, voff, vlen;
+    size_t beg, len;
+    int c;
 
-      default:
-	res = rb_funcall(y, rb_intern("=~"), 1, x);
-	break;
+    rb_scan_args(argc, argv, "12", &vbyte, &voff, &vlen);
+    GetMmap(obj, i_mm, 0);
+    if (TYPE(vbyte) == T_STRING) {
+	if (RSTRING(vbyte)->len != 1) {
+	    rb_raise(rb_eArgError, "expected a String of one byte");
+	}
+	c = (unsigned char)RSTRING(vbyte)->ptr[0];
     }
-    return res;
+    else {
+	c = NUM2INT(vbyte) & 0xff;
+    }
+    mm_byte_range(i_mm, voff, vlen, &beg, &len);
+    return ULONG2NUM(mm_count_range(i_mm, c, beg, len));
 }
 
+/*
+ * call-seq: line_count
+ *
+ * return the number of lines, i.e. the number of "\n" plus one if
+ * the file don't end with "\n"
+ */
 static VALUE
-get_pat(VALUE pat)
+mm_line_count(VALUE obj)
 {
-    switch (TYPE(pat)) {
-      case T_REGEXP:
-	break;
-
-      case T_STRING:
-	pat = rb_reg_regcomp(pat);
-	break;
+    mm_ipc *i_mm;
+    size_t count;
 
-      default:
-	/* type failed */
-	Check_Type(pat, T_REGEXP);
+    GetMmap(obj, i_mm, 0);
+    count = mm_count_range(i_mm, '\n', 0, i_mm->t->real);
+    if (i_mm->t->real && ((char *)i_mm->t->addr)[i_mm->t->real - 1] != '\n') {
+	count++;
     }
-    return pat;
+    return ULONG2NUM(count);
 }
 
-static int
-mm_correct_backref(void)
+static VALUE
+mm_internal_each(VALUE arg)
+{
+    VALUE *tmp = (VALUE *)arg;
+    return rb_funcall2(tmp[0], (ID)tmp[1], (int)tmp[2], (VALUE *)tmp[3]);
+}
+
+/*
+ * call-seq: scan(pattern, &block)
+ *
+ * return an array of all occurence matched by <em>pattern</em> 
+ */
+static VALUE
+mm_i_scan_yield(VALUE val, VALUE obj)
 {
+    mm_ipc *i_mm;
     VALUE match;
-    int i, start;
 
+    Data_Get_Struct(obj, mm_ipc, i_mm);
     match = rb_backref_get();
-    if (NIL_P(match)) return 0;
-    if (RMATCH(match)->BEG(0) == -1) return 0;
-    start = RMATCH(match)->BEG(0);
-    RMATCH(match)->str = rb_str_new(StringValuePtr(RMATCH(match)->str) + start,
-				    RMATCH(match)->END(0) - start);
-    if (OBJ_TAINTED(match)) OBJ_TAINT(RMATCH(match)->str);
-    for (i = 0; i < RMATCH(match)->regs->num_regs && RMATCH(match)->BEG(i) != -1; i++) {
-	RMATCH(match)->BEG(i) -= start;
-	RMATCH(match)->END(i) -= start;
+    if (!NIL_P(match) && RMATCH(match)->END(0) >= 0) {
+	mm_readahead(i_mm, RMATCH(match)->END(0));
     }
-    rb_backref_set(match);
-    return start;
+    return rb_yield(val);
 }
 
 static VALUE
-mm_sub_bang_int(mm_bang *bang_st)
+mm_scan(VALUE obj, VALUE a)
 {
-    int argc = bang_st->argc;
-    VALUE *argv = bang_st->argv;
-    VALUE obj = bang_st->obj;
-    VALUE pat, repl = Qnil, match, str, res;
-    struct re_registers *regs;
-    int start, iter = 0;
-    int tainted = 0;
-    long plen;
+    VALUE tmp[4];
     mm_ipc *i_mm;
-    char *ptr;
 
-    if (argc == 1 && rb_block_given_p()) {
-	iter = 1;
+    GetMmap(obj, i_mm, 0);
+    i_mm->ranext = 0;
+    mm_readahead(i_mm, 0);
+    if (!rb_block_given_p()) {
+	return rb_funcall(mm_str(obj, MM_ORIGIN), rb_intern("scan"), 1, a);
     }
-    else if (argc == 2) {
-	repl = rb_str_to_str(argv[1]);
-	if (OBJ_TAINTED(repl)) tainted = 1;
+    tmp[0] = mm_str(obj, MM_ORIGIN);
+    tmp[1] = (VALUE)rb_intern("scan");
+    tmp[2] = (VALUE)1;
+    tmp[3] = (VALUE)&a;
+    if (i_mm->readahead) {
+	rb_iterate(mm_internal_each, (VALUE)tmp, mm_i_scan_yield, obj);
     }
     else {
-	rb_raise(rb_eArgError, "wrong # of arguments(%d for 2)", argc);
-    }
-    GetMmap(obj, i_mm, MM_MODIFY);
-    str = mm_str(obj, MM_MODIFY | MM_ORIGIN);
-
-    pat = get_pat(argv[0]);
-    res = Qnil;
-    if (rb_reg_search(pat, str, 0, 0) >= 0) {
-	start = mm_correct_backref();
-	match = rb_backref_get();
-	regs = RMATCH(match)->regs;
-	if (iter) {
-	    rb_match_busy(match);
-	    repl = rb_obj_as_string(rb_yield(rb_reg_nth_match(0, match)));
-	    rb_backref_set(match);
-	}
-	else {
-	    RSTRING(str)->ptr += start;
-	    repl = rb_reg_regsub(repl, str, regs);
-	    RSTRING(str)->ptr -= start;
-	}
-	if (OBJ_TAINTED(repl)) tainted = 1;
-	plen = END(0) - BEG(0);
-	if (RSTRING(repl)->len > plen) {
-	    mm_realloc(i_mm, RSTRING(str)->len + RSTRING(repl)->len - plen);
-	    RSTRING(str)->ptr = i_mm->t->addr;
-	}
-	ptr = RSTRING(str)->ptr + start + BEG(0);
-	if (RSTRING(repl)->len != plen) {
-	    if (i_mm->t->flag & MM_FIXED) {
-		rb_raise(rb_eTypeError, "try to change the size of a fixed map");
-	    }
-	    memmove(ptr + RSTRING(repl)->len,
-		    ptr + plen,
-		    RSTRING(str)->len - start - BEG(0) - plen);
-	}
-	memcpy(ptr, RSTRING(repl)->ptr, RSTRING(repl)->len);
-	i_mm->t->real += RSTRING(repl)->len - plen;
-	if (tainted) OBJ_TAINT(obj);
-
-	res = obj;
+	rb_iterate(mm_internal_each, (VALUE)tmp, rb_yield, 0);
     }
-    rb_gc_force_recycle(str);
-    return res;
+    return obj;
 }
 
 /*
+ * Document-method: each
+ * Document-method: each_line
+ *
  * call-seq:
- *    str.sub!(pattern, replacement)      => str or nil
- *    str.sub!(pattern) {|match| block }  => str or nil
+ *    each(rs = $/, options = {}, &block)
  *
- * substitution 
+ * iterate on each line. The map is scanned in place and each line is
+ * copied out, or yielded without any copy when <em>options</em>
+ * contains "shared" => true (the String is frozen and becomes invalid
+ * once the map is unmapped or remapped).
+ *
+ * "chomp" => true remove the separator from each line
+ *
+ * "offsets" => true yield (offset, length) instead of a String
+ *
+ * Without a block an Enumerator is returned.
  */
 static VALUE
-mm_sub_bang(int argc, VALUE *argv, VALUE obj)
+mm_i_each_yield(VALUE val, VALUE arg)
 {
-    VALUE res;
-    mm_bang bang_st;
+    VALUE *tmp = (VALUE *)arg;
     mm_ipc *i_mm;
 
-    bang_st.argc = argc;
-    bang_st.argv = argv;
-    bang_st.obj = obj;
-    GetMmap(obj, i_mm, MM_MODIFY);
-    if (i_mm->t->flag & MM_IPC) {
-	mm_lock(i_mm, Qtrue);
-	res = rb_ensure(mm_sub_bang_int, (VALUE)&bang_st, mm_vunlock, obj);
+    Data_Get_Struct(tmp[4], mm_ipc, i_mm);
+    tmp[5] += FIXNUM_P(val) ? 1 : RSTRING(val)->len;
+    mm_readahead(i_mm, tmp[5]);
+    return rb_yield(val);
+}
+
+static VALUE
+mm_substr(VALUE obj, mm_ipc *i_mm, size_t beg, size_t len, int shared)
+{
+    VALUE ret;
+
+    if (!shared) {
+	ret = rb_str_new((char *)i_mm->t->addr + beg, len);
     }
     else {
-	res = mm_sub_bang_int(&bang_st);
+	ret = rb_obj_alloc(rb_cString);
+	RSTRING(ret)->ptr = (char *)i_mm->t->addr + beg;
+	RSTRING(ret)->len = len;
+	RSTRING(ret)->aux.shared = ret;
+	FL_SET(ret, ELTS_SHARED);
+	rb_obj_freeze(ret);
     }
-    return res;
+    if (rb_obj_tainted(obj)) {
+	OBJ_TAINT(ret);
+    }
+    return ret;
 }
 
 static VALUE
-mm_gsub_bang_int(mm_bang *bang_st)
+mm_each_line(int argc, VALUE *argv, VALUE obj)
 {
-    int argc = bang_st->argc;
-    VALUE *argv = bang_st->argv;
-    VALUE obj = bang_st->obj;
-    VALUE pat, val, repl = Qnil, match, str;
-    struct re_registers *regs;
-    long beg, offset;
-    int start, iter = 0;
-    int tainted = 0;
-    long plen;
+    VALUE tmp[6], rs, options = Qnil;
     mm_ipc *i_mm;
-    char *ptr;
+    char *addr, *rsptr, *p;
+    size_t pos, end, len, rslen;
+    long res;
+    int chomp, offsets, shared, newline;
 
-    if (argc == 1 && rb_block_given_p()) {
-	iter = 1;
-    }
-    else if (argc == 2) {
-	repl = rb_str_to_str(argv[1]);
-	if (OBJ_TAINTED(repl)) tainted = 1;
+#ifdef RETURN_ENUMERATOR
+    RETURN_ENUMERATOR(obj, argc, argv);
+#endif
+    if (argc > 0 && TYPE(argv[argc - 1]) == T_HASH) {
+	options = argv[--argc];
     }
-    else {
-	rb_raise(rb_eArgError, "wrong # of arguments(%d for 2)", argc);
+    if (rb_scan_args(argc, argv, "01", &rs) == 0) {
+	rs = rb_rs;
     }
-    GetMmap(obj, i_mm, MM_MODIFY);
-    str = mm_str(obj, MM_MODIFY | MM_ORIGIN);
-
-    pat = get_pat(argv[0]);
-    offset = 0;
-    beg = rb_reg_search(pat, str, 0, 0);
-    if (beg < 0) {
-	rb_gc_force_recycle(str);
-	return Qnil;
+    if (!NIL_P(rs)) {
+	StringValue(rs);
     }
-    while (beg >= 0) {
-	start = mm_correct_backref();
-	match = rb_backref_get();
-	regs = RMATCH(match)->regs;
-	if (iter) {
-	    rb_match_busy(match);
-	    val = rb_obj_as_string(rb_yield(rb_reg_nth_match(0, match)));
-	    rb_backref_set(match);
+    GetMmap(obj, i_mm, 0);
+    i_mm->ranext = 0;
+    mm_readahead(i_mm, 0);
+    if (!NIL_P(rs) && RSTRING(rs)->len == 0) {
+	/* paragraph mode is left to String#each_line */
+	tmp[0] = mm_str(obj, MM_ORIGIN);
+	tmp[1] = (VALUE)rb_intern("each_line");
+	tmp[2] = (VALUE)argc;
+	tmp[3] = (VALUE)argv;
+	tmp[4] = obj;
+	tmp[5] = 0;
+	if (i_mm->readahead) {
+	    rb_iterate(mm_internal_each, (VALUE)tmp, mm_i_each_yield, (VALUE)tmp);
 	}
 	else {
-	    RSTRING(str)->ptr += start;
-	    val = rb_reg_regsub(repl, str, regs);
-	    RSTRING(str)->ptr -= start;
+	    rb_iterate(mm_internal_each, (VALUE)tmp, rb_yield, 0);
 	}
-	if (OBJ_TAINTED(repl)) tainted = 1;
-	plen = END(0) - BEG(0);
-	if ((i_mm->t->real + RSTRING(val)->len - plen) > i_mm->t->len) {
-	    mm_realloc(i_mm, RSTRING(str)->len + RSTRING(val)->len - plen);
+	return obj;
+    }
+    chomp = mm_i_option(options, "chomp");
+    offsets = mm_i_option(options, "offsets");
+    shared = mm_i_option(options, "shared");
+    rsptr = NIL_P(rs) ? 0 : RSTRING(rs)->ptr;
+    rslen = NIL_P(rs) ? 0 : RSTRING(rs)->len;
+    newline = rslen == 1 && rsptr[0] == '\n';
+    pos = 0;
+    while (pos < i_mm->t->real) {
+	/* the block may have changed the map: reload it every time */
+	addr = i_mm->t->addr;
+	len = i_mm->t->real - pos;
+	if (rslen == 0) {
+	    end = pos + len;
 	}
-	ptr = RSTRING_PTR(str) + start + BEG(0);
-	if (RSTRING(val)->len != plen) {
-	    if (i_mm->t->flag & MM_FIXED) {
-		rb_raise(rb_eTypeError, "try to change the size of a fixed map");
-	    }
-	    memmove(ptr + RSTRING(val)->len,
-		    ptr + plen,
-		    RSTRING(str)->len - start - BEG(0) - plen);
+	else if (rslen == 1) {
+	    p = memchr(addr + pos, rsptr[0], len);
+	    end = p ? p - addr + 1 : pos + len;
 	}
-	memcpy(ptr, RSTRING(val)->ptr, RSTRING(val)->len);
-	RSTRING(str)->len += RSTRING(val)->len - plen;
-	i_mm->t->real = RSTRING(str)->len;
-	if (BEG(0) == END(0)) {
-	    offset = start + END(0) + mbclen2(RSTRING(str)->ptr[END(0)], pat);
-	    offset += RSTRING(val)->len - plen;
+	else {
+	    res = mm_memsearch(addr + pos, len, rsptr, rslen);
+	    end = res >= 0 ? pos + res + rslen : pos + len;
+	}
+	len = end - pos;
+	if (chomp && rslen && len >= rslen &&
+	    memcmp(addr + end - rslen, rsptr, rslen) == 0) {
+	    len -= rslen;
+	    if (newline && len && addr[pos + len - 1] == '\r') len--;
+	}
+	mm_readahead(i_mm, end);
+	if (offsets) {
+	    rb_yield_values(2, ULONG2NUM(pos), ULONG2NUM(len));
 	}
 	else {
-	    offset = start + END(0) + RSTRING(val)->len - plen;
+	    rb_yield(mm_substr(obj, i_mm, pos, len, shared));
 	}
-	if (offset > RSTRING(str)->len) break;
-	beg = rb_reg_search(pat, str, offset, 0);
+	GetMmap(obj, i_mm, 0);
+	pos = end;
     }
-    rb_backref_set(match);
-    if (tainted) OBJ_TAINT(obj);
-    rb_gc_force_recycle(str);
     return obj;
 }
 
 /*
- * call-seq:
- *    str.gsub!(pattern, replacement)        => str or nil
- *    str.gsub!(pattern) {|match| block }    => str or nil
- *
- * global substitution
+ * index of the lines : off[i] is the offset of the start of the line i,
+ * the bytes [0, end) were scanned. When a path is given the index is
+ * kept in a sidecar file, a mm_lhead followed by the offsets. The
+ * header records the device and the inode of the file, and a hash of
+ * the head and the tail of the scanned bytes, to reject quickly an
+ * index of another file. An index which pass is still checked against
+ * the whole scanned bytes, see mm_lindex_check
  */
-static VALUE
-mm_gsub_bang(int argc, VALUE *argv, VALUE obj)
+#define MM_LINDEX_MAGIC "MMLINDX2"
+#define MM_LINDEX_SAMPLE 4096
+
+typedef struct {
+    char magic[8];
+    uint64_t count, end, dev, ino, hash;
+} mm_lhead;
+
+struct mm_lindex {
+    size_t n, cap, end;
+    uint64_t *off;
+    char *map;
+    size_t maplen;
+    uint64_t dev, ino;
+    int fd;
+};
+
+typedef struct {
+    const char *base;
+    size_t beg, len, count;
+    uint64_t *out;
+} mm_lchunk;
+
+/*
+ * FNV-1a hash of the first and the last MM_LINDEX_SAMPLE bytes of
+ * [0, end)
+ */
+static uint64_t
+mm_lindex_hash(const char *base, size_t end)
 {
-    VALUE res;
-    mm_bang bang_st;
-    mm_ipc *i_mm;
+    uint64_t h = 14695981039346656037ULL;
+    size_t i, n;
 
-    bang_st.argc = argc;
-    bang_st.argv = argv;
-    bang_st.obj = obj;
-    GetMmap(obj, i_mm, MM_MODIFY);
-    if (i_mm->t->flag & MM_IPC) {
-	mm_lock(i_mm, Qtrue);
-	res = rb_ensure(mm_gsub_bang_int, (VALUE)&bang_st, mm_vunlock, obj);
+    n = end < MM_LINDEX_SAMPLE ? end : MM_LINDEX_SAMPLE;
+    for (i = 0; i < n; i++) {
+	h = (h ^ (unsigned char)base[i]) * 1099511628211ULL;
     }
-    else {
-	res = mm_gsub_bang_int(&bang_st);
+    for (i = end - n; i < end; i++) {
+	h = (h ^ (unsigned char)base[i]) * 1099511628211ULL;
     }
-    return res;
+    return h ^ end;
 }
 
-static VALUE mm_index __((int, VALUE *, VALUE));
-
+/*
+ * device and inode of the mapped file, 0 for an anonymous map
+ */
 static void
-mm_subpat_set(VALUE obj, VALUE re, int offset, VALUE val)
+mm_lindex_ident(mm_ipc *i_mm, uint64_t *dev, uint64_t *ino)
 {
-    VALUE str, match;
-    int start, end, len;
-    mm_ipc *i_mm;
-    
-    str = mm_str(obj, MM_MODIFY | MM_ORIGIN);
-    if (rb_reg_search(re, str, 0, 0) < 0) {
-	rb_raise(rb_eIndexError, "regexp not matched");
+    struct stat st;
+    int res = -1;
+
+    if (i_mm->t->fd >= 0) {
+	res = fstat(i_mm->t->fd, &st);
     }
-    match = rb_backref_get();
-    if (offset >= RMATCH(match)->regs->num_regs) {
-	rb_raise(rb_eIndexError, "index %d out of regexp", offset);
+    else if (i_mm->t->path && i_mm->t->path != (char *)-1) {
+	res = stat(i_mm->t->path, &st);
     }
+    *dev = res == -1 ? 0 : (uint64_t)st.st_dev;
+    *ino = res == -1 ? 0 : (uint64_t)st.st_ino;
+}
 
-    start = RMATCH(match)->BEG(offset);
-    if (start == -1) {
-	rb_raise(rb_eIndexError, "regexp group %d not matched", offset);
+static void
+mm_lindex_stamp(mm_ipc *i_mm)
+{
+    struct mm_lindex *ix = i_mm->lindex;
+    mm_lhead *head;
+
+    if (ix->map) {
+	head = (mm_lhead *)ix->map;
+	head->dev = ix->dev;
+	head->ino = ix->ino;
+	head->hash = mm_lindex_hash((char *)i_mm->t->addr, ix->end);
     }
-    end = RMATCH(match)->END(offset);
-    len = end - start;
-    GetMmap(obj, i_mm, MM_MODIFY);
-    mm_update(i_mm, start, len, val);
 }
 
-static VALUE
-mm_aset(VALUE str, VALUE indx, VALUE val)
+static void
+mm_lindex_sync(struct mm_lindex *ix)
 {
-    long idx;
-    mm_ipc *i_mm;
+    mm_lhead *head;
 
-    GetMmap(str, i_mm, MM_MODIFY);
-    switch (TYPE(indx)) {
-      case T_FIXNUM:
-      num_index:
-	idx = NUM2INT(indx);
-	if (idx < 0) {
-	    idx += i_mm->t->real;
+    if (ix->map) {
+	head = (mm_lhead *)ix->map;
+	head->count = ix->n;
+	head->end = ix->end;
+    }
+}
+
+/*
+ * make room for need offsets, return 0 or an errno. Called without
+ * the GVL
+ */
+static int
+mm_lindex_reserve(struct mm_lindex *ix, size_t need)
+{
+    size_t cap, maplen;
+    void *p;
+
+    if (need <= ix->cap) return 0;
+    cap = ix->cap ? ix->cap : 1024;
+    while (cap < need) cap *= 2;
+    if (ix->fd < 0) {
+	if ((p = realloc(ix->off, cap * sizeof(uint64_t))) == 0) {
+	    return ENOMEM;
 	}
-	if (idx < 0 || i_mm->t->real <= (size_t)idx) {
-	    rb_raise(rb_eIndexError, "index %d out of string", idx);
+	ix->off = (uint64_t *)p;
+    }
+    else {
+	maplen = sizeof(mm_lhead) + cap * sizeof(uint64_t);
+	if (ftruncate(ix->fd, maplen) == -1) {
+	    return errno;
 	}
-	if (FIXNUM_P(val)) {
-	    if (i_mm->t->real == (size_t)idx) {
-		i_mm->t->real += 1;
-		mm_realloc(i_mm, i_mm->t->real);
-	    }
-	    ((char *)i_mm->t->addr)[idx] = NUM2INT(val) & 0xff;
+	p = mmap(0, maplen, PROT_READ | PROT_WRITE, MAP_SHARED, ix->fd, 0);
+	if (p == MAP_FAILED) {
+	    return errno;
 	}
-	else {
-	    mm_update(i_mm, idx, 1, val);
+	if (ix->map) {
+	    munmap(ix->map, ix->maplen);
 	}
-	return val;
+	ix->map = (char *)p;
+	ix->maplen = maplen;
+	ix->off = (uint64_t *)(ix->map + sizeof(mm_lhead));
+    }
+    ix->cap = cap;
+    return 0;
+}
 
-      case T_REGEXP:
-	  mm_subpat_set(str, indx, 0, val);
-	return val;
+static void
+mm_lindex_free(mm_ipc *i_mm)
+{
+    struct mm_lindex *ix = i_mm->lindex;
 
-      case T_STRING:
-      {
-	  VALUE res;
+    if (!ix) return;
+    i_mm->lindex = 0;
+    if (ix->fd >= 0) {
+	if (ix->map) {
+	    munmap(ix->map, ix->maplen);
+	}
+	close(ix->fd);
+    }
+    else {
+	free(ix->off);
+    }
+    free(ix);
+}
 
-	  res = mm_index(1, &indx, str);
-	  if (!NIL_P(res)) {
-	      mm_update(i_mm, NUM2LONG(res), RSTRING(indx)->len, val);
-	  }
-	  return val;
-      }
+/*
+ * the bytes from beg were modified : forget the lines which start
+ * after beg
+ */
+static void
+mm_lindex_cut(struct mm_lindex *ix, size_t beg)
+{
+    size_t lo, hi, mid;
+
+    if (beg >= ix->end) return;
+    lo = 0;
+    hi = ix->n;
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (ix->off[mid] <= beg) lo = mid + 1;
+	else hi = mid;
+    }
+    ix->n = lo;
+    ix->end = ix->off[lo - 1];
+    mm_lindex_sync(ix);
+}
 
-      default:
-	/* check if indx is Range */
-	{
-	    long beg, len;
-	    if (rb_range_beg_len(indx, &beg, &len, i_mm->t->real, 2)) {
-		mm_update(i_mm, beg, len, val);
-		return val;
-	    }
+static void *
+mm_i_lindex_chunk(void *ptr)
+{
+    mm_lchunk *c = (mm_lchunk *)ptr;
+    const char *p = c->base + c->beg, *e = p + c->len;
+    uint64_t *out = c->out;
+
+    if (!out) {
+	c->count = mm_memcount(p, c->len, '\n');
+	return 0;
+    }
+    while (p < e && (p = memchr(p, '\n', e - p)) != 0) {
+	p++;
+	*out++ = p - c->base;
+    }
+    return 0;
+}
+
+static void
+mm_i_lindex_run(mm_lchunk *c, int n)
+{
+#if HAVE_PTHREAD_H
+    pthread_t thread[MM_COUNT_THREADS];
+    int started[MM_COUNT_THREADS];
+    int i;
+
+    for (i = 0; i < n; i++) {
+	started[i] = (i > 0 && pthread_create(&thread[i], 0, mm_i_lindex_chunk, &c[i]) == 0);
+    }
+    for (i = 0; i < n; i++) {
+	if (started[i]) {
+	    pthread_join(thread[i], 0);
+	}
+	else {
+	    mm_i_lindex_chunk(&c[i]);
 	}
-	idx = NUM2LONG(indx);
-	goto num_index;
     }
+#else
+    mm_i_lindex_chunk(c);
+#endif
 }
 
 /*
- * call-seq: []=(args)
- *
- * Element assignement - with the following syntax
- *
- *   self[nth] = val
- *
- * change the <em>nth</em> character with <em>val</em>
- *
- *   self[start..last] = val
- *
- * change substring from <em>start</em> to <em>last</em> with <em>val</em>
- *
- *   self[start, len] = val
- * 
- * replace <em>length</em> characters from <em>start</em> with <em>val</em>.
- * 
+ * extend the index up to the end of the file : the newlines are
+ * counted in each chunk, then each chunk write its offsets at its
+ * place in the index
  */
-static VALUE
-mm_aset_m(int argc, VALUE *argv, VALUE str)
+static void *
+mm_i_lindex(void *ptr)
 {
-    mm_ipc *i_mm;
+    mm_st *st_mm = (mm_st *)ptr;
+    struct mm_lindex *ix = st_mm->i_mm->lindex;
+    mm_lchunk c[MM_COUNT_THREADS];
+    size_t beg, len, chunk, total;
+    int i, n = 1;
+
+    beg = ix->end;
+    len = st_mm->i_mm->t->real - beg;
+#if HAVE_PTHREAD_H
+    {
+	long ncpu = 1;
 
-    GetMmap(str, i_mm, MM_MODIFY);
-    if (argc == 3) {
-	long beg, len;
+#ifdef _SC_NPROCESSORS_ONLN
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	n = len / MM_COUNT_CHUNK;
+	if (n > ncpu) n = ncpu;
+	if (n > MM_COUNT_THREADS) n = MM_COUNT_THREADS;
+	if (n < 1) n = 1;
+    }
+#endif
+    chunk = (len + n - 1) / n;
+    for (i = 0; i < n; i++) {
+	c[i].base = (char *)st_mm->i_mm->t->addr;
+	c[i].beg = beg + i * chunk;
+	c[i].len = (i == n - 1) ? len - i * chunk : chunk;
+	c[i].out = 0;
+    }
+    mm_i_lindex_run(c, n);
+    total = 0;
+    for (i = 0; i < n; i++) {
+	total += c[i].count;
+    }
+    st_mm->error = mm_lindex_reserve(ix, ix->n + total);
+    if (!st_mm->error) {
+	total = ix->n;
+	for (i = 0; i < n; i++) {
+	    c[i].out = ix->off + total;
+	    total += c[i].count;
+	}
+	mm_i_lindex_run(c, n);
+	ix->n = total;
+	ix->end = beg + len;
+	mm_lindex_sync(ix);
+    }
+    st_mm->done = 1;
+    return 0;
+}
 
-	if (TYPE(argv[0]) == T_REGEXP) {
-	    mm_subpat_set(str, argv[0], NUM2INT(argv[1]), argv[2]);
+/*
+ * bring the index up to date with the file, and return the number
+ * of lines
+ */
+static size_t
+mm_lindex_update(mm_ipc *i_mm)
+{
+    struct mm_lindex *ix = i_mm->lindex;
+    mm_st st_mm;
+
+    if (ix->end > i_mm->t->real) {
+	mm_lindex_cut(ix, 0);
+	mm_lindex_stamp(i_mm);
+    }
+    if (ix->end < i_mm->t->real) {
+	st_mm.i_mm = i_mm;
+	st_mm.error = 0;
+	st_mm.done = 0;
+	mm_rlock(i_mm);
+	if (i_mm->t->real - ix->end < MM_COUNT_CHUNK) {
+	    mm_i_lindex(&st_mm);
 	}
 	else {
-	    beg = NUM2INT(argv[0]);
-	    len = NUM2INT(argv[1]);
-	    mm_update(i_mm, beg, len, argv[2]);
+	    mm_nogvl(&st_mm, mm_i_lindex, 1);
+	}
+	mm_lindex_stamp(i_mm);
+	mm_runlock(i_mm);
+	if (st_mm.error) {
+	    errno = st_mm.error;
+	    rb_sys_fail("line index");
 	}
-	return argv[2];
-    }
-    if (argc != 2) {
-	rb_raise(rb_eArgError, "wrong # of arguments(%d for 2)", argc);
     }
-    return mm_aset(str, argv[0], argv[1]);
+    return ix->n - (ix->off[ix->n - 1] >= i_mm->t->real);
 }
 
 /*
- * call-seq: insert(index, str)
- *
- * insert <em>str</em> at <em>index</em>
+ * the offsets of a sidecar file must be exactly the starts of the
+ * lines in [0, end) : increasing, each one after a "\n", and as many
+ * as the "\n" of the bytes
  */
-static VALUE
-mm_insert(VALUE str, VALUE idx, VALUE str2)
+static int
+mm_lindex_check(mm_ipc *i_mm, uint64_t *off, size_t n, size_t end)
 {
-    mm_ipc *i_mm;
-    long pos = NUM2LONG(idx);
+    const char *base = (char *)i_mm->t->addr;
+    size_t i;
 
-    GetMmap(str, i_mm, MM_MODIFY);
-    if (pos == -1) {
-	pos = RSTRING(str)->len;
-    }
-    else if (pos < 0) {
-	pos++;
+    if (off[0] != 0) return 0;
+    for (i = 1; i < n; i++) {
+	if (off[i] <= off[i - 1] || off[i] > end || base[off[i] - 1] != '\n') {
+	    return 0;
+	}
     }
-    mm_update(i_mm, pos, 0, str2);
-    return str;
+    return mm_memcount(base, end, '\n') == n - 1;
 }
 
-static VALUE mm_aref_m(int, VALUE *, VALUE);
-
 /*
- * call-seq: slice!(str)
- *
- * delete the specified portion of the file
+ * reuse the sidecar file if it is an index of this file : same device
+ * and inode, same hash of the scanned bytes and offsets which match
+ * these bytes
  */
-static VALUE
-mm_slice_bang(int argc, VALUE *argv, VALUE str)
+static int
+mm_lindex_load(mm_ipc *i_mm, struct mm_lindex *ix)
 {
-    VALUE result;
-    VALUE buf[3];
-    int i;
+    struct stat st;
+    mm_lhead *head;
+    void *p;
 
-    if (argc < 1 || 2 < argc) {
-	rb_raise(rb_eArgError, "wrong # of arguments(%d for 1)", argc);
+    if (fstat(ix->fd, &st) == -1 ||
+	st.st_size < (off_t)(sizeof(mm_lhead) + sizeof(uint64_t))) {
+	return 0;
     }
-    for (i = 0; i < argc; i++) {
-	buf[i] = argv[i];
+    p = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, ix->fd, 0);
+    if (p == MAP_FAILED) {
+	return 0;
     }
-    buf[i] = rb_str_new(0,0);
-    result = mm_aref_m(argc, buf, str);
-    if (!NIL_P(result)) {
-	mm_aset_m(argc+1, buf, str);
+    head = (mm_lhead *)p;
+    ix->off = (uint64_t *)((char *)p + sizeof(mm_lhead));
+    if (memcmp(head->magic, MM_LINDEX_MAGIC, 8) != 0 || head->count < 1 ||
+	head->count > (st.st_size - sizeof(mm_lhead)) / sizeof(uint64_t) ||
+	head->end > i_mm->t->real ||
+	head->dev != ix->dev || head->ino != ix->ino ||
+	head->hash != mm_lindex_hash((char *)i_mm->t->addr, head->end) ||
+	!mm_lindex_check(i_mm, ix->off, head->count, head->end)) {
+	munmap(p, st.st_size);
+	ix->off = 0;
+	return 0;
     }
-    return result;
+    ix->map = (char *)p;
+    ix->maplen = st.st_size;
+    ix->cap = (st.st_size - sizeof(mm_lhead)) / sizeof(uint64_t);
+    ix->n = head->count;
+    ix->end = head->end;
+    return 1;
 }
 
+/*
+ * call-seq: build_line_index(path = nil)
+ *
+ * build an index of the lines ("\n"), used by #line and #lines, and
+ * return the number of lines. The index is built in parallel and
+ * extended when the file grows. 
+ *
+ * With <em>path</em> the index is stored in this file (mapped), and
+ * reused by the next call if the file was only extended. An index of
+ * another file, or of a file rewritten since, is rebuilt : the stored
+ * offsets are checked against all the indexed bytes (a scan for "\n",
+ * much faster than a build)
+ */
 static VALUE
-mm_cat(VALUE str, const char *ptr, long len)
+mm_build_line_index(int argc, VALUE *argv, VALUE obj)
 {
     mm_ipc *i_mm;
-    char *sptr;
-
-    GetMmap(str, i_mm, MM_MODIFY);
-    if (len > 0) {
-	int poffset = -1;
-	sptr = (char *)i_mm->t->addr;
+    struct mm_lindex *ix;
+    VALUE path;
+    int err;
 
-	if (sptr <= ptr &&
-	    ptr < sptr + i_mm->t->real) {
-	    poffset = ptr - sptr;
+    rb_scan_args(argc, argv, "01", &path);
+    GetMmap(obj, i_mm, 0);
+    if (!NIL_P(path)) {
+	SafeStringValue(path);
+    }
+    mm_lindex_free(i_mm);
+    ix = ALLOC(struct mm_lindex);
+    MEMZERO(ix, struct mm_lindex, 1);
+    ix->fd = -1;
+    mm_lindex_ident(i_mm, &ix->dev, &ix->ino);
+    if (!NIL_P(path)) {
+	if ((ix->fd = open(RSTRING(path)->ptr, O_RDWR | O_CREAT, 0644)) == -1) {
+	    free(ix);
+	    rb_sys_fail(RSTRING(path)->ptr);
 	}
-	mm_lock(i_mm, Qtrue);
-	mm_realloc(i_mm, i_mm->t->real + len);
-	sptr = (char *)i_mm->t->addr;
-	if (ptr) {
-	    if (poffset >= 0) ptr = sptr + poffset;
-	    memcpy(sptr + i_mm->t->real, ptr, len);
+	if (!mm_lindex_load(i_mm, ix) && ftruncate(ix->fd, 0) == -1) {
+	    err = errno;
+	    close(ix->fd);
+	    free(ix);
+	    errno = err;
+	    rb_sys_fail(RSTRING(path)->ptr);
 	}
-	i_mm->t->real += len;
-	mm_unlock(i_mm);
     }
-    return str;
+    if (!ix->n) {
+	if ((err = mm_lindex_reserve(ix, 1)) != 0) {
+	    i_mm->lindex = ix;
+	    mm_lindex_free(i_mm);
+	    errno = err;
+	    rb_sys_fail("line index");
+	}
+	if (ix->map) {
+	    memcpy(ix->map, MM_LINDEX_MAGIC, 8);
+	}
+	ix->off[0] = 0;
+	ix->n = 1;
+	ix->end = 0;
+	mm_lindex_sync(ix);
+    }
+    i_mm->lindex = ix;
+    mm_lindex_stamp(i_mm);
+    return ULONG2NUM(mm_lindex_update(i_mm));
 }
 
-static VALUE
-mm_append(VALUE str1, VALUE str2)
+static size_t
+mm_lindex(VALUE obj, mm_ipc **ret)
 {
-    str2 = rb_str_to_str(str2);
-    str1 = mm_cat(str1, StringValuePtr(str2), RSTRING(str2)->len);
-    return str1;
+    mm_ipc *i_mm;
+
+    GetMmap(obj, i_mm, 0);
+    if (!i_mm->lindex) {
+	mm_build_line_index(0, 0, obj);
+    }
+    *ret = i_mm;
+    return mm_lindex_update(i_mm);
 }
 
-/*
- * Document-method: concat
- * Document-method: <<
- *
- * call-seq: concat(other)
- *
- * append the contents of <em>other</em>
- */
 static VALUE
-mm_concat(VALUE str1, VALUE str2)
+mm_lindex_line(VALUE obj, mm_ipc *i_mm, size_t i)
 {
-    if (FIXNUM_P(str2)) {
-	int i = FIX2INT(str2);
-	if (0 <= i && i <= 0xff) { /* byte */
-	    char c = i;
-	    return mm_cat(str1, &c, 1);
-	}
+    struct mm_lindex *ix = i_mm->lindex;
+    size_t beg, end;
+
+    beg = ix->off[i];
+    end = (i + 1 < ix->n) ? ix->off[i + 1] : i_mm->t->real;
+    if (end < beg || end > i_mm->t->real) {
+	rb_raise(rb_eIndexError, "line index out of date (see #build_line_index)");
     }
-    str1 = mm_append(str1, str2);
-    return str1;
+    return mm_substr(obj, i_mm, beg, end - beg, 0);
 }
 
 /*
- * call-seq: lstrip!
+ * call-seq: line(n)
  *
- * removes leading whitespace
+ * return the line <em>n</em> (with its "\n"), or nil. The index is
+ * built by the first call if #build_line_index was not called
  */
 static VALUE
-mm_lstrip_bang(VALUE str)
+mm_line(VALUE obj, VALUE vn)
 {
-    char *s, *t, *e;
     mm_ipc *i_mm;
+    size_t count;
+    long n;
 
-    GetMmap(str, i_mm, MM_MODIFY);
-    mm_lock(i_mm, Qtrue);
-    s = (char *)i_mm->t->addr;
-    e = t = s + i_mm->t->real;
-    while (s < t && ISSPACE(*s)) s++;
-
-    if (i_mm->t->real != (size_t)(t - s) && (i_mm->t->flag & MM_FIXED)) {
-	mm_unlock(i_mm);
-	rb_raise(rb_eTypeError, "try to change the size of a fixed map");
+    n = NUM2LONG(vn);
+    count = mm_lindex(obj, &i_mm);
+    if (n < 0) {
+	n += count;
     }
-    i_mm->t->real = t - s;
-    if (s > (char *)i_mm->t->addr) { 
-	memmove(i_mm->t->addr, s, i_mm->t->real);
-	((char *)i_mm->t->addr)[i_mm->t->real] = '\0';
-	mm_unlock(i_mm);
-	return str;
+    if (n < 0 || (size_t)n >= count) {
+	return Qnil;
     }
-    mm_unlock(i_mm);
-    return Qnil;
+    return mm_lindex_line(obj, i_mm, n);
 }
 
 /*
- * call-seq: rstrip!
+ * call-seq:
+ *   lines(range)
+ *   lines(start, length)
  *
- * removes trailing whitespace
+ * return an Array with the lines in the range, or nil
  */
 static VALUE
-mm_rstrip_bang(VALUE str)
+mm_lines(int argc, VALUE *argv, VALUE obj)
 {
-    char *s, *t, *e;
     mm_ipc *i_mm;
+    VALUE a, b, res;
+    size_t count;
+    long beg, len, i;
+
+    rb_scan_args(argc, argv, "11", &a, &b);
+    count = mm_lindex(obj, &i_mm);
+    if (NIL_P(b)) {
+	switch (rb_range_beg_len(a, &beg, &len, count, 0)) {
+	case Qfalse:
+	    rb_raise(rb_eTypeError, "expected a Range");
+	case Qnil:
+	    return Qnil;
+	}
+    }
+    else {
+	beg = NUM2LONG(a);
+	len = NUM2LONG(b);
+	if (beg < 0) {
+	    beg += count;
+	}
+	if (beg < 0 || (size_t)beg > count || len < 0) {
+	    return Qnil;
+	}
+	if ((size_t)(beg + len) > count) {
+	    len = count - beg;
+	}
+    }
+    res = rb_ary_new2(len);
+    for (i = 0; i < len; i++) {
+	rb_ary_push(res, mm_lindex_line(obj, i_mm, beg + i));
+    }
+    return res;
+}
 
-    GetMmap(str, i_mm, MM_MODIFY);
-    mm_lock(i_mm, Qtrue);
-    s = (char *)i_mm->t->addr;
-    e = t = s + i_mm->t->real;
-    t--;
-    while (s <= t && ISSPACE(*t)) t--;
-    t++;
-    if (i_mm->t->real != (size_t)(t - s) && (i_mm->t->flag & MM_FIXED)) {
-	mm_unlock(i_mm);
-	rb_raise(rb_eTypeError, "try to change the size of a fixed map");
+/*
+ * typed array over the map : Mmap::ArrayView
+ */
+#define MM_AV_INT 0
+#define MM_AV_UINT 1
+#define MM_AV_FLOAT 2
+
+#define MM_AV_SUM 0
+#define MM_AV_MINMAX 1
+#define MM_AV_COUNT 2
+#define MM_AV_HIST 3
+
+#define MM_AV_LT 0
+#define MM_AV_LE 1
+#define MM_AV_GT 2
+#define MM_AV_GE 3
+#define MM_AV_EQ 4
+#define MM_AV_NE 5
+
+typedef struct {
+    const char *ptr;
+    size_t n;
+    int type, op, cmp, nbins;
+    double lo, hi;
+    int64_t ival;
+    uint64_t uval;
+    size_t *bins;
+    int64_t isum, imin, imax;
+    uint64_t usum, umin, umax;
+    double dsum, dmin, dmax;
+    size_t count;
+} mm_avst;
+
+/*
+ * SIMD kernels for float64, float32 and int32 : they process the
+ * first elements (a multiple of the vector width) for the sums,
+ * minimum/maximum and counts, add their result to st and return the
+ * number of elements done. The float32 sums and comparisons are done
+ * in double, like the generic kernel
+ */
+#define MM_AV_NOSIMD(st) 0
+#define MM_BITS4(m) ("\0\1\1\2\1\2\2\3\1\2\2\3\2\3\3\4"[(m) & 15])
+
+#ifdef MM_AVX2
+#define MM_AV_CMP_AVX2(pred, load)					\
+    for (i = 0; i < n; i += 4) {					\
+	c += __builtin_popcount(_mm256_movemask_pd(_mm256_cmp_pd(load, v, pred))); \
     }
-    i_mm->t->real = t - s;
-    if (t < e) {
-	((char *)i_mm->t->addr)[i_mm->t->real] = '\0';
-	mm_unlock(i_mm);
-	return str;
+
+__attribute__((target("avx2")))
+static size_t
+mm_av_float64_avx2(mm_avst *st)
+{
+    const double *p = (const double *)st->ptr;
+    size_t i, n = st->n & ~(size_t)3, c = 0;
+    double t[4], u[4];
+    int k;
+
+    if (!n) return 0;
+    switch (st->op) {
+      case MM_AV_SUM: {
+	__m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+
+	for (i = 0; i + 8 <= n; i += 8) {
+	    s0 = _mm256_add_pd(s0, _mm256_loadu_pd(p + i));
+	    s1 = _mm256_add_pd(s1, _mm256_loadu_pd(p + i + 4));
+	}
+	if (i < n) s0 = _mm256_add_pd(s0, _mm256_loadu_pd(p + i));
+	_mm256_storeu_pd(t, _mm256_add_pd(s0, s1));
+	st->dsum += t[0] + t[1] + t[2] + t[3];
+	break;
+      }
+      case MM_AV_MINMAX: {
+	__m256d mn = _mm256_set1_pd(p[0]), mx = mn, x;
+
+	for (i = 0; i < n; i += 4) {
+	    x = _mm256_loadu_pd(p + i);
+	    mn = _mm256_min_pd(x, mn);
+	    mx = _mm256_max_pd(x, mx);
+	}
+	_mm256_storeu_pd(t, mn);
+	_mm256_storeu_pd(u, mx);
+	st->dmin = t[0];
+	st->dmax = u[0];
+	for (k = 1; k < 4; k++) {
+	    if (t[k] < st->dmin) st->dmin = t[k];
+	    if (u[k] > st->dmax) st->dmax = u[k];
+	}
+	break;
+      }
+      case MM_AV_COUNT: {
+	__m256d v = _mm256_set1_pd(st->lo);
+
+	switch (st->cmp) {
+	  case MM_AV_LT: MM_AV_CMP_AVX2(_CMP_LT_OQ, _mm256_loadu_pd(p + i)); break;
+	  case MM_AV_LE: MM_AV_CMP_AVX2(_CMP_LE_OQ, _mm256_loadu_pd(p + i)); break;
+	  case MM_AV_GT: MM_AV_CMP_AVX2(_CMP_GT_OQ, _mm256_loadu_pd(p + i)); break;
+	  case MM_AV_GE: MM_AV_CMP_AVX2(_CMP_GE_OQ, _mm256_loadu_pd(p + i)); break;
+	  case MM_AV_EQ: MM_AV_CMP_AVX2(_CMP_EQ_OQ, _mm256_loadu_pd(p + i)); break;
+	  default: MM_AV_CMP_AVX2(_CMP_NEQ_UQ, _mm256_loadu_pd(p + i)); break;
+	}
+	st->count += c;
+	break;
+      }
+      default:
+	return 0;
     }
-    mm_unlock(i_mm);
-    return Qnil;
+    return n;
 }
 
-static VALUE
-mm_strip_bang(VALUE str)
+__attribute__((target("avx2")))
+static size_t
+mm_av_float32_avx2(mm_avst *st)
 {
-    VALUE l = mm_lstrip_bang(str);
-    VALUE r = mm_rstrip_bang(str);
+    const float *p = (const float *)st->ptr;
+    size_t i, n = st->n & ~(size_t)7, c = 0;
+    float t[8], u[8];
+    double d[4];
+    int k;
+
+    if (!n) return 0;
+    switch (st->op) {
+      case MM_AV_SUM: {
+	__m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+
+	for (i = 0; i < n; i += 8) {
+	    s0 = _mm256_add_pd(s0, _mm256_cvtps_pd(_mm_loadu_ps(p + i)));
+	    s1 = _mm256_add_pd(s1, _mm256_cvtps_pd(_mm_loadu_ps(p + i + 4)));
+	}
+	_mm256_storeu_pd(d, _mm256_add_pd(s0, s1));
+	st->dsum += d[0] + d[1] + d[2] + d[3];
+	break;
+      }
+      case MM_AV_MINMAX: {
+	__m256 mn = _mm256_set1_ps(p[0]), mx = mn, x;
 
-    if (NIL_P(l) && NIL_P(r)) return Qnil;
-    return str;
+	for (i = 0; i < n; i += 8) {
+	    x = _mm256_loadu_ps(p + i);
+	    mn = _mm256_min_ps(x, mn);
+	    mx = _mm256_max_ps(x, mx);
+	}
+	_mm256_storeu_ps(t, mn);
+	_mm256_storeu_ps(u, mx);
+	st->dmin = t[0];
+	st->dmax = u[0];
+	for (k = 1; k < 8; k++) {
+	    if (t[k] < st->dmin) st->dmin = t[k];
+	    if (u[k] > st->dmax) st->dmax = u[k];
+	}
+	break;
+      }
+      case MM_AV_COUNT: {
+	__m256d v = _mm256_set1_pd(st->lo);
+
+	switch (st->cmp) {
+	  case MM_AV_LT: MM_AV_CMP_AVX2(_CMP_LT_OQ, _mm256_cvtps_pd(_mm_loadu_ps(p + i))); break;
+	  case MM_AV_LE: MM_AV_CMP_AVX2(_CMP_LE_OQ, _mm256_cvtps_pd(_mm_loadu_ps(p + i))); break;
+	  case MM_AV_GT: MM_AV_CMP_AVX2(_CMP_GT_OQ, _mm256_cvtps_pd(_mm_loadu_ps(p + i))); break;
+	  case MM_AV_GE: MM_AV_CMP_AVX2(_CMP_GE_OQ, _mm256_cvtps_pd(_mm_loadu_ps(p + i))); break;
+	  case MM_AV_EQ: MM_AV_CMP_AVX2(_CMP_EQ_OQ, _mm256_cvtps_pd(_mm_loadu_ps(p + i))); break;
+	  default: MM_AV_CMP_AVX2(_CMP_NEQ_UQ, _mm256_cvtps_pd(_mm_loadu_ps(p + i))); break;
+	}
+	st->count += c;
+	break;
+      }
+      default:
+	return 0;
+    }
+    return n;
 }
 
-#define MmapStr(b, recycle)						    \
-do {									    \
-    recycle = 0;							    \
-    if (TYPE(b) == T_DATA &&  RDATA(b)->dfree == (RUBY_DATA_FUNC)mm_free) { \
-	recycle = 1;							    \
-	b = mm_str(b, MM_ORIGIN);					    \
-    }									    \
-    else {								    \
-	b = rb_str_to_str(b);						    \
-    }									    \
-} while (0);
- 
- 
-/*
- * call-seq: <=>(other)
- *
- * comparison : return -1, 0, 1
- */
-static VALUE
-mm_cmp(VALUE a, VALUE b)
+__attribute__((target("avx2")))
+static size_t
+mm_av_int32_avx2(mm_avst *st)
 {
-    int result;
-    int recycle = 0;
+    const int32_t *p = (const int32_t *)st->ptr;
+    size_t i, n = st->n & ~(size_t)7, c = 0;
+    int32_t t[8], u[8];
+    int64_t q[4];
+    int k;
+
+    if (!n) return 0;
+    switch (st->op) {
+      case MM_AV_SUM: {
+	__m256i s = _mm256_setzero_si256(), x;
+
+	for (i = 0; i < n; i += 8) {
+	    x = _mm256_loadu_si256((const __m256i *)(p + i));
+	    s = _mm256_add_epi64(s, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(x)));
+	    s = _mm256_add_epi64(s, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(x, 1)));
+	}
+	_mm256_storeu_si256((__m256i *)q, s);
+	st->isum += q[0] + q[1] + q[2] + q[3];
+	break;
+      }
+      case MM_AV_MINMAX: {
+	__m256i mn = _mm256_set1_epi32(p[0]), mx = mn, x;
 
-    a = mm_str(a, MM_ORIGIN);
-    MmapStr(b, recycle);
-    result = rb_str_cmp(a, b);
-    rb_gc_force_recycle(a);
-    if (recycle) rb_gc_force_recycle(b);
-    return INT2FIX(result);
+	for (i = 0; i < n; i += 8) {
+	    x = _mm256_loadu_si256((const __m256i *)(p + i));
+	    mn = _mm256_min_epi32(x, mn);
+	    mx = _mm256_max_epi32(x, mx);
+	}
+	_mm256_storeu_si256((__m256i *)t, mn);
+	_mm256_storeu_si256((__m256i *)u, mx);
+	st->imin = t[0];
+	st->imax = u[0];
+	for (k = 1; k < 8; k++) {
+	    if (t[k] < st->imin) st->imin = t[k];
+	    if (u[k] > st->imax) st->imax = u[k];
+	}
+	break;
+      }
+      case MM_AV_COUNT: {
+	__m256i v = _mm256_set1_epi32((int32_t)st->ival), x, m;
+	int neg = (st->cmp == MM_AV_LE || st->cmp == MM_AV_GE || st->cmp == MM_AV_NE);
+
+	for (i = 0; i < n; i += 8) {
+	    x = _mm256_loadu_si256((const __m256i *)(p + i));
+	    switch (st->cmp) {
+	      case MM_AV_LT: case MM_AV_GE: m = _mm256_cmpgt_epi32(v, x); break;
+	      case MM_AV_LE: case MM_AV_GT: m = _mm256_cmpgt_epi32(x, v); break;
+	      default: m = _mm256_cmpeq_epi32(x, v); break;
+	    }
+	    k = __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(m)));
+	    c += neg ? 8 - k : k;
+	}
+	st->count += c;
+	break;
+      }
+      default:
+	return 0;
+    }
+    return n;
 }
+#endif
 
-/*
- * call-seq: casecmp(other)
- *
- * only with ruby >= 1.7.1
- */
-static VALUE
-mm_casecmp(VALUE a, VALUE b)
+#ifdef __SSE2__
+#define MM_AV_CMP_SSE2(cmp, load)					\
+    for (i = 0; i < n; i += 2) {					\
+	c += MM_BITS4(_mm_movemask_pd(cmp(load, v)));			\
+    }
+
+static size_t
+mm_av_float64_sse2(mm_avst *st)
 {
-    VALUE result;
-    int recycle = 0;
+    const double *p = (const double *)st->ptr;
+    size_t i, n = st->n & ~(size_t)1, c = 0;
+    double t[2], u[2];
+
+    if (!n) return 0;
+    switch (st->op) {
+      case MM_AV_SUM: {
+	__m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+
+	for (i = 0; i + 4 <= n; i += 4) {
+	    s0 = _mm_add_pd(s0, _mm_loadu_pd(p + i));
+	    s1 = _mm_add_pd(s1, _mm_loadu_pd(p + i + 2));
+	}
+	if (i < n) s0 = _mm_add_pd(s0, _mm_loadu_pd(p + i));
+	_mm_storeu_pd(t, _mm_add_pd(s0, s1));
+	st->dsum += t[0] + t[1];
+	break;
+      }
+      case MM_AV_MINMAX: {
+	__m128d mn = _mm_set1_pd(p[0]), mx = mn, x;
 
-    a = mm_str(a, MM_ORIGIN);
-    MmapStr(b, recycle);
-    result = rb_funcall2(a, rb_intern("casecmp"), 1, &b);
-    rb_gc_force_recycle(a);
-    if (recycle) rb_gc_force_recycle(b);
-    return result;
+	for (i = 0; i < n; i += 2) {
+	    x = _mm_loadu_pd(p + i);
+	    mn = _mm_min_pd(x, mn);
+	    mx = _mm_max_pd(x, mx);
+	}
+	_mm_storeu_pd(t, mn);
+	_mm_storeu_pd(u, mx);
+	st->dmin = (t[1] < t[0]) ? t[1] : t[0];
+	st->dmax = (u[1] > u[0]) ? u[1] : u[0];
+	break;
+      }
+      case MM_AV_COUNT: {
+	__m128d v = _mm_set1_pd(st->lo);
+
+	switch (st->cmp) {
+	  case MM_AV_LT: MM_AV_CMP_SSE2(_mm_cmplt_pd, _mm_loadu_pd(p + i)); break;
+	  case MM_AV_LE: MM_AV_CMP_SSE2(_mm_cmple_pd, _mm_loadu_pd(p + i)); break;
+	  case MM_AV_GT: MM_AV_CMP_SSE2(_mm_cmpgt_pd, _mm_loadu_pd(p + i)); break;
+	  case MM_AV_GE: MM_AV_CMP_SSE2(_mm_cmpge_pd, _mm_loadu_pd(p + i)); break;
+	  case MM_AV_EQ: MM_AV_CMP_SSE2(_mm_cmpeq_pd, _mm_loadu_pd(p + i)); break;
+	  default: MM_AV_CMP_SSE2(_mm_cmpneq_pd, _mm_loadu_pd(p + i)); break;
+	}
+	st->count += c;
+	break;
+      }
+      default:
+	return 0;
+    }
+    return n;
 }
 
-/*
- * Document-method: ==
- * Document-method: ===
- *
- * call-seq: ==
- *
- * comparison
- */
-static VALUE
-mm_equal(VALUE a, VALUE b)
+static size_t
+mm_av_float32_sse2(mm_avst *st)
 {
-    VALUE result;
-    mm_ipc *i_mm, *u_mm;
-
-    if (a == b) return Qtrue;
-    if (TYPE(b) != T_DATA || RDATA(b)->dfree != (RUBY_DATA_FUNC)mm_free)
-	return Qfalse;
+    const float *p = (const float *)st->ptr;
+    size_t i, n = st->n & ~(size_t)3, c = 0;
+    float t[4], u[4];
+    double d[2];
+    int k;
+
+    if (!n) return 0;
+    switch (st->op) {
+      case MM_AV_SUM: {
+	__m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+	__m128 x;
+
+	for (i = 0; i < n; i += 4) {
+	    x = _mm_loadu_ps(p + i);
+	    s0 = _mm_add_pd(s0, _mm_cvtps_pd(x));
+	    s1 = _mm_add_pd(s1, _mm_cvtps_pd(_mm_movehl_ps(x, x)));
+	}
+	_mm_storeu_pd(d, _mm_add_pd(s0, s1));
+	st->dsum += d[0] + d[1];
+	break;
+      }
+      case MM_AV_MINMAX: {
+	__m128 mn = _mm_set1_ps(p[0]), mx = mn, x;
 
-    GetMmap(a, i_mm, 0);
-    GetMmap(b, u_mm, 0);
-    if (i_mm->t->real != u_mm->t->real)
-        return Qfalse;
-    a = mm_str(a, MM_ORIGIN);
-    b = mm_str(b, MM_ORIGIN);
-    result = rb_funcall2(a, rb_intern("=="), 1, &b);
-    rb_gc_force_recycle(a);
-    rb_gc_force_recycle(b);
-    return result;
+	for (i = 0; i < n; i += 4) {
+	    x = _mm_loadu_ps(p + i);
+	    mn = _mm_min_ps(x, mn);
+	    mx = _mm_max_ps(x, mx);
+	}
+	_mm_storeu_ps(t, mn);
+	_mm_storeu_ps(u, mx);
+	st->dmin = t[0];
+	st->dmax = u[0];
+	for (k = 1; k < 4; k++) {
+	    if (t[k] < st->dmin) st->dmin = t[k];
+	    if (u[k] > st->dmax) st->dmax = u[k];
+	}
+	break;
+      }
+      case MM_AV_COUNT: {
+	__m128d v = _mm_set1_pd(st->lo);
+
+	n &= ~(size_t)1;
+	switch (st->cmp) {
+	  case MM_AV_LT: MM_AV_CMP_SSE2(_mm_cmplt_pd, _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64((const __m128i *)(p + i))))); break;
+	  case MM_AV_LE: MM_AV_CMP_SSE2(_mm_cmple_pd, _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64((const __m128i *)(p + i))))); break;
+	  case MM_AV_GT: MM_AV_CMP_SSE2(_mm_cmpgt_pd, _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64((const __m128i *)(p + i))))); break;
+	  case MM_AV_GE: MM_AV_CMP_SSE2(_mm_cmpge_pd, _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64((const __m128i *)(p + i))))); break;
+	  case MM_AV_EQ: MM_AV_CMP_SSE2(_mm_cmpeq_pd, _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64((const __m128i *)(p + i))))); break;
+	  default: MM_AV_CMP_SSE2(_mm_cmpneq_pd, _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64((const __m128i *)(p + i))))); break;
+	}
+	st->count += c;
+	break;
+      }
+      default:
+	return 0;
+    }
+    return n;
 }
 
-/*
- * call-seq: eql?(other)
- *
- * Is this eql? to +other+ ?
- */
-static VALUE
-mm_eql(VALUE a, VALUE b)
+static size_t
+mm_av_int32_sse2(mm_avst *st)
 {
-    VALUE result;
-    mm_ipc *i_mm, *u_mm;
-    
-    if (a == b) return Qtrue;
-    if (TYPE(b) != T_DATA || RDATA(b)->dfree != (RUBY_DATA_FUNC)mm_free)
-	return Qfalse;
+    const int32_t *p = (const int32_t *)st->ptr;
+    size_t i, n = st->n & ~(size_t)3, c = 0;
+    int32_t t[4], u[4];
+    int64_t q[2];
+    int k;
+
+    if (!n) return 0;
+    switch (st->op) {
+      case MM_AV_SUM: {
+	__m128i s = _mm_setzero_si128(), x, sign;
+
+	for (i = 0; i < n; i += 4) {
+	    x = _mm_loadu_si128((const __m128i *)(p + i));
+	    sign = _mm_srai_epi32(x, 31);
+	    s = _mm_add_epi64(s, _mm_unpacklo_epi32(x, sign));
+	    s = _mm_add_epi64(s, _mm_unpackhi_epi32(x, sign));
+	}
+	_mm_storeu_si128((__m128i *)q, s);
+	st->isum += q[0] + q[1];
+	break;
+      }
+      case MM_AV_MINMAX: {
+	__m128i mn = _mm_set1_epi32(p[0]), mx = mn, x, m;
+
+	for (i = 0; i < n; i += 4) {
+	    x = _mm_loadu_si128((const __m128i *)(p + i));
+	    m = _mm_cmpgt_epi32(mn, x);
+	    mn = _mm_or_si128(_mm_and_si128(m, x), _mm_andnot_si128(m, mn));
+	    m = _mm_cmpgt_epi32(x, mx);
+	    mx = _mm_or_si128(_mm_and_si128(m, x), _mm_andnot_si128(m, mx));
+	}
+	_mm_storeu_si128((__m128i *)t, mn);
+	_mm_storeu_si128((__m128i *)u, mx);
+	st->imin = t[0];
+	st->imax = u[0];
+	for (k = 1; k < 4; k++) {
+	    if (t[k] < st->imin) st->imin = t[k];
+	    if (u[k] > st->imax) st->imax = u[k];
+	}
+	break;
+      }
+      case MM_AV_COUNT: {
+	__m128i v = _mm_set1_epi32((int32_t)st->ival), x, m;
+	int neg = (st->cmp == MM_AV_LE || st->cmp == MM_AV_GE || st->cmp == MM_AV_NE);
+
+	for (i = 0; i < n; i += 4) {
+	    x = _mm_loadu_si128((const __m128i *)(p + i));
+	    switch (st->cmp) {
+	      case MM_AV_LT: case MM_AV_GE: m = _mm_cmpgt_epi32(v, x); break;
+	      case MM_AV_LE: case MM_AV_GT: m = _mm_cmpgt_epi32(x, v); break;
+	      default: m = _mm_cmpeq_epi32(x, v); break;
+	    }
+	    k = MM_BITS4(_mm_movemask_ps(_mm_castsi128_ps(m)));
+	    c += neg ? 4 - k : k;
+	}
+	st->count += c;
+	break;
+      }
+      default:
+	return 0;
+    }
+    return n;
+}
+#endif
 
-    GetMmap(a, i_mm, 0);
-    GetMmap(b, u_mm, 0);
-    if (i_mm->t->real != u_mm->t->real)
-        return Qfalse;
-    a = mm_str(a, MM_ORIGIN);
-    b = mm_str(b, MM_ORIGIN);
-    result = rb_funcall2(a, rb_intern("eql?"), 1, &b);
-    rb_gc_force_recycle(a);
-    rb_gc_force_recycle(b);
-    return result;
+#define MM_AV_SIMD(name)						\
+static size_t								\
+mm_av_simd_##name(mm_avst *st)						\
+{									\
+    MM_AV_SIMD_AVX2(name)						\
+    MM_AV_SIMD_SSE2(name)						\
+    return 0;								\
 }
 
+#ifdef MM_AVX2
+#define MM_AV_SIMD_AVX2(name)						\
+    if (__builtin_cpu_supports("avx2")) return mm_av_##name##_avx2(st);
+#else
+#define MM_AV_SIMD_AVX2(name)
+#endif
+#ifdef __SSE2__
+#define MM_AV_SIMD_SSE2(name) return mm_av_##name##_sse2(st);
+#else
+#define MM_AV_SIMD_SSE2(name)
+#endif
+
+MM_AV_SIMD(float64)
+MM_AV_SIMD(float32)
+MM_AV_SIMD(int32)
+
 /*
- * call-seq: hash
- *
- * Get the hash value
+ * the generic loops start where the SIMD kernel stopped, and are
+ * written so that the compiler vectorize them : several accumulators
+ * for the sums, branchless comparisons for the counts. The counts
+ * compare in ctype with the threshold thr (converted to the type for
+ * the integers)
  */
-static VALUE
-mm_hash(VALUE a)
-{
-    VALUE b;
-    int res;
+#define MM_AV_KERNEL(name, type, acc, sum, min, max, ctype, thr, simd)	\
+static void								\
+mm_av_##name(mm_avst *st)						\
+{									\
+    const type *p = (const type *)st->ptr;				\
+    size_t i, i0, n = st->n, c = 0;					\
+									\
+    i0 = (st->op == MM_AV_HIST) ? 0 : simd(st);				\
+    switch (st->op) {							\
+      case MM_AV_SUM: {							\
+	acc s0 = 0, s1 = 0, s2 = 0, s3 = 0;				\
+									\
+	for (i = i0; i + 4 <= n; i += 4) {				\
+	    s0 += p[i];							\
+	    s1 += p[i + 1];						\
+	    s2 += p[i + 2];						\
+	    s3 += p[i + 3];						\
+	}								\
+	for (; i < n; i++) s0 += p[i];					\
+	st->sum += s0 + s1 + s2 + s3;					\
+	break;								\
+      }									\
+      case MM_AV_MINMAX: {						\
+	type mn, mx;							\
+									\
+	if (!n) break;							\
+	if (i0) {							\
+	    mn = (type)st->min;						\
+	    mx = (type)st->max;						\
+	}								\
+	else {								\
+	    mn = mx = p[0];						\
+	}								\
+	for (i = i0; i < n; i++) {					\
+	    mn = (p[i] < mn) ? p[i] : mn;				\
+	    mx = (p[i] > mx) ? p[i] : mx;				\
+	}								\
+	st->min = mn;							\
+	st->max = mx;							\
+	break;								\
+      }									\
+      case MM_AV_COUNT: {						\
+	ctype v = (ctype)st->thr;					\
+									\
+	switch (st->cmp) {						\
+	  case MM_AV_LT: for (i = i0; i < n; i++) c += (p[i] < v); break; \
+	  case MM_AV_LE: for (i = i0; i < n; i++) c += (p[i] <= v); break; \
+	  case MM_AV_GT: for (i = i0; i < n; i++) c += (p[i] > v); break; \
+	  case MM_AV_GE: for (i = i0; i < n; i++) c += (p[i] >= v); break; \
+	  case MM_AV_EQ: for (i = i0; i < n; i++) c += (p[i] == v); break; \
+	  default: for (i = i0; i < n; i++) c += (p[i] != v); break;	\
+	}								\
+	st->count += c;							\
+	break;								\
+      }									\
+      case MM_AV_HIST: {						\
+	double scale = st->nbins / (st->hi - st->lo), x;		\
+	int k;								\
+									\
+	for (i = 0; i < n; i++) {					\
+	    x = p[i];							\
+	    if (x >= st->lo && x <= st->hi) {				\
+		k = (int)((x - st->lo) * scale);			\
+		if (k >= st->nbins) k = st->nbins - 1;			\
+		st->bins[k]++;						\
+	    }								\
+	}								\
+	break;								\
+      }									\
+    }									\
+}
 
-    b = mm_str(a, MM_ORIGIN);
-    res = rb_str_hash(b);
-    rb_gc_force_recycle(b);
-    return INT2FIX(res);
+MM_AV_KERNEL(int8, int8_t, int64_t, isum, imin, imax, int8_t, ival, MM_AV_NOSIMD)
+MM_AV_KERNEL(uint8, uint8_t, uint64_t, usum, umin, umax, uint8_t, uval, MM_AV_NOSIMD)
+MM_AV_KERNEL(int16, int16_t, int64_t, isum, imin, imax, int16_t, ival, MM_AV_NOSIMD)
+MM_AV_KERNEL(uint16, uint16_t, uint64_t, usum, umin, umax, uint16_t, uval, MM_AV_NOSIMD)
+MM_AV_KERNEL(int32, int32_t, int64_t, isum, imin, imax, int32_t, ival, mm_av_simd_int32)
+MM_AV_KERNEL(uint32, uint32_t, uint64_t, usum, umin, umax, uint32_t, uval, MM_AV_NOSIMD)
+MM_AV_KERNEL(int64, int64_t, int64_t, isum, imin, imax, int64_t, ival, MM_AV_NOSIMD)
+MM_AV_KERNEL(uint64, uint64_t, uint64_t, usum, umin, umax, uint64_t, uval, MM_AV_NOSIMD)
+MM_AV_KERNEL(float32, float, double, dsum, dmin, dmax, double, lo, mm_av_simd_float32)
+MM_AV_KERNEL(float64, double, double, dsum, dmin, dmax, double, lo, mm_av_simd_float64)
+
+static struct {
+    const char *name;
+    int size, kind;
+    void (*kernel) __((mm_avst *));
+    VALUE (*load) __((const char *, int));
+    void (*store) __((char *, VALUE, int));
+} mm_av_types[] = {
+    {"int8", 1, MM_AV_INT, mm_av_int8, mm_load_i8, mm_store_i8},
+    {"uint8", 1, MM_AV_UINT, mm_av_uint8, mm_load_u8, mm_store_u8},
+    {"int16", 2, MM_AV_INT, mm_av_int16, mm_load_i16, mm_store_i16},
+    {"uint16", 2, MM_AV_UINT, mm_av_uint16, mm_load_u16, mm_store_u16},
+    {"int32", 4, MM_AV_INT, mm_av_int32, mm_load_i32, mm_store_i32},
+    {"uint32", 4, MM_AV_UINT, mm_av_uint32, mm_load_u32, mm_store_u32},
+    {"int64", 8, MM_AV_INT, mm_av_int64, mm_load_i64, mm_store_i64},
+    {"uint64", 8, MM_AV_UINT, mm_av_uint64, mm_load_u64, mm_store_u64},
+    {"float32", 4, MM_AV_FLOAT, mm_av_float32, mm_load_f32, mm_store_f32},
+    {"float64", 8, MM_AV_FLOAT, mm_av_float64, mm_load_f64, mm_store_f64},
+    {0, 0, 0, 0, 0, 0}
+};
+
+typedef struct {
+    VALUE obj;
+    size_t offset, count;
+    int type;
+} mm_aview;
+
+static void
+mm_aview_mark(mm_aview *av)
+{
+    rb_gc_mark(av->obj);
 }
 
 /*
- * Document-method: length
- * Document-method: size
- *
- * return the size of the file
+ * check that the view is still in the map, and return its address
  */
-static VALUE
-mm_size(VALUE a)
+static char *
+mm_aview_ptr(VALUE obj, mm_aview **avp, mm_ipc **ret, int modify)
 {
+    mm_aview *av;
     mm_ipc *i_mm;
 
-    GetMmap(a, i_mm, 0);
-    return UINT2NUM(i_mm->t->real);
+    Data_Get_Struct(obj, mm_aview, av);
+    GetMmap(av->obj, i_mm, modify);
+    if (i_mm->t->real < av->offset ||
+	(i_mm->t->real - av->offset) / mm_av_types[av->type].size < av->count) {
+	rb_raise(rb_eIndexError, "array view out of mmap");
+    }
+    *avp = av;
+    if (ret) *ret = i_mm;
+    return (char *)i_mm->t->addr + av->offset;
 }
 
 /*
- * call-seq: empty?
+ * call-seq: array_view(type, offset = 0, count = nil)
  *
- * return <em>true</em> if the file is empty
+ * return a <em>Mmap::ArrayView</em> over <em>count</em> numbers (all
+ * the numbers up to the end of the map by default) at
+ * <em>offset</em>, which must be aligned in memory on the size of the
+ * type (for a map with an unaligned "offset", the address of the map
+ * plus <em>offset</em>). <em>type</em> is :int8, :uint8, :int16, :uint16, :int32, :uint32,
+ * :int64, :uint64, :float32 or :float64 (native byte order)
  */
 static VALUE
-mm_empty(VALUE a)
+mm_array_view(int argc, VALUE *argv, VALUE obj)
 {
     mm_ipc *i_mm;
+    mm_aview *av;
+    VALUE vtype, voff, vcount, res;
+    const char *name;
+    long off;
+    int i;
 
-    GetMmap(a, i_mm, 0);
-    if (i_mm->t->real == 0) return Qtrue;
-    return Qfalse;
+    rb_scan_args(argc, argv, "12", &vtype, &voff, &vcount);
+    GetMmap(obj, i_mm, 0);
+    name = SYMBOL_P(vtype) ? rb_id2name(SYM2ID(vtype)) : StringValuePtr(vtype);
+    for (i = 0; mm_av_types[i].name; i++) {
+	if (strcmp(mm_av_types[i].name, name) == 0) break;
+    }
+    if (!mm_av_types[i].name) {
+	rb_raise(rb_eArgError, "unknown type `%s'", name);
+    }
+    off = NIL_P(voff) ? 0 : NUM2LONG(voff);
+    if (off < 0 || i_mm->t->real < (size_t)off) {
+	rb_raise(rb_eIndexError, "offset %ld out of mmap", off);
+    }
+    if (((uintptr_t)i_mm->t->addr + off) % mm_av_types[i].size) {
+	rb_raise(rb_eArgError, "offset %ld not aligned on %d bytes in memory", off,
+		 mm_av_types[i].size);
+    }
+    res = Data_Make_Struct(mm_cArrayView, mm_aview, mm_aview_mark, free, av);
+    av->obj = obj;
+    av->offset = off;
+    av->type = i;
+    av->count = NIL_P(vcount) ? (i_mm->t->real - off) / mm_av_types[i].size
+	: NUM2ULONG(vcount);
+    mm_aview_ptr(res, &av, 0, 0);
+    return res;
 }
 
 static VALUE
-mm_protect_bang(VALUE *t)
+mm_aview_get(mm_aview *av, const char *ptr, size_t i)
 {
-    return rb_funcall2(t[0], (ID)t[1], (int)t[2], (VALUE *)t[3]);
+    return mm_av_types[av->type].load(ptr + i * mm_av_types[av->type].size, 0);
 }
 
-static VALUE
-mm_recycle(VALUE str)
+static long
+mm_aview_index(mm_aview *av, VALUE vi)
 {
-    rb_gc_force_recycle(str);
-    return str;
+    long i = NUM2LONG(vi);
+
+    if (i < 0) i += av->count;
+    if (i < 0 || (size_t)i >= av->count) return -1;
+    return i;
 }
 
+/*
+ * call-seq: [](index)
+ *
+ * return the number at <em>index</em>, or nil
+ */
 static VALUE
-mm_i_bang(mm_bang *bang_st)
+mm_aview_aref(VALUE obj, VALUE vi)
 {
-    VALUE str, res;
-    mm_ipc *i_mm;
-    
-    str = mm_str(bang_st->obj, bang_st->flag);
-    if (bang_st->flag & MM_PROTECT) {
-	VALUE tmp[4];
-	tmp[0] = str;
-	tmp[1] = (VALUE)bang_st->id;
-	tmp[2] = (VALUE)bang_st->argc;
-	tmp[3] = (VALUE)bang_st->argv;
-	res = rb_ensure(mm_protect_bang, (VALUE)tmp, mm_recycle, str);
-    }
-    else {
-	res = rb_funcall2(str, bang_st->id, bang_st->argc, bang_st->argv);
-	rb_gc_force_recycle(str);
-    }
-    if (res != Qnil) {
-	GetMmap(bang_st->obj, i_mm, 0);
-	i_mm->t->real = RSTRING(str)->len;
-    }
-    return res;
-}
+    mm_aview *av;
+    char *ptr;
+    long i;
 
+    ptr = mm_aview_ptr(obj, &av, 0, 0);
+    if ((i = mm_aview_index(av, vi)) < 0) return Qnil;
+    return mm_aview_get(av, ptr, i);
+}
 
+/*
+ * call-seq: []=(index, value)
+ *
+ * write <em>value</em> at <em>index</em>
+ */
 static VALUE
-mm_bang_i(VALUE obj, int flag, int id, int argc, VALUE *argv)
+mm_aview_aset(VALUE obj, VALUE vi, VALUE val)
 {
-    VALUE res;
+    mm_aview *av;
     mm_ipc *i_mm;
-    mm_bang bang_st;
+    char *ptr, buf[8];
+    long i;
+    int size;
 
-    GetMmap(obj, i_mm, 0);
-    if ((flag & MM_CHANGE) && (i_mm->t->flag & MM_FIXED)) {
-	rb_raise(rb_eTypeError, "try to change the size of a fixed map");
-    }
-    bang_st.obj = obj;
-    bang_st.flag = flag;
-    bang_st.id = id;
-    bang_st.argc = argc;
-    bang_st.argv = argv;
-    if (i_mm->t->flag & MM_IPC) {
-	mm_lock(i_mm, Qtrue);
-	res = rb_ensure(mm_i_bang, (VALUE)&bang_st, mm_vunlock, obj);
-    }
-    else {
-	res = mm_i_bang(&bang_st);
+    mm_aview_ptr(obj, &av, 0, MM_MODIFY);
+    if ((i = mm_aview_index(av, vi)) < 0) {
+	rb_raise(rb_eIndexError, "index %ld out of array view", NUM2LONG(vi));
     }
-    if (res == Qnil) return res;
-    return (flag & MM_ORIGIN)?res:obj;
-
+    size = mm_av_types[av->type].size;
+    mm_av_types[av->type].store(buf, val, 0);
+    ptr = mm_aview_ptr(obj, &av, &i_mm, MM_MODIFY) + i * size;
+    memcpy(ptr, buf, size);
+    mm_dirty(i_mm, av->offset + i * size, size);
+    return val;
 }
 
 /*
- * call-seq: match(pattern)
+ * call-seq: size
  *
- * convert <em>pattern</em> to a <em>Regexp</em> and then call
- * <em>match</em> on <em>self</em>
+ * return the number of elements
  */
 static VALUE
-mm_match_m(VALUE a, VALUE b)
+mm_aview_size(VALUE obj)
 {
-    return mm_bang_i(a, MM_ORIGIN, rb_intern("match"), 1, &b);
+    mm_aview *av;
+
+    Data_Get_Struct(obj, mm_aview, av);
+    return ULONG2NUM(av->count);
 }
 
 /*
- * call-seq: upcase!
+ * call-seq: each {|x| ... }
  *
- * replaces all lowercase characters to downcase characters
+ * iterate on the numbers
  */
 static VALUE
-mm_upcase_bang(VALUE a)
+mm_aview_each(VALUE obj)
 {
-    return mm_bang_i(a, MM_MODIFY, rb_intern("upcase!"), 0, 0);
+    mm_aview *av;
+    char *ptr;
+    size_t i;
+
+#ifdef RETURN_ENUMERATOR
+    RETURN_ENUMERATOR(obj, 0, 0);
+#endif
+    Data_Get_Struct(obj, mm_aview, av);
+    for (i = 0; i < av->count; i++) {
+	ptr = mm_aview_ptr(obj, &av, 0, 0);
+	rb_yield(mm_aview_get(av, ptr, i));
+    }
+    return obj;
 }
 
 /*
- * call-seq: downcase!
+ * call-seq: to_a
  *
- * change all uppercase character to lowercase character
+ * return an Array with the numbers
  */
 static VALUE
-mm_downcase_bang(VALUE a)
+mm_aview_to_a(VALUE obj)
 {
-    return mm_bang_i(a, MM_MODIFY, rb_intern("downcase!"), 0, 0);
+    mm_aview *av;
+    char *ptr;
+    VALUE res;
+    size_t i;
+
+    ptr = mm_aview_ptr(obj, &av, 0, 0);
+    res = rb_ary_new2(av->count);
+    for (i = 0; i < av->count; i++) {
+	rb_ary_push(res, mm_aview_get(av, ptr, i));
+    }
+    return res;
 }
 
-/*
- * call-seq: capitalize!
- *
- * change the first character to uppercase letter
- */
-static VALUE
-mm_capitalize_bang(VALUE a)
+#if HAVE_PTHREAD_H
+static void *
+mm_i_av_thread(void *ptr)
 {
-    return mm_bang_i(a, MM_MODIFY, rb_intern("capitalize!"), 0, 0);
+    mm_avst *st = (mm_avst *)ptr;
+
+    mm_av_types[st->type].kernel(st);
+    return 0;
 }
+#endif
 
 /*
- * call-seq: swapcase!
- *
- * replaces all lowercase characters to uppercase characters, and vice-versa
+ * run the kernel of st->type on the mm_avst st_mm->data,
+ * with up to one thread for each MM_COUNT_CHUNK bytes, and merge the
+ * results
  */
-static VALUE
-mm_swapcase_bang(VALUE a)
+static void *
+mm_i_av(void *ptr)
 {
-    return mm_bang_i(a, MM_MODIFY, rb_intern("swapcase!"), 0, 0);
+    mm_st *st_mm = (mm_st *)ptr;
+    mm_avst *st = (mm_avst *)st_mm->data;
+    int size = mm_av_types[st->type].size;
+#if HAVE_PTHREAD_H
+    mm_avst sub[MM_COUNT_THREADS];
+    pthread_t thread[MM_COUNT_THREADS];
+    int started[MM_COUNT_THREADS];
+    long ncpu = 1;
+    size_t chunk;
+    int i, k, n;
+
+#ifdef _SC_NPROCESSORS_ONLN
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    n = st->n * size / MM_COUNT_CHUNK;
+    if (n > ncpu) n = ncpu;
+    if (n > MM_COUNT_THREADS) n = MM_COUNT_THREADS;
+    if (n > 1) {
+	chunk = (st->n + n - 1) / n;
+	for (i = 0; i < n; i++) {
+	    sub[i] = *st;
+	    sub[i].ptr = st->ptr + i * chunk * size;
+	    sub[i].n = (i == n - 1) ? st->n - i * chunk : chunk;
+	    if (st->op == MM_AV_HIST) {
+		sub[i].bins = st->bins + (size_t)(i + 1) * st->nbins;
+	    }
+	    started[i] = (i > 0 && pthread_create(&thread[i], 0, mm_i_av_thread, &sub[i]) == 0);
+	}
+	for (i = 0; i < n; i++) {
+	    if (started[i]) {
+		pthread_join(thread[i], 0);
+	    }
+	    else {
+		mm_i_av_thread(&sub[i]);
+	    }
+	}
+	for (i = 0; i < n; i++) {
+	    st->isum += sub[i].isum;
+	    st->usum += sub[i].usum;
+	    st->dsum += sub[i].dsum;
+	    st->count += sub[i].count;
+	    if (st->op == MM_AV_MINMAX) {
+		if (i == 0 || sub[i].imin < st->imin) st->imin = sub[i].imin;
+		if (i == 0 || sub[i].imax > st->imax) st->imax = sub[i].imax;
+		if (i == 0 || sub[i].umin < st->umin) st->umin = sub[i].umin;
+		if (i == 0 || sub[i].umax > st->umax) st->umax = sub[i].umax;
+		if (i == 0 || sub[i].dmin < st->dmin) st->dmin = sub[i].dmin;
+		if (i == 0 || sub[i].dmax > st->dmax) st->dmax = sub[i].dmax;
+	    }
+	    if (st->op == MM_AV_HIST) {
+		for (k = 0; k < st->nbins; k++) {
+		    st->bins[k] += sub[i].bins[k];
+		}
+	    }
+	}
+	st_mm->done = 1;
+	return 0;
+    }
+#endif
+    mm_av_types[st->type].kernel(st);
+    st_mm->done = 1;
+    return 0;
 }
- 
+
+static void
+mm_aview_run(VALUE obj, mm_avst *st)
+{
+    mm_aview *av;
+    mm_ipc *i_mm;
+    mm_st st_mm;
+
+    st->ptr = mm_aview_ptr(obj, &av, &i_mm, 0);
+    st->n = av->count;
+    st->type = av->type;
+    st_mm.i_mm = i_mm;
+    st_mm.data = st;
+    mm_rlock(i_mm);
+    if (av->count * mm_av_types[av->type].size < MM_COUNT_CHUNK) {
+	mm_i_av(&st_mm);
+    }
+    else {
+	mm_nogvl(&st_mm, mm_i_av, 1);
+    }
+    mm_runlock(i_mm);
+}
+
 /*
- * call-seq: reverse!
+ * call-seq: sum
  *
- * reverse the content of the file 
+ * return the sum of the numbers (an Integer for the integer types,
+ * computed modulo 2**64)
  */
 static VALUE
-mm_reverse_bang(VALUE a)
+mm_aview_sum(VALUE obj)
 {
-    return mm_bang_i(a, MM_MODIFY, rb_intern("reverse!"), 0, 0);
+    mm_aview *av;
+    mm_avst st;
+
+    Data_Get_Struct(obj, mm_aview, av);
+    MEMZERO(&st, mm_avst, 1);
+    st.op = MM_AV_SUM;
+    mm_aview_run(obj, &st);
+    switch (mm_av_types[av->type].kind) {
+      case MM_AV_INT: return LL2NUM(st.isum);
+      case MM_AV_UINT: return ULL2NUM(st.usum);
+      default: return rb_float_new(st.dsum);
+    }
 }
 
 /*
- * call-seq: chop!
+ * call-seq: mean
  *
- * chop off the last character
+ * return the mean of the numbers (a Float), or nil if the view is
+ * empty
  */
 static VALUE
-mm_chop_bang(VALUE a)
+mm_aview_mean(VALUE obj)
 {
-    return mm_bang_i(a, MM_CHANGE, rb_intern("chop!"), 0, 0);
+    mm_aview *av;
+    mm_avst st;
+
+    Data_Get_Struct(obj, mm_aview, av);
+    if (!av->count) return Qnil;
+    MEMZERO(&st, mm_avst, 1);
+    st.op = MM_AV_SUM;
+    mm_aview_run(obj, &st);
+    switch (mm_av_types[av->type].kind) {
+      case MM_AV_INT: return rb_float_new((double)st.isum / av->count);
+      case MM_AV_UINT: return rb_float_new((double)st.usum / av->count);
+      default: return rb_float_new(st.dsum / av->count);
+    }
 }
 
 static VALUE
-mm_inspect(VALUE a)
+mm_aview_minmax(VALUE obj, int max)
 {
-    return rb_any_to_s(a);
+    mm_aview *av;
+    mm_avst st;
+
+    Data_Get_Struct(obj, mm_aview, av);
+    if (!av->count) return Qnil;
+    MEMZERO(&st, mm_avst, 1);
+    st.op = MM_AV_MINMAX;
+    mm_aview_run(obj, &st);
+    switch (mm_av_types[av->type].kind) {
+      case MM_AV_INT: return LL2NUM(max ? st.imax : st.imin);
+      case MM_AV_UINT: return ULL2NUM(max ? st.umax : st.umin);
+      default: return rb_float_new(max ? st.dmax : st.dmin);
+    }
 }
 
 /*
- * call-seq: chomp!(rs = $/)
+ * call-seq: min
  *
- * chop off the  line ending character, specified by <em>rs</em>
+ * return the smallest number, or nil if the view is empty
  */
 static VALUE
-mm_chomp_bang(int argc, VALUE *argv, VALUE obj)
+mm_aview_min(VALUE obj)
 {
-    return mm_bang_i(obj, MM_CHANGE | MM_PROTECT, rb_intern("chomp!"), argc, argv);
+    return mm_aview_minmax(obj, 0);
 }
 
 /*
- * call-seq: delete!(str)
+ * call-seq: max
  *
- * delete every characters included in <em>str</em>
+ * return the largest number, or nil if the view is empty
  */
 static VALUE
-mm_delete_bang(int argc, VALUE *argv, VALUE obj)
+mm_aview_max(VALUE obj)
 {
-    return mm_bang_i(obj, MM_CHANGE | MM_PROTECT, rb_intern("delete!"), argc, argv);
+    return mm_aview_minmax(obj, 1);
 }
 
 /*
- * squeeze!(str)
- *
- * squeezes sequences of the same characters which is included in <em>str</em>
+ * convert the threshold val of a count to the integer type of the
+ * view, in st->ival or st->uval. A Float is rounded so that the
+ * comparison keep its result. Return -1 (or 1) if val is below (or
+ * above) all the values of the type, 2 if no value can be equal to
+ * val, else 0
  */
-static VALUE
-mm_squeeze_bang(int argc, VALUE *argv, VALUE obj)
+static int
+mm_av_threshold(mm_avst *st, int type, VALUE val)
 {
-    return mm_bang_i(obj, MM_CHANGE | MM_PROTECT, rb_intern("squeeze!"), argc, argv);
+    int bits = mm_av_types[type].size * 8;
+    double f;
+
+    if (!FIXNUM_P(val) && TYPE(val) != T_BIGNUM) {
+	f = NUM2DBL(val);
+	if (f != f) return 2;
+	switch (st->cmp) {
+	  case MM_AV_LT: case MM_AV_GE: f = ceil(f); break;
+	  case MM_AV_LE: case MM_AV_GT: f = floor(f); break;
+	  default: if (f != floor(f)) return 2; break;
+	}
+	if (f - f != 0) return (f < 0) ? -1 : 1;
+	val = rb_dbl2big(f);
+    }
+    if (mm_av_types[type].kind == MM_AV_INT) {
+	int64_t hi = (bits == 64) ? INT64_MAX : ((int64_t)1 << (bits - 1)) - 1;
+
+	if (RTEST(rb_funcall(val, '<', 1, LL2NUM(-hi - 1)))) return -1;
+	if (RTEST(rb_funcall(val, '>', 1, LL2NUM(hi)))) return 1;
+	st->ival = NUM2LL(val);
+    }
+    else {
+	uint64_t hi = (bits == 64) ? UINT64_MAX : ((uint64_t)1 << bits) - 1;
+
+	if (RTEST(rb_funcall(val, '<', 1, INT2FIX(0)))) return -1;
+	if (RTEST(rb_funcall(val, '>', 1, ULL2NUM(hi)))) return 1;
+	st->uval = NUM2ULL(val);
+    }
+    return 0;
 }
 
 /*
- * call-seq: tr!(search, replace)
+ * call-seq: count(op = nil, value = nil)
  *
- * translate the character from <em>search</em> to <em>replace</em> 
+ * return the number of elements <em>x</em> for which <em>x op
+ * value</em> is true, <em>op</em> is one of :<, :<=, :>, :>=, :== or
+ * :!=. Without argument return the size. The comparison is exact for
+ * all the types : for the integer types it is done in the type of
+ * the view, not in Float
  */
 static VALUE
-mm_tr_bang(VALUE obj, VALUE a, VALUE b)
+mm_aview_count(int argc, VALUE *argv, VALUE obj)
 {
-    VALUE tmp[2];
-    tmp[0] = a;
-    tmp[1] = b;
-    return mm_bang_i(obj, MM_MODIFY | MM_PROTECT, rb_intern("tr!"), 2, tmp);
+    static const char *ops[] = {"<", "<=", ">", ">=", "==", "!="};
+    mm_aview *av;
+    mm_avst st;
+    VALUE vop, val;
+    const char *name;
+    int i;
+
+    Data_Get_Struct(obj, mm_aview, av);
+    if (rb_scan_args(argc, argv, "02", &vop, &val) == 0) {
+	return ULONG2NUM(av->count);
+    }
+    name = SYMBOL_P(vop) ? rb_id2name(SYM2ID(vop)) : StringValuePtr(vop);
+    for (i = 0; i < 6; i++) {
+	if (strcmp(ops[i], name) == 0) break;
+    }
+    if (i == 6) {
+	rb_raise(rb_eArgError, "unknown operator `%s'", name);
+    }
+    MEMZERO(&st, mm_avst, 1);
+    st.op = MM_AV_COUNT;
+    st.cmp = i;
+    if (mm_av_types[av->type].kind == MM_AV_FLOAT) {
+	st.lo = NUM2DBL(val);
+    }
+    else {
+	switch (mm_av_threshold(&st, av->type, val)) {
+	  case -1:
+	    i = (i == MM_AV_GT || i == MM_AV_GE || i == MM_AV_NE);
+	    mm_aview_ptr(obj, &av, 0, 0);
+	    return ULONG2NUM(i ? av->count : 0);
+	  case 1:
+	    i = (i == MM_AV_LT || i == MM_AV_LE || i == MM_AV_NE);
+	    mm_aview_ptr(obj, &av, 0, 0);
+	    return ULONG2NUM(i ? av->count : 0);
+	  case 2:
+	    mm_aview_ptr(obj, &av, 0, 0);
+	    return ULONG2NUM(i == MM_AV_NE ? av->count : 0);
+	}
+    }
+    mm_aview_run(obj, &st);
+    return ULONG2NUM(st.count);
 }
 
 /*
- * call-seq: tr_s!(search, replace)
+ * call-seq: histogram(bins, min = self.min, max = self.max)
  *
- * translate the character from <em>search</em> to <em>replace</em>, then
- * squeeze sequence of the same characters 
+ * return an Array with the number of elements in each of the
+ * <em>bins</em> intervals of the same width between <em>min</em> and
+ * <em>max</em>
  */
 static VALUE
-mm_tr_s_bang(VALUE obj, VALUE a, VALUE b)
+mm_aview_histogram(int argc, VALUE *argv, VALUE obj)
 {
-    VALUE tmp[2];
-    tmp[0] = a;
-    tmp[1] = b;
-    return mm_bang_i(obj, MM_CHANGE | MM_PROTECT, rb_intern("tr_s!"), 2, tmp);
+    mm_aview *av;
+    mm_avst st;
+    VALUE vbins, vmin, vmax, buf, res;
+    size_t size;
+    int i, n;
+
+    rb_scan_args(argc, argv, "12", &vbins, &vmin, &vmax);
+    Data_Get_Struct(obj, mm_aview, av);
+    n = NUM2INT(vbins);
+    if (n <= 0) {
+	rb_raise(rb_eArgError, "invalid number of bins %d", n);
+    }
+    /* one set of bins for the result and one for each thread */
+    size = (MM_COUNT_THREADS + 1) * sizeof(size_t);
+    if ((size_t)n > LONG_MAX / size) {
+	rb_raise(rb_eArgError, "too many bins %d", n);
+    }
+    size *= n;
+    if (NIL_P(vmin)) vmin = mm_aview_min(obj);
+    if (NIL_P(vmax)) vmax = mm_aview_max(obj);
+    res = rb_ary_new2(n);
+    MEMZERO(&st, mm_avst, 1);
+    if (!NIL_P(vmin) && !NIL_P(vmax)) {
+	st.lo = NUM2DBL(vmin);
+	st.hi = NUM2DBL(vmax);
+    }
+    if (!av->count || !(st.lo < st.hi)) {
+	for (i = 0; i < n; i++) {
+	    rb_ary_push(res, INT2FIX(0));
+	}
+	if (av->count && st.lo == st.hi && !NIL_P(vmin)) {
+	    VALUE args[2];
+
+	    args[0] = ID2SYM(rb_intern("=="));
+	    args[1] = vmin;
+	    rb_ary_store(res, 0, mm_aview_count(2, args, obj));
+	}
+	return res;
+    }
+    buf = rb_str_new(0, size);
+    MEMZERO(RSTRING(buf)->ptr, char, RSTRING(buf)->len);
+    st.op = MM_AV_HIST;
+    st.nbins = n;
+    st.bins = (size_t *)RSTRING(buf)->ptr;
+    mm_aview_run(obj, &st);
+    for (i = 0; i < n; i++) {
+	rb_ary_push(res, ULONG2NUM(st.bins[i]));
+    }
+    return res;
 }
 
 /*
- * call-seq: crypt
- *
- * crypt with <em>salt</em> 
+ * fixed-size records : Mmap::Layout and Mmap::Records
  */
-static VALUE
-mm_crypt(VALUE a, VALUE b)
+#define MM_FIELD_BYTES -1
+
+typedef struct {
+    ID id;
+    int type;
+    size_t offset, size;
+} mm_field;
+
+typedef struct {
+    int n, swap;
+    size_t size;
+    mm_field *fields;
+} mm_layout;
+
+static void
+mm_layout_free(mm_layout *ly)
 {
-    return mm_bang_i(a, MM_ORIGIN, rb_intern("crypt"), 1, &b);
+    if (ly->fields) free(ly->fields);
+    free(ly);
 }
 
 /*
- * call-seq: include?(other)
+ * call-seq: Mmap::Layout.define(fields, order = :native)
  *
- * return <em>true</em> if <em>other</em> is found
+ * compile the description of a record. <em>fields</em> is a Hash (an
+ * Array of pairs with ruby 1.8, where the Hash are not ordered) which
+ * give for each name the type of the field : :u8, :i8, :u16, :i16,
+ * :u32, :i32, :u64, :i64, :f32, :f64 or [:bytes, length]. The fields
+ * are packed without padding
+ *
+ *   Mmap::Layout.define(id: :u64, ts: :i64, score: :f32, name: [:bytes, 16])
  */
 static VALUE
-mm_include(VALUE a, VALUE b)
+mm_layout_define(int argc, VALUE *argv, VALUE klass)
+{
+    VALUE fields, order, res, pair, vtype;
+    mm_layout *ly;
+    mm_field *f;
+    const char *name;
+    long i;
+    int j;
+
+    rb_scan_args(argc, argv, "11", &fields, &order);
+    if (TYPE(fields) == T_HASH) {
+	fields = rb_funcall(fields, rb_intern("to_a"), 0);
+    }
+    fields = rb_Array(fields);
+    res = Data_Make_Struct(klass, mm_layout, 0, mm_layout_free, ly);
+    ly->swap = mm_swap_endian(order);
+    ly->fields = ALLOC_N(mm_field, RARRAY(fields)->len);
+    for (i = 0; i < RARRAY(fields)->len; i++) {
+	pair = rb_Array(RARRAY(fields)->ptr[i]);
+	if (RARRAY(pair)->len != 2) {
+	    rb_raise(rb_eArgError, "invalid field description");
+	}
+	f = &ly->fields[ly->n];
+	f->id = rb_to_id(RARRAY(pair)->ptr[0]);
+	f->offset = ly->size;
+	vtype = RARRAY(pair)->ptr[1];
+	if (TYPE(vtype) == T_ARRAY) {
+	    if (RARRAY(vtype)->len != 2 ||
+		rb_to_id(RARRAY(vtype)->ptr[0]) != rb_intern("bytes") ||
+		NUM2LONG(RARRAY(vtype)->ptr[1]) <= 0) {
+		rb_raise(rb_eArgError, "invalid type for field `%s'",
+			 rb_id2name(f->id));
+	    }
+	    f->type = MM_FIELD_BYTES;
+	    f->size = NUM2LONG(RARRAY(vtype)->ptr[1]);
+	}
+	else {
+	    name = rb_id2name(rb_to_id(vtype));
+	    for (j = 0; mm_scalar_types[j].name; j++) {
+		if (strcmp(mm_scalar_types[j].name, name) == 0) break;
+	    }
+	    if (!mm_scalar_types[j].name) {
+		rb_raise(rb_eArgError, "unknown type `%s'", name);
+	    }
+	    f->type = j;
+	    f->size = mm_scalar_types[j].size;
+	}
+	for (j = 0; j < ly->n; j++) {
+	    if (ly->fields[j].id == f->id) {
+		rb_raise(rb_eArgError, "duplicate field `%s'", rb_id2name(f->id));
+	    }
+	}
+	ly->size += f->size;
+	ly->n++;
+    }
+    if (!ly->size) {
+	rb_raise(rb_eArgError, "empty layout");
+    }
+    return res;
+}
+
+static mm_field *
+mm_layout_field(mm_layout *ly, VALUE name)
 {
-    return mm_bang_i(a, MM_ORIGIN, rb_intern("include?"), 1, &b);
+    long i;
+    ID id;
+
+    if (FIXNUM_P(name)) {
+	i = FIX2LONG(name);
+	if (i < 0 || i >= ly->n) {
+	    rb_raise(rb_eIndexError, "field %ld out of layout", i);
+	}
+	return &ly->fields[i];
+    }
+    id = rb_to_id(name);
+    for (i = 0; i < ly->n; i++) {
+	if (ly->fields[i].id == id) return &ly->fields[i];
+    }
+    rb_raise(rb_eArgError, "unknown field `%s'", rb_id2name(id));
+    return 0;
 }
 
 /*
- * call-seq: index
+ * call-seq: size
  *
- * return the index of <em>substr</em> 
+ * return the size of a record
  */
 static VALUE
-mm_index(int argc, VALUE *argv, VALUE obj)
+mm_layout_size(VALUE obj)
 {
-    return mm_bang_i(obj, MM_ORIGIN, rb_intern("index"), argc, argv);
+    mm_layout *ly;
+
+    Data_Get_Struct(obj, mm_layout, ly);
+    return ULONG2NUM(ly->size);
 }
 
 /*
- * call-seq: rindex(sibstr, pos = nil)
+ * call-seq: fields
  *
- * return the index of the last occurrence of <em>substr</em>
+ * return the names of the fields
  */
 static VALUE
-mm_rindex(int argc, VALUE *argv, VALUE obj)
+mm_layout_fields(VALUE obj)
 {
-    return mm_bang_i(obj, MM_ORIGIN, rb_intern("rindex"), argc, argv);
+    mm_layout *ly;
+    VALUE res;
+    int i;
+
+    Data_Get_Struct(obj, mm_layout, ly);
+    res = rb_ary_new2(ly->n);
+    for (i = 0; i < ly->n; i++) {
+	rb_ary_push(res, ID2SYM(ly->fields[i].id));
+    }
+    return res;
 }
 
 /*
- * Document-method: []
- * Document-method: slice
- *
- * call-seq: [](args)
+ * call-seq: offset(field)
  *
- * Element reference - with the following syntax:
- * 
- *   self[nth] 
- * 
- * retrieve the <em>nth</em> character
- * 
- *   self[start..last]
- * 
- * return a substring from <em>start</em> to <em>last</em>
- * 
- *   self[start, length]
- * 
- * return a substring of <em>lenght</em> characters from <em>start</em> 
+ * return the offset of <em>field</em> in a record
  */
 static VALUE
-mm_aref_m(int argc, VALUE *argv, VALUE obj)
+mm_layout_offset(VALUE obj, VALUE name)
 {
-    return mm_bang_i(obj, MM_ORIGIN, rb_intern("[]"), argc, argv);
+    mm_layout *ly;
+
+    Data_Get_Struct(obj, mm_layout, ly);
+    return ULONG2NUM(mm_layout_field(ly, name)->offset);
+}
+
+typedef struct {
+    VALUE obj, layout;
+    size_t offset, count;
+} mm_records;
+
+static void
+mm_records_mark(mm_records *rc)
+{
+    rb_gc_mark(rc->obj);
+    rb_gc_mark(rc->layout);
 }
 
 /*
- * call-seq: sum(bits = 16)
+ * check that the records are still in the map, and return their
+ * address
+ */
+static char *
+mm_records_ptr(VALUE obj, mm_records **rcp, mm_layout **lyp, mm_ipc **ret,
+	       int modify)
+{
+    mm_records *rc;
+    mm_ipc *i_mm;
+
+    Data_Get_Struct(obj, mm_records, rc);
+    Data_Get_Struct(rc->layout, mm_layout, *lyp);
+    GetMmap(rc->obj, i_mm, modify);
+    if (i_mm->t->real < rc->offset ||
+	(i_mm->t->real - rc->offset) / (*lyp)->size < rc->count) {
+	rb_raise(rb_eIndexError, "records out of mmap");
+    }
+    *rcp = rc;
+    if (ret) *ret = i_mm;
+    return (char *)i_mm->t->addr + rc->offset;
+}
+
+/*
+ * call-seq: records(layout, offset = 0, count = nil)
  *
- * return a checksum
+ * return the <em>Mmap::Records</em> with <em>layout</em> at
+ * <em>offset</em> : <em>count</em> records, or all the complete
+ * records up to the end of the map
  */
 static VALUE
-mm_sum(int argc, VALUE *argv, VALUE obj)
+mm_records_new(int argc, VALUE *argv, VALUE obj)
 {
-    return mm_bang_i(obj, MM_ORIGIN, rb_intern("sum"), argc, argv);
+    VALUE layout, voff, vcount, res;
+    mm_records *rc;
+    mm_layout *ly;
+    mm_ipc *i_mm;
+    long off;
+
+    rb_scan_args(argc, argv, "12", &layout, &voff, &vcount);
+    GetMmap(obj, i_mm, 0);
+    if (!rb_obj_is_kind_of(layout, mm_cLayout)) {
+	rb_raise(rb_eTypeError, "expected a Mmap::Layout");
+    }
+    Data_Get_Struct(layout, mm_layout, ly);
+    off = NIL_P(voff) ? 0 : NUM2LONG(voff);
+    if (off < 0 || i_mm->t->real < (size_t)off) {
+	rb_raise(rb_eIndexError, "offset %ld out of mmap", off);
+    }
+    res = Data_Make_Struct(mm_cRecords, mm_records, mm_records_mark, free, rc);
+    rc->obj = obj;
+    rc->layout = layout;
+    rc->offset = off;
+    rc->count = NIL_P(vcount) ? (i_mm->t->real - off) / ly->size
+	: NUM2ULONG(vcount);
+    mm_records_ptr(res, &rc, &ly, 0, 0);
+    return res;
+}
+
+static long
+mm_records_index(mm_records *rc, VALUE vi)
+{
+    long i = NUM2LONG(vi);
+
+    if (i < 0) i += rc->count;
+    if (i < 0 || (size_t)i >= rc->count) {
+	rb_raise(rb_eIndexError, "record %ld out of range", NUM2LONG(vi));
+    }
+    return i;
+}
+
+static VALUE
+mm_records_load(VALUE obj, mm_ipc *i_mm, mm_layout *ly, mm_field *f,
+		size_t off)
+{
+    if (f->type == MM_FIELD_BYTES) {
+	return mm_substr(obj, i_mm, off, f->size, 0);
+    }
+    return mm_scalar_types[f->type].load((char *)i_mm->t->addr + off, ly->swap);
 }
 
 /*
- * call-seq: split(sep, limit = 0)
+ * call-seq:
+ *   [](index, field)
+ *   [](index)
  *
- * splits into a list of strings and return this array
+ * return the value of <em>field</em> in the record <em>index</em>,
+ * read directly in the map. Without <em>field</em> return a Hash
+ * with all the fields of the record
  */
 static VALUE
-mm_split(int argc, VALUE *argv, VALUE obj)
+mm_records_aref(int argc, VALUE *argv, VALUE obj)
 {
-    return mm_bang_i(obj, MM_ORIGIN, rb_intern("split"), argc, argv);
+    VALUE vi, name, res;
+    mm_records *rc;
+    mm_layout *ly;
+    mm_field *f;
+    mm_ipc *i_mm;
+    size_t off;
+    int j;
+
+    rb_scan_args(argc, argv, "11", &vi, &name);
+    mm_records_ptr(obj, &rc, &ly, &i_mm, 0);
+    off = rc->offset + mm_records_index(rc, vi) * ly->size;
+    if (!NIL_P(name)) {
+	f = mm_layout_field(ly, name);
+	return mm_records_load(rc->obj, i_mm, ly, f, off + f->offset);
+    }
+    res = rb_hash_new();
+    for (j = 0; j < ly->n; j++) {
+	rb_hash_aset(res, ID2SYM(ly->fields[j].id),
+		     mm_records_load(rc->obj, i_mm, ly, &ly->fields[j],
+				     off + ly->fields[j].offset));
+    }
+    return res;
 }
 
 /*
- * call-seq: count(o1, *args)
+ * call-seq: []=(index, field, value)
  *
- * each parameter defines a set of character to count
+ * write <em>value</em> in <em>field</em> of the record <em>index</em>.
+ * A String shorter than a bytes field is padded with "\0"
  */
 static VALUE
-mm_count(int argc, VALUE *argv, VALUE obj)
+mm_records_aset(VALUE obj, VALUE vi, VALUE name, VALUE val)
 {
-    return mm_bang_i(obj, MM_ORIGIN, rb_intern("count"), argc, argv);
+    mm_records *rc;
+    mm_layout *ly;
+    mm_field *f;
+    mm_ipc *i_mm;
+    char buf[8], *ptr;
+    size_t off;
+
+    Data_Get_Struct(obj, mm_records, rc);
+    Data_Get_Struct(rc->layout, mm_layout, ly);
+    f = mm_layout_field(ly, name);
+    if (f->type == MM_FIELD_BYTES) {
+	StringValue(val);
+	if (RSTRING(val)->len > (long)f->size) {
+	    rb_raise(rb_eArgError, "string too long for field `%s'",
+		     rb_id2name(f->id));
+	}
+    }
+    else {
+	mm_scalar_types[f->type].store(buf, val, ly->swap);
+    }
+    ptr = mm_records_ptr(obj, &rc, &ly, &i_mm, MM_MODIFY);
+    off = mm_records_index(rc, vi) * ly->size + f->offset;
+    ptr += off;
+    if (f->type == MM_FIELD_BYTES) {
+	memcpy(ptr, RSTRING(val)->ptr, RSTRING(val)->len);
+	memset(ptr + RSTRING(val)->len, 0, f->size - RSTRING(val)->len);
+    }
+    else {
+	memcpy(ptr, buf, f->size);
+    }
+    mm_dirty(i_mm, rc->offset + off, f->size);
+    return val;
 }
 
+/*
+ * call-seq: column(field)
+ *
+ * return a String with the values of <em>field</em> in all the
+ * records, packed one after the other (in the native byte order for
+ * the numbers)
+ */
 static VALUE
-mm_internal_each(VALUE arg)
+mm_records_column(VALUE obj, VALUE name)
 {
-    VALUE *tmp = (VALUE *)arg;
-    return rb_funcall2(tmp[0], (ID)tmp[1], (int)tmp[2], (VALUE *)tmp[3]);
+    mm_records *rc;
+    mm_layout *ly;
+    mm_field *f;
+    VALUE res;
+    char *src, *dst;
+    size_t i, size;
+
+    Data_Get_Struct(obj, mm_records, rc);
+    Data_Get_Struct(rc->layout, mm_layout, ly);
+    f = mm_layout_field(ly, name);
+    size = f->size;
+    res = rb_str_new(0, rc->count * size);
+    src = mm_records_ptr(obj, &rc, &ly, 0, 0) + f->offset;
+    dst = RSTRING(res)->ptr;
+    for (i = 0; i < rc->count; i++) {
+	memcpy(dst, src, size);
+	src += ly->size;
+	dst += size;
+    }
+    if (ly->swap && f->type != MM_FIELD_BYTES && size > 1) {
+	dst = RSTRING(res)->ptr;
+	for (i = 0; i < rc->count; i++, dst += size) {
+	    switch (size) {
+	      case 2: {
+		uint16_t u;
+		memcpy(&u, dst, 2); u = MM_BSWAP16(u); memcpy(dst, &u, 2);
+		break;
+	      }
+	      case 4: {
+		uint32_t u;
+		memcpy(&u, dst, 4); u = MM_BSWAP32(u); memcpy(dst, &u, 4);
+		break;
+	      }
+	      default: {
+		uint64_t u;
+		memcpy(&u, dst, 8); u = MM_BSWAP64(u); memcpy(dst, &u, 8);
+		break;
+	      }
+	    }
+	}
+    }
+    return res;
 }
 
 /*
- * call-seq: scan(pattern, &block)
+ * call-seq: size
  *
- * return an array of all occurence matched by <em>pattern</em> 
+ * return the number of records
  */
 static VALUE
-mm_scan(VALUE obj, VALUE a)
+mm_records_size(VALUE obj)
 {
-    VALUE tmp[4];
+    mm_records *rc;
 
-    if (!rb_block_given_p()) {
-	return rb_funcall(mm_str(obj, MM_ORIGIN), rb_intern("scan"), 1, a);
-    }
-    tmp[0] = mm_str(obj, MM_ORIGIN);
-    tmp[1] = (VALUE)rb_intern("scan");
-    tmp[2] = (VALUE)1;
-    tmp[3] = (VALUE)&a;
-    rb_iterate(mm_internal_each, (VALUE)tmp, rb_yield, 0);
-    return obj;
+    Data_Get_Struct(obj, mm_records, rc);
+    return ULONG2NUM(rc->count);
 }
 
 /*
- * Document-method: each
- * Document-method: each_line
- *
- * call-seq:
- *    each(rs = $/, &block)
+ * call-seq: layout
  *
- * iterate on each line
+ * return the <em>Mmap::Layout</em> of the records
  */
 static VALUE
-mm_each_line(int argc, VALUE *argv, VALUE obj)
+mm_records_layout(VALUE obj)
 {
-    VALUE tmp[4];
+    mm_records *rc;
 
-    tmp[0] = mm_str(obj, MM_ORIGIN);
-    tmp[1] = (VALUE)rb_intern("each_line");
-    tmp[2] = (VALUE)argc;
-    tmp[3] = (VALUE)argv;
-    rb_iterate(mm_internal_each, (VALUE)tmp, rb_yield, 0);
-    return obj;
+    Data_Get_Struct(obj, mm_records, rc);
+    return rc->layout;
 }
 
 /*
@@ -2181,13 +8272,27 @@ mm_each_line(int argc, VALUE *argv, VALUE obj)
 static VALUE
 mm_each_byte(int argc, VALUE *argv, VALUE obj)
 {
-    VALUE tmp[4];
+    VALUE tmp[6];
+    mm_ipc *i_mm;
 
+#ifdef RETURN_ENUMERATOR
+    RETURN_ENUMERATOR(obj, argc, argv);
+#endif
+    GetMmap(obj, i_mm, 0);
+    i_mm->ranext = 0;
+    mm_readahead(i_mm, 0);
     tmp[0] = mm_str(obj, MM_ORIGIN);
     tmp[1] = (VALUE)rb_intern("each_byte");
     tmp[2] = (VALUE)argc;
     tmp[3] = (VALUE)argv;
-    rb_iterate(mm_internal_each, (VALUE)tmp, rb_yield, 0);
+    tmp[4] = obj;
+    tmp[5] = 0;
+    if (i_mm->readahead) {
+	rb_iterate(mm_internal_each, (VALUE)tmp, mm_i_each_yield, (VALUE)tmp);
+    }
+    else {
+	rb_iterate(mm_internal_each, (VALUE)tmp, rb_yield, 0);
+    }
     return obj;
 }
 
@@ -2233,6 +8338,17 @@ mm_munlockall(VALUE obj)
     return Qnil;
 }
 
+static void *
+mm_i_mlock(void *ptr)
+{
+    mm_st *st_mm = (mm_st *)ptr;
+
+    st_mm->error = mlock(st_mm->addr, st_mm->len);
+    st_mm->err = errno;
+    st_mm->done = 1;
+    return 0;
+}
+
 /*
  * Document-method: lock
  * Document-method: mlock
@@ -2245,6 +8361,7 @@ static VALUE
 mm_mlock(VALUE obj)
 {
     mm_ipc *i_mm;
+    mm_st st_mm;
 
     Data_Get_Struct(obj, mm_ipc, i_mm);
     if (i_mm->t->flag & MM_LOCK) {
@@ -2253,8 +8370,12 @@ mm_mlock(VALUE obj)
     if (i_mm->t->flag & MM_ANON) {
 	rb_raise(rb_eArgError, "mlock(anonymous)");
     }
-    if (mlock(i_mm->t->addr, i_mm->t->len) == -1) {
-	rb_raise(rb_eArgError, "mlock(%d)", errno);
+    st_mm.i_mm = i_mm;
+    st_mm.addr = MM_BASE(i_mm->t);
+    st_mm.len = MM_MAPLEN(i_mm->t);
+    mm_nogvl(&st_mm, mm_i_mlock, 1);
+    if (st_mm.error == -1) {
+	rb_raise(rb_eArgError, "mlock(%d)", st_mm.err);
     }
     i_mm->t->flag |= MM_LOCK;
     return obj;
@@ -2277,7 +8398,7 @@ mm_munlock(VALUE obj)
     if (!(i_mm->t->flag & MM_LOCK)) {
 	return obj;
     }
-    if (munlock(i_mm->t->addr, i_mm->t->len) == -1) {
+    if (munlock(MM_BASE(i_mm->t), MM_MAPLEN(i_mm->t)) == -1) {
 	rb_raise(rb_eArgError, "munlock(%d)", errno);
     }
     i_mm->t->flag &= ~MM_LOCK;
@@ -2291,6 +8412,19 @@ Init_mmap(void)
 	rb_raise(rb_eNameError, "class already defined");
     }
     mm_cMap = rb_define_class("Mmap", rb_cObject);
+    mm_pagesize = getpagesize();
+#if defined(MADV_POPULATE_READ) && defined(MADV_POPULATE_WRITE) && defined(MAP_ANON)
+    {
+	/* the kernel may be older than the headers */
+	void *p = mmap(0, mm_pagesize, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANON, -1, 0);
+
+	if (p != MAP_FAILED) {
+	    mm_madv_populate = madvise(p, mm_pagesize, MADV_POPULATE_READ) == 0;
+	    munmap(p, mm_pagesize);
+	}
+    }
+#endif
     rb_define_const(mm_cMap, "MS_SYNC", INT2FIX(MS_SYNC));
     rb_define_const(mm_cMap, "MS_ASYNC", INT2FIX(MS_ASYNC));
     rb_define_const(mm_cMap, "MS_INVALIDATE", INT2FIX(MS_INVALIDATE));
@@ -2307,6 +8441,42 @@ Init_mmap(void)
     rb_define_const(mm_cMap, "MADV_WILLNEED", INT2FIX(MADV_WILLNEED));
     rb_define_const(mm_cMap, "MADV_DONTNEED", INT2FIX(MADV_DONTNEED));
 #endif
+#ifdef MADV_HUGEPAGE
+    rb_define_const(mm_cMap, "MADV_HUGEPAGE", INT2FIX(MADV_HUGEPAGE));
+#endif
+#ifdef MADV_NOHUGEPAGE
+    rb_define_const(mm_cMap, "MADV_NOHUGEPAGE", INT2FIX(MADV_NOHUGEPAGE));
+#endif
+#ifdef MADV_FREE
+    rb_define_const(mm_cMap, "MADV_FREE", INT2FIX(MADV_FREE));
+#endif
+#ifdef MADV_COLD
+    rb_define_const(mm_cMap, "MADV_COLD", INT2FIX(MADV_COLD));
+#endif
+#ifdef MADV_PAGEOUT
+    rb_define_const(mm_cMap, "MADV_PAGEOUT", INT2FIX(MADV_PAGEOUT));
+#endif
+#ifdef MADV_POPULATE_READ
+    rb_define_const(mm_cMap, "MADV_POPULATE_READ", INT2FIX(MADV_POPULATE_READ));
+#endif
+#ifdef MADV_POPULATE_WRITE
+    rb_define_const(mm_cMap, "MADV_POPULATE_WRITE", INT2FIX(MADV_POPULATE_WRITE));
+#endif
+#ifdef MADV_DONTFORK
+    rb_define_const(mm_cMap, "MADV_DONTFORK", INT2FIX(MADV_DONTFORK));
+#endif
+#ifdef MADV_DOFORK
+    rb_define_const(mm_cMap, "MADV_DOFORK", INT2FIX(MADV_DOFORK));
+#endif
+#ifdef F_SEAL_SEAL
+    rb_define_const(mm_cMap, "F_SEAL_SEAL", INT2FIX(F_SEAL_SEAL));
+    rb_define_const(mm_cMap, "F_SEAL_SHRINK", INT2FIX(F_SEAL_SHRINK));
+    rb_define_const(mm_cMap, "F_SEAL_GROW", INT2FIX(F_SEAL_GROW));
+    rb_define_const(mm_cMap, "F_SEAL_WRITE", INT2FIX(F_SEAL_WRITE));
+#endif
+#ifdef F_SEAL_FUTURE_WRITE
+    rb_define_const(mm_cMap, "F_SEAL_FUTURE_WRITE", INT2FIX(F_SEAL_FUTURE_WRITE));
+#endif
 #ifdef MAP_DENYWRITE
     rb_define_const(mm_cMap, "MAP_DENYWRITE", INT2FIX(MAP_DENYWRITE));
 #endif
@@ -2353,11 +8523,20 @@ Init_mmap(void)
     rb_define_method(mm_cMap, "msync", mm_msync, -1);
     rb_define_method(mm_cMap, "sync", mm_msync, -1);
     rb_define_method(mm_cMap, "flush", mm_msync, -1);
+    rb_define_method(mm_cMap, "flush_async", mm_flush_async, -1);
+    rb_define_method(mm_cMap, "dirty_ranges", mm_dirty_ranges, 0);
     rb_define_method(mm_cMap, "mprotect", mm_mprotect, 1);
     rb_define_method(mm_cMap, "protect", mm_mprotect, 1);
 #ifdef MADV_NORMAL
-    rb_define_method(mm_cMap, "madvise", mm_madvise, 1);
-    rb_define_method(mm_cMap, "advise", mm_madvise, 1);
+    rb_define_method(mm_cMap, "madvise", mm_madvise, -1);
+    rb_define_method(mm_cMap, "advise", mm_madvise, -1);
+#endif
+    rb_define_method(mm_cMap, "prefetch", mm_prefetch, -1);
+    rb_define_method(mm_cMap, "populate", mm_populate, -1);
+#if HAVE_MINCORE
+    rb_define_method(mm_cMap, "residency", mm_residency, -1);
+    rb_define_method(mm_cMap, "resident_ranges", mm_resident_ranges, -1);
+    rb_define_method(mm_cMap, "residency_bitmap", mm_residency_bitmap, -1);
 #endif
     rb_define_method(mm_cMap, "mlock", mm_mlock, 0);
     rb_define_method(mm_cMap, "lock", mm_mlock, 0);
@@ -2450,6 +8629,12 @@ Init_mmap(void)
     rb_define_method(mm_cMap, "delete", mm_undefined, -1);
     rb_define_method(mm_cMap, "squeeze", mm_undefined, -1);
     rb_define_method(mm_cMap, "count", mm_count, -1);
+    rb_define_method(mm_cMap, "count_byte", mm_count_byte, -1);
+    rb_define_method(mm_cMap, "line_count", mm_line_count, 0);
+    rb_define_method(mm_cMap, "build_line_index", mm_build_line_index, -1);
+    rb_define_method(mm_cMap, "line", mm_line, 1);
+    rb_define_method(mm_cMap, "lines", mm_lines, -1);
+    rb_define_method(mm_cMap, "batch", mm_batch, 0);
 
     rb_define_method(mm_cMap, "tr!", mm_tr_bang, 2);
     rb_define_method(mm_cMap, "tr_s!", mm_tr_s_bang, 2);
@@ -2465,5 +8650,103 @@ Init_mmap(void)
     rb_define_method(mm_cMap, "slice", mm_aref_m, -1);
     rb_define_method(mm_cMap, "slice!", mm_slice_bang, -1);
     rb_define_method(mm_cMap, "semlock", mm_semlock, -1);
+    rb_define_method(mm_cMap, "write_lock", mm_semlock, -1);
+    rb_define_method(mm_cMap, "read_lock", mm_read_lock, -1);
+    rb_define_method(mm_cMap, "lock_range", mm_lock_range, -1);
+    rb_define_method(mm_cMap, "get_u8", mm_get_u8, -1);
+    rb_define_method(mm_cMap, "get_i8", mm_get_i8, -1);
+    rb_define_method(mm_cMap, "get_u16", mm_get_u16, -1);
+    rb_define_method(mm_cMap, "get_i16", mm_get_i16, -1);
+    rb_define_method(mm_cMap, "get_u32", mm_get_u32, -1);
+    rb_define_method(mm_cMap, "get_i32", mm_get_i32, -1);
+    rb_define_method(mm_cMap, "get_u64", mm_get_u64, -1);
+    rb_define_method(mm_cMap, "get_i64", mm_get_i64, -1);
+    rb_define_method(mm_cMap, "get_f32", mm_get_f32, -1);
+    rb_define_method(mm_cMap, "get_f64", mm_get_f64, -1);
+    rb_define_method(mm_cMap, "put_u8", mm_put_u8, -1);
+    rb_define_method(mm_cMap, "put_i8", mm_put_i8, -1);
+    rb_define_method(mm_cMap, "put_u16", mm_put_u16, -1);
+    rb_define_method(mm_cMap, "put_i16", mm_put_i16, -1);
+    rb_define_method(mm_cMap, "put_u32", mm_put_u32, -1);
+    rb_define_method(mm_cMap, "put_i32", mm_put_i32, -1);
+    rb_define_method(mm_cMap, "put_u64", mm_put_u64, -1);
+    rb_define_method(mm_cMap, "put_i64", mm_put_i64, -1);
+    rb_define_method(mm_cMap, "put_f32", mm_put_f32, -1);
+    rb_define_method(mm_cMap, "put_f64", mm_put_f64, -1);
+    rb_define_method(mm_cMap, "array_view", mm_array_view, -1);
+    rb_define_method(mm_cMap, "records", mm_records_new, -1);
+#ifdef __ATOMIC_ACQ_REL
+    rb_define_method(mm_cMap, "log_init", mm_log_init, -1);
+    rb_define_method(mm_cMap, "log_append", mm_log_append, 1);
+    rb_define_method(mm_cMap, "log_each", mm_log_each, -1);
+    rb_define_method(mm_cMap, "atomic_load", mm_atomic_load, -1);
+    rb_define_method(mm_cMap, "atomic_store", mm_atomic_store, -1);
+    rb_define_method(mm_cMap, "atomic_add", mm_atomic_add, -1);
+    rb_define_method(mm_cMap, "compare_and_swap", mm_compare_and_swap, -1);
+#endif
     rb_define_method(mm_cMap, "ipc_key", mm_ipc_key, 0);
+    rb_define_singleton_method(mm_cMap, "from_fd", mm_s_from_fd, -1);
+    rb_define_method(mm_cMap, "to_io", mm_to_io, 0);
+#if HAVE_MEMFD_CREATE && defined(F_ADD_SEALS)
+    rb_define_method(mm_cMap, "seal", mm_seal, -1);
+    rb_define_method(mm_cMap, "seals", mm_seals, 0);
+#endif
+
+    mm_cFlush = rb_define_class_under(mm_cMap, "Flush", rb_cObject);
+    rb_undef_method(CLASS_OF(mm_cFlush), "new");
+    rb_define_method(mm_cFlush, "done?", mm_flush_done, 0);
+    rb_define_method(mm_cFlush, "wait", mm_flush_wait, 0);
+
+    mm_cBatch = rb_define_class_under(mm_cMap, "Batch", rb_cObject);
+    rb_undef_method(CLASS_OF(mm_cBatch), "new");
+    rb_define_method(mm_cBatch, "replace", mm_batch_replace, 3);
+    rb_define_method(mm_cBatch, "insert", mm_batch_insert, 2);
+    rb_define_method(mm_cBatch, "delete", mm_batch_delete, 2);
+    rb_define_method(mm_cBatch, "size", mm_batch_size, 0);
+
+    mm_cArrayView = rb_define_class_under(mm_cMap, "ArrayView", rb_cObject);
+    rb_undef_method(CLASS_OF(mm_cArrayView), "new");
+    rb_include_module(mm_cArrayView, rb_mEnumerable);
+    rb_define_method(mm_cArrayView, "[]", mm_aview_aref, 1);
+    rb_define_method(mm_cArrayView, "[]=", mm_aview_aset, 2);
+    rb_define_method(mm_cArrayView, "size", mm_aview_size, 0);
+    rb_define_method(mm_cArrayView, "length", mm_aview_size, 0);
+    rb_define_method(mm_cArrayView, "each", mm_aview_each, 0);
+    rb_define_method(mm_cArrayView, "to_a", mm_aview_to_a, 0);
+    rb_define_method(mm_cArrayView, "sum", mm_aview_sum, 0);
+    rb_define_method(mm_cArrayView, "mean", mm_aview_mean, 0);
+    rb_define_method(mm_cArrayView, "min", mm_aview_min, 0);
+    rb_define_method(mm_cArrayView, "max", mm_aview_max, 0);
+    rb_define_method(mm_cArrayView, "count", mm_aview_count, -1);
+    rb_define_method(mm_cArrayView, "histogram", mm_aview_histogram, -1);
+
+    mm_cLayout = rb_define_class_under(mm_cMap, "Layout", rb_cObject);
+    rb_undef_method(CLASS_OF(mm_cLayout), "new");
+    rb_define_singleton_method(mm_cLayout, "define", mm_layout_define, -1);
+    rb_define_method(mm_cLayout, "size", mm_layout_size, 0);
+    rb_define_method(mm_cLayout, "fields", mm_layout_fields, 0);
+    rb_define_method(mm_cLayout, "offset", mm_layout_offset, 1);
+
+    mm_cRecords = rb_define_class_under(mm_cMap, "Records", rb_cObject);
+    rb_undef_method(CLASS_OF(mm_cRecords), "new");
+    rb_define_method(mm_cRecords, "[]", mm_records_aref, -1);
+    rb_define_method(mm_cRecords, "[]=", mm_records_aset, 3);
+    rb_define_method(mm_cRecords, "column", mm_records_column, 1);
+    rb_define_method(mm_cRecords, "size", mm_records_size, 0);
+    rb_define_method(mm_cRecords, "length", mm_records_size, 0);
+    rb_define_method(mm_cRecords, "layout", mm_records_layout, 0);
+
+    mm_cWindow = rb_define_class_under(mm_cMap, "Window", rb_cObject);
+    rb_define_singleton_method(mm_cWindow, "new", mm_window_s_new, -1);
+    rb_define_method(mm_cWindow, "read", mm_window_read, -1);
+    rb_define_method(mm_cWindow, "gets", mm_window_gets, -1);
+    rb_define_method(mm_cWindow, "each_line", mm_window_each_line, -1);
+    rb_define_method(mm_cWindow, "each", mm_window_each_line, -1);
+    rb_define_method(mm_cWindow, "pos", mm_window_pos, 0);
+    rb_define_method(mm_cWindow, "pos=", mm_window_set_pos, 1);
+    rb_define_method(mm_cWindow, "seek", mm_window_set_pos, 1);
+    rb_define_method(mm_cWindow, "size", mm_window_size, 0);
+    rb_define_method(mm_cWindow, "eof?", mm_window_eof, 0);
+    rb_define_method(mm_cWindow, "window", mm_window_window, 0);
+    rb_define_method(mm_cWindow, "close", mm_window_close, 0);
 }
@@ -20,6 +20,8 @@ load "#{$pathmm}/test/runit_.rb"
 
 $mmap, $str = nil, nil
 
+PAGESIZE = 4096
+
 Inh = defined?(RUNIT) ? RUNIT : Test::Unit
 
 $pathmm = $LOAD_PATH.find {|p| File.exist?(p + "/mmap.c") }
@@ -372,6 +374,457 @@ class TestMmap < Inh::TestCase
 	 end
       end
    end
+
+   def test_15_growth
+      file = "#{$pathmm}/tmp/growth"
+      File.open(file, "w") {}
+      assert_kind_of(Mmap, m = Mmap.new(file, "rw", "growth" => 1.5), "new growth")
+      str = ""
+      1000.times do |i|
+	 [m, str].each {|l| l << "line #{i}\n" }
+      end
+      assert_equal(str, m.to_str, "growth")
+      assert_equal(str.size, m.size, "growth size")
+      assert_nil(m.munmap, "munmap")
+      assert_equal(str, File.read(file), "growth truncate")
+      assert_raises(ArgumentError) { Mmap.new(file, "rw", "growth" => 0.5) }
+   end
+
+   def test_16_flush
+      internal_init
+      $mmap[0, 5] = $str[0, 5] = "abcde"
+      assert_equal($mmap, $mmap.msync(0, 5), "msync range")
+      assert_equal($str, internal_read, "msync range")
+      $mmap[-5, 5] = $str[-5, 5] = "fghij"
+      assert_kind_of(Mmap::Flush, fl = $mmap.flush_async($mmap.size - 5, 5), "flush_async")
+      assert_equal(fl, fl.wait, "wait")
+      assert_equal(true, fl.done?, "done?")
+      assert_equal($str, internal_read, "flush_async")
+      assert_raises(IndexError) { $mmap.msync(0, -1) }
+   end
+
+   def test_17_dirty
+      internal_init
+      $mmap.msync
+      assert_equal([], $mmap.dirty_ranges, "dirty clean")
+      $mmap[10] = $str[10] = "x"
+      assert_equal([[0, PAGESIZE]], $mmap.dirty_ranges, "dirty one")
+      if $mmap.size > 3 * PAGESIZE
+	 pos = 3 * PAGESIZE + 1
+	 $mmap[pos, 1] = $str[pos, 1] = "y"
+	 assert_equal([[0, PAGESIZE], [3 * PAGESIZE, PAGESIZE]], 
+		      $mmap.dirty_ranges, "dirty two")
+      end
+      $mmap.msync
+      assert_equal([], $mmap.dirty_ranges, "dirty msync")
+      assert_equal($str, internal_read, "dirty msync")
+      assert_equal(true, $mmap.flush_async.done?, "flush_async clean")
+   end
+
+   def test_18_madvise
+      internal_init
+      if defined?(Mmap::MADV_WILLNEED)
+	 assert_nil($mmap.madvise(Mmap::MADV_WILLNEED, 0, PAGESIZE), "madvise range")
+	 assert_nil($mmap.madvise(Mmap::MADV_SEQUENTIAL), "madvise")
+	 assert_raises(IndexError) { $mmap.madvise(Mmap::MADV_NORMAL, 0, -1) }
+      end
+      if defined?(Mmap::MADV_COLD)
+	 assert_nil($mmap.madvise(Mmap::MADV_COLD, PAGESIZE), "madvise cold")
+      end
+      assert_equal($str, $mmap.to_str, "madvise")
+   end
+
+   def test_19_prefetch
+      internal_init
+      assert_equal($mmap, $mmap.prefetch, "prefetch")
+      assert_equal($mmap, $mmap.prefetch(0, PAGESIZE), "prefetch")
+      assert_equal($mmap, $mmap.prefetch(0 .. 12), "prefetch range")
+      $mmap.unmap
+      $mmap = Mmap.new("#{$pathmm}/tmp/mmap", "rw", "readahead" => PAGESIZE)
+      mmap = []; $mmap.each {|l| mmap << l}
+      str = []; $str.each {|l| str << l}
+      assert_equal(str, mmap, "<each readahead>")
+      mmap = []; $mmap.scan(/rb_\w+/) {|l| mmap << l}
+      assert_equal($str.scan(/rb_\w+/), mmap, "<scan readahead>")
+   end
+
+   def test_20_residency
+      internal_init
+      if $mmap.respond_to?(:residency)
+	 $mmap.to_str.sum
+	 assert_equal(1.0, $mmap.residency, "residency")
+	 pages = ($mmap.size + PAGESIZE - 1) / PAGESIZE
+	 assert_equal([[0, $mmap.size]], $mmap.resident_ranges, "resident_ranges")
+	 assert_equal([[PAGESIZE, $mmap.size - PAGESIZE]],
+		      $mmap.resident_ranges(PAGESIZE + 1), "resident_ranges")
+	 bitmap = $mmap.residency_bitmap
+	 assert_equal((pages + 7) / 8, bitmap.size, "residency_bitmap")
+	 assert_equal(pages, bitmap.unpack("b*")[0].count("1"), "residency_bitmap")
+      end
+   end
+
+   def test_21_search
+      internal_init
+      %w{rb_raise mm_ipc GetMmap Init_mmap a z zzzz}.each do |s|
+	 [0, 12, 1000, -1000, -1, $str.size, $str.size + 1].each do |pos|
+	    assert_equal($str.index(s, pos), $mmap.index(s, pos), "<index #{s} #{pos}>")
+	    assert_equal($str.rindex(s, pos), $mmap.rindex(s, pos), "<rindex #{s} #{pos}>")
+	 end
+	 assert_equal($str.include?(s), $mmap.include?(s), "<include? #{s}>")
+      end
+      assert_equal($str.index(""), $mmap.index(""), "<index empty>")
+      assert_equal($str.rindex(""), $mmap.rindex(""), "<rindex empty>")
+   end
+
+   def test_22_count
+      internal_init
+      assert_equal($str.count("\n"), $mmap.count("\n"), "<count>")
+      assert_equal($str.count("a-z"), $mmap.count("a-z"), "<count set>")
+      assert_equal($str.count("\n"), $mmap.count_byte(10), "<count_byte>")
+      assert_equal($str.count("e"), $mmap.count_byte("e"), "<count_byte>")
+      assert_equal($str[100, 1000].count("e"), $mmap.count_byte("e", 100, 1000), "<count_byte>")
+      assert_equal($str[100 .. 1000].count("e"), $mmap.count_byte("e", 100 .. 1000), "<count_byte>")
+      lines = 0; $str.each {|l| lines += 1}
+      assert_equal(lines, $mmap.line_count, "<line_count>")
+   end
+
+   def test_23_each_line
+      internal_init
+      lines = []; $str.each {|l| lines << l}
+      res = []; $mmap.each_line {|l| res << l}
+      assert_equal(lines, res, "<each_line>")
+      res = []; $mmap.each_line("\n", "chomp" => true) {|l| res << l}
+      assert_equal(lines.collect {|l| l.chomp}, res, "<each_line chomp>")
+      res = []; $mmap.each_line("\n", "offsets" => true) {|o, l| res << $str[o, l]}
+      assert_equal(lines, res, "<each_line offsets>")
+      res = []; $mmap.each_line("\n", "shared" => true) {|l| res << l.frozen?}
+      assert(res.all?, "<each_line shared>")
+      lines = []; $str.each("ab") {|l| lines << l}
+      res = []; $mmap.each_line("ab") {|l| res << l}
+      assert_equal(lines, res, "<each_line rs>")
+      if defined?(Enumerator)
+         assert_equal($str.each_line.to_a, $mmap.each_line.to_a, "<each_line enum>")
+      end
+   end
+
+   def test_24_line_index
+      internal_init
+      lines = []; $str.each {|l| lines << l}
+      assert_equal(lines.size, $mmap.build_line_index, "<build_line_index>")
+      assert_equal(lines[0], $mmap.line(0), "<line>")
+      assert_equal(lines[-1], $mmap.line(-1), "<line>")
+      assert_equal(nil, $mmap.line(lines.size), "<line>")
+      assert_equal(lines[10 .. 20], $mmap.lines(10 .. 20), "<lines>")
+      assert_equal(lines[10, 5], $mmap.lines(10, 5), "<lines>")
+      $mmap << "one\ntwo\n"
+      assert_equal("two\n", $mmap.line(-1), "<line extended>")
+      $mmap[0, 1] = "\n"
+      $str = $mmap.to_str.dup
+      lines = []; $str.each {|l| lines << l}
+      assert_equal(lines, $mmap.lines(0 .. -1), "<lines modified>")
+      assert_equal(lines.size, $mmap.build_line_index("#{$pathmm}/tmp/mmap.idx"), "<build_line_index path>")
+      assert_equal(lines.size, $mmap.build_line_index("#{$pathmm}/tmp/mmap.idx"), "<build_line_index reuse>")
+      assert_equal(lines[5], $mmap.line(5), "<line path>")
+      File.open("#{$pathmm}/tmp/lines", "w") {|f| f.write("a\nb\n") }
+      m = Mmap.new("#{$pathmm}/tmp/lines", "r")
+      assert_equal(2, m.build_line_index("#{$pathmm}/tmp/mmap.idx"), "<build_line_index other>")
+      assert_equal("b\n", m.line(1), "<line other>")
+      m.munmap
+      File.open("#{$pathmm}/tmp/lines", "w") {|f| f.write("a\n" * 5000) }
+      m = Mmap.new("#{$pathmm}/tmp/lines", "r")
+      assert_equal(5000, m.build_line_index("#{$pathmm}/tmp/mmap.idx"), "<build_line_index big>")
+      m.munmap
+      File.open("#{$pathmm}/tmp/lines", "r+") {|f| f.seek(5000); f.write("aa") }
+      m = Mmap.new("#{$pathmm}/tmp/lines", "r")
+      assert_equal(4999, m.build_line_index("#{$pathmm}/tmp/mmap.idx"), "<build_line_index rewritten>")
+      assert_equal("aaa\n", m.line(2500), "<line rewritten>")
+      m.munmap
+   end
+
+   def test_25_gsub
+      internal_init
+      [[/e/, "EEE"], [/[a-z]+/, "x"], [/\n/, "\r\n"], [/z*/, "-"]].each do |re, val|
+	 $str.gsub!(re, val)
+	 $mmap.gsub!(re, val)
+	 assert_equal($str, $mmap.to_str, "<gsub! #{re.inspect}>")
+      end
+      $str.gsub!(/x/) {|m| m * 3}
+      $mmap.gsub!(/x/) {|m| m * 3}
+      assert_equal($str, $mmap.to_str, "<gsub! block>")
+      assert_equal(nil, $mmap.gsub!(/not found/, ""), "<gsub! nil>")
+   end
+
+   def test_26_batch
+      internal_init
+      $mmap.batch do |b|
+	 b.replace(100, 10, "0123")
+	 b.insert(10, "inserted")
+	 b.delete(200, 50)
+	 b.insert(10, "again")
+	 assert_equal(4, b.size, "<batch size>")
+      end
+      $str[200, 50] = ""
+      $str[100, 10] = "0123"
+      $str[10, 0] = "insertedagain"
+      assert_equal($str, $mmap.to_str, "<batch>")
+      assert_raises(ArgumentError) do
+	 $mmap.batch {|b| b.delete(0, 10); b.replace(5, 1, "x") }
+      end
+      assert_equal($str, $mmap.to_str, "<batch overlap>")
+      $mmap.batch {|b| b.replace(20, 5, "R"); b.insert(20, "a"); b.insert(20, "b") }
+      $str[20, 5] = "abR"
+      assert_equal($str, $mmap.to_str, "<batch same offset>")
+   end
+
+   def test_27_semlock
+      internal_init
+      begin
+	 m = Mmap.new("#{$pathmm}/tmp/mmap", "rw", "ipc" => true)
+      rescue ArgumentError
+	 return
+      end
+      res = nil
+      m.semlock("timeout" => 0.5) { res = m[0, 10] }
+      assert_equal($str[0, 10], res, "<semlock timeout>")
+      m.semlock(false) { res = m[0, 10] }
+      assert_equal($str[0, 10], res, "<semlock nowait>")
+      m.read_lock { m.read_lock { res = m.index("e") } }
+      assert_equal($str.index("e"), res, "<read_lock>")
+      m.write_lock { m.read_lock { res = m[0, 10] } }
+      assert_equal($str[0, 10], res, "<write_lock>")
+      assert_raises(ThreadError) { m.read_lock { m.write_lock {} } }
+      order = []
+      th = nil
+      m.read_lock do
+	 th = Thread.new { m.write_lock { order << :write } }
+	 sleep 0.1
+	 order << :read
+      end
+      th.join
+      assert_equal([:read, :write], order, "<write_lock other thread>")
+      order = []
+      m.read_lock do
+	 th = Thread.new { m.write_lock { sleep 0.1; order << :write } }
+	 sleep 0.1
+	 th2 = Thread.new { m.read_lock { order << :reader } }
+	 sleep 0.1
+	 order << :read
+      end
+      th.join
+      th2.join
+      assert_equal([:read, :write, :reader], order, "<write_lock waiting writer>")
+      m.munmap
+   end
+
+   def test_28_lock_range
+      internal_init
+      begin
+	 assert_equal(12, $mmap.lock_range(0, 100) { 12 }, "<lock_range>")
+      rescue NotImplementedError
+	 return
+      end
+      $mmap.lock_range(0, 100) do
+	 assert_equal(1, $mmap.lock_range(100, 100, "wait" => false) { 1 }, "<lock_range disjoint>")
+	 if /linux/ =~ RUBY_PLATFORM
+	    assert_raises(Errno::EAGAIN) do
+	       $mmap.lock_range(50, 100, "wait" => false) {}
+	    end
+	 end
+      end
+      $mmap.lock_range(0, 100, "shared" => true) do
+	 assert_equal(2, $mmap.lock_range(0, 100, "shared" => true) { 2 }, "<lock_range shared>")
+      end
+   end
+
+   def test_29_log
+      return unless Mmap.method_defined?(:log_append)
+      File.open("#{$pathmm}/tmp/log", "w") {|f| f.write("\0" * 4096) }
+      m = Mmap.new("#{$pathmm}/tmp/log", "rw")
+      m.log_init
+      recs = %w{first second third}
+      recs.each {|r| m.log_append(r) }
+      res = []
+      off = m.log_each {|r, n| res << r }
+      assert_equal(recs, res, "<log_each>")
+      m.log_append("fourth")
+      res = []
+      m.log_each(off) {|r, n| res << r }
+      assert_equal(["fourth"], res, "<log_each offset>")
+      assert_raises(IndexError) { m.log_append("x" * 4096) }
+      m.munmap
+   end
+
+   def test_30_atomic
+      return unless Mmap.method_defined?(:atomic_add)
+      File.open("#{$pathmm}/tmp/atomic", "w") {|f| f.write("\0" * 64) }
+      m = Mmap.new("#{$pathmm}/tmp/atomic", "rw")
+      assert_equal(5, m.atomic_add(8, 5), "<atomic_add>")
+      assert_equal(3, m.atomic_add(8, -2), "<atomic_add>")
+      assert_equal(3, m.atomic_load(8), "<atomic_load>")
+      assert_equal(false, m.compare_and_swap(8, 4, 10), "<compare_and_swap>")
+      assert_equal(true, m.compare_and_swap(8, 3, 10), "<compare_and_swap>")
+      m.atomic_store(4, -1, 4)
+      assert_equal(-1, m.atomic_load(4, 4), "<atomic_store>")
+      assert_equal([10].pack("q"), m[8, 8], "<atomic bytes>")
+      assert_raises(ArgumentError) { m.atomic_add(3, 1) }
+      assert_raises(IndexError) { m.atomic_add(64, 1) }
+      assert_raises(RangeError) { m.atomic_store(4, 2 ** 31, 4) }
+      assert_equal(-1, m.atomic_load(4, 4), "<atomic_store range>")
+      m.munmap
+   end
+
+   def test_31_scalar
+      internal_init
+      assert_equal($str[10, 1].unpack("C")[0], $mmap.get_u8(10), "<get_u8>")
+      assert_equal($str[10, 2].unpack("v")[0], $mmap.get_u16(10, :little), "<get_u16>")
+      assert_equal($str[10, 4].unpack("N")[0], $mmap.get_u32(10, :big), "<get_u32>")
+      assert_equal($str[10, 8].unpack("q")[0], $mmap.get_i64(10), "<get_i64>")
+      $mmap.put_i32(20, -2, :big)
+      assert_equal([-2].pack("N"), $mmap[20, 4], "<put_i32>")
+      assert_equal(-2, $mmap.get_i32(20, :big), "<get_i32>")
+      $mmap.put_f64(24, 1.5)
+      assert_equal(1.5, $mmap.get_f64(24), "<get_f64>")
+      $mmap.put_u16(-2, 0x4142, :big)
+      assert_equal("AB", $mmap[-2, 2], "<put_u16>")
+      assert_raises(IndexError) { $mmap.get_u64($mmap.size - 4) }
+      assert_raises(RangeError) { $mmap.put_u8(0, 256) }
+      assert_raises(RangeError) { $mmap.put_i16(0, -0x8001) }
+      assert_raises(RangeError) { $mmap.put_u64(0, -1) }
+      $mmap.put_u32(20, 0xffffffff)
+      assert_equal(0xffffffff, $mmap.get_u32(20), "<put_u32 max>")
+   end
+
+   def test_32_array_view
+      internal_init
+      a = $str[0, $str.size / 4 * 4].unpack("l*")
+      v = $mmap.array_view(:int32)
+      assert_equal(a.size, v.size, "<size>")
+      assert_equal(a[3], v[3], "<aref>")
+      assert_equal(a[-1], v[-1], "<aref>")
+      assert_equal(a, v.to_a, "<to_a>")
+      assert_equal(a.inject(0) {|s, x| s + x }, v.sum, "<sum>")
+      assert_equal(a.min, v.min, "<min>")
+      assert_equal(a.max, v.max, "<max>")
+      assert_equal(a.select {|x| x > 0 }.size, v.count(:>, 0), "<count>")
+      h = v.histogram(4)
+      assert_equal(a.size, h.inject(0) {|s, x| s + x }, "<histogram>")
+      v[1] = -7
+      assert_equal([-7].pack("l"), $mmap[4, 4], "<aset>")
+      d = $mmap.array_view(:float64, 8, 2)
+      d[0] = 1.5
+      d[1] = 2.5
+      assert_equal(4.0, d.sum, "<float sum>")
+      assert_equal(2.0, d.mean, "<mean>")
+      assert_raises(ArgumentError) { $mmap.array_view(:int32, 2) }
+      b = v.to_a
+      assert_equal(b.select {|x| x < 2.5 }.size, v.count(:<, 2.5), "<count float>")
+      assert_equal(b.size, v.count(:<, 2 ** 40), "<count above>")
+      q = $mmap.array_view(:int64, 16, 2)
+      q[0] = 2 ** 53 + 1
+      q[1] = 2 ** 53
+      assert_equal(2 ** 53 + 1, q[0], "<aref int64>")
+      assert_equal(1, q.count(:>, 2 ** 53), "<count int64>")
+      assert_equal(1, q.count(:==, 2 ** 53 + 1), "<count int64>")
+      assert_raises(RangeError) { v[0] = 2 ** 31 }
+   end
+
+   def test_33_records
+      internal_init
+      layout = Mmap::Layout.define([[:id, :u32], [:score, :f32], [:name, [:bytes, 8]]])
+      assert_equal(16, layout.size, "<layout size>")
+      assert_equal([:id, :score, :name], layout.fields, "<fields>")
+      assert_equal(8, layout.offset(:name), "<offset>")
+      r = $mmap.records(layout)
+      assert_equal($str.size / 16, r.size, "<size>")
+      assert_equal($str[16, 4].unpack("L")[0], r[1, :id], "<aref>")
+      assert_equal($str[24, 8], r[1, :name], "<bytes>")
+      r[2, :id] = 12
+      r[2, :score] = 0.5
+      r[2, :name] = "abc"
+      assert_equal([12, 0.5, "abc\0\0\0\0\0"].pack("Lfa8"), $mmap[32, 16], "<aset>")
+      assert_equal({:id => 12, :score => 0.5, :name => "abc\0\0\0\0\0"}, r[2], "<record>")
+      assert_equal(12, r.column(:id)[8, 4].unpack("L")[0], "<column>")
+      assert_equal(r.size * 4, r.column(:score).size, "<column size>")
+      assert_raises(ArgumentError) { r[0, :unknown] }
+   end
+
+   def test_34_hugepages
+      m = Mmap.new(nil, 4096, "hugepages" => true)
+      assert_equal(4096, m.size, "<size>")
+      m[0, 3] = "abc"
+      assert_equal("abc", m[0, 3], "<write>")
+      m.munmap
+      m = Mmap.new(nil, 4096, "hugepages" => :transparent)
+      assert_equal(4096, m.size, "<transparent>")
+      m.munmap
+      assert_raises(ArgumentError) { Mmap.new(nil, 4096, "hugepages" => 3000) }
+   end
+
+   def test_35_populate
+      internal_init
+      assert_equal($mmap, $mmap.populate, "<populate>")
+      assert_equal($mmap, $mmap.populate(0..4095, "threads" => 2), "<range>")
+      assert_equal($mmap, $mmap.populate(0, 8192, "write" => true), "<write>")
+      m = Mmap.new(nil, 8192, "populate" => true)
+      m[0, 3] = "abc"
+      assert_equal("abc", m[0, 3], "<populate option>")
+      m.munmap
+      m = Mmap.new("#{$pathmm}/tmp/mmap", "r", "populate" => :read)
+      assert_equal($str, m.to_str, "<file>")
+      assert_raises(ArgumentError) { m.populate("write" => true) }
+      assert_raises(ArgumentError) do
+	 Mmap.new("#{$pathmm}/tmp/mmap", "r", "populate" => :write)
+      end
+   end
+
+   def test_36_window
+      internal_init
+      m = Mmap.new("#{$pathmm}/tmp/mmap", "r", "offset" => 1000, "length" => 3000)
+      assert_equal($str[1000, 3000], m.to_str, "<offset>")
+      m.munmap
+      m = Mmap.new("#{$pathmm}/tmp/mmap", "r", "offset" => 1001, "length" => 3000)
+      assert_equal($str[1004, 4].unpack("l")[0], m.array_view(:int32, 3)[0], "<unaligned view>")
+      assert_raises(ArgumentError) { m.array_view(:int32, 0) }
+      if m.respond_to?(:atomic_load)
+	 assert_equal($str[1008, 8].unpack("q")[0], m.atomic_load(7), "<unaligned atomic>")
+	 assert_raises(ArgumentError) { m.atomic_load(0) }
+      end
+      m.munmap
+      assert_raises(ArgumentError) do
+	 Mmap.new("#{$pathmm}/tmp/mmap", "r", "offset" => $str.size + 1)
+      end
+      w = Mmap::Window.new("#{$pathmm}/tmp/mmap", 4096)
+      assert_equal($str.size, w.size, "<size>")
+      assert_equal($str[0, 10], w.read(10), "<read>")
+      assert_equal(10, w.pos, "<pos>")
+      w.pos = 0
+      lines = []
+      w.each_line {|l| lines << l }
+      assert_equal($str.split(/^/), lines, "<each_line>")
+      assert(w.eof?, "<eof>")
+      w.pos = 5000
+      assert_equal($str[5000, 6000], w.read(6000), "<remap>")
+      w.close
+   end
+
+   def test_37_memfd
+      return unless Mmap.method_defined?(:seal)
+      m = Mmap.new(nil, 4096, "memfd" => "test")
+      m[0, 5] = "hello"
+      io = m.to_io
+      m2 = Mmap.from_fd(io, "rw")
+      assert_equal("hello", m2[0, 5], "<from_fd>")
+      m2[0, 1] = "j"
+      assert_equal("jello", m[0, 5], "<shared>")
+      m2.munmap
+      m.seal(:write, :shrink, :grow)
+      assert(m.frozen?, "<frozen>")
+      assert_equal(Mmap::F_SEAL_WRITE, m.seals & Mmap::F_SEAL_WRITE, "<seals>")
+      assert_raises(ArgumentError) { Mmap.from_fd(io, "rw") }
+      m3 = Mmap.from_fd(io.fileno)
+      assert_equal("jello", m3[0, 5], "<sealed>")
+      io.close
+   end
 end
 
 if defined?(RUNIT)